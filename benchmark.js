@@ -1,6 +1,10 @@
 'use strict'
 
 const benchmark = require('benchmark')
+const fs = require('fs')
+const path = require('path')
+const os = require('os')
+const Writable = require('stream').Writable
 const nodeXml = require('node-xml')
 let libxml = null
 const expat = require('./')
@@ -49,32 +53,370 @@ function LtxParser () {
   this.name = 'ltx'
 }
 
-const parsers = [
-  SaxParser,
-  NodeXmlParser,
-  ExpatParser,
-  LtxParser
-].map(function (Parser) {
-  return new Parser()
-})
-
-if (libxml) {
-  parsers.push(new LibXmlJsParser())
+// Usage: node benchmark.js [suite...]
+const suites = {}
+
+suites.parse = function () {
+  const parsers = [
+    SaxParser,
+    NodeXmlParser,
+    ExpatParser,
+    LtxParser
+  ].map(function (Parser) {
+    return new Parser()
+  })
+
+  if (libxml) {
+    parsers.push(new LibXmlJsParser())
+  }
+
+  const suite = new benchmark.Suite('parse')
+
+  parsers.forEach(function (parser) {
+    parser.parse('<r>')
+    suite.add(parser.name, function () {
+      parser.parse('<foo bar="baz">quux</foo>')
+    })
+  })
+  return suite
 }
 
-const suite = new benchmark.Suite('parse')
+// Whole-document parsing with listeners attached, per delivery mode
+suites.events = function () {
+  const doc = fs.readFileSync(path.join(__dirname, 'test', 'mystic-library.xml'))
+  const suite = new benchmark.Suite('events')
 
-parsers.forEach(function (parser) {
-  parser.parse('<r>')
-  suite.add(parser.name, function () {
-    parser.parse('<foo bar="baz">quux</foo>')
+  function add (name, options) {
+    suite.add(name, function () {
+      const parser = new expat.Parser('UTF-8', options)
+      let n = 0
+      parser.on('startElement', function (name, attrs) { n++ })
+      parser.on('endElement', function (name) { n++ })
+      parser.on('text', function (text) { n++ })
+      parser.parse(doc, true)
+      return n
+    })
+  }
+  add('node-expat', {})
+  add('node-expat batch', { batch: true })
+  return suite
+}
+
+// Reading every attribute of the attribute-heavy test document
+suites.attributes = function () {
+  const doc = fs.readFileSync(path.join(__dirname, 'test', 'mystic-library.xml'))
+  const suite = new benchmark.Suite('attributes')
+
+  function add (name, options, read) {
+    suite.add(name, function () {
+      const parser = new expat.Parser('UTF-8', options)
+      let n = 0
+      parser.on('startElement', function (name, attrs) { n += read(attrs) })
+      parser.parse(doc, true)
+      return n
+    })
+  }
+  function readObject (attrs) {
+    let n = 0
+    for (const key in attrs) {
+      n += attrs[key].length
+    }
+    return n
+  }
+  function readArray (attrs) {
+    let n = 0
+    for (let i = 1; i < attrs.length; i += 2) {
+      n += attrs[i].length
+    }
+    return n
+  }
+  function readLink (attrs) {
+    return attrs.link ? attrs.link.length : 0
+  }
+  add('node-expat object', { attributes: 'object' }, readObject)
+  add('node-expat array', { attributes: 'array' }, readArray)
+  add('node-expat lazy', { attributes: 'lazy' }, readObject)
+  add('node-expat object, one attribute', { attributes: 'object' }, readLink)
+  add('node-expat lazy, one attribute', { attributes: 'lazy' }, readLink)
+  return suite
+}
+
+// Many short streams, as on a server with connection churn
+suites.churn = function () {
+  const stanzas = '<stream:stream xmlns="jabber:client" xmlns:stream="http://etherx.jabber.org/streams">' +
+    '<message to="a@example.com" type="chat"><body>hi</body></message>'
+  const suite = new benchmark.Suite('churn')
+
+  function connection (parser) {
+    let n = 0
+    parser.on('startElement', function (name, attrs) { n++ })
+    parser.write(stanzas)
+    return n
+  }
+  suite.add('node-expat new parser', function () {
+    return connection(new expat.Parser('UTF-8'))
   })
-})
+  const pool = new expat.ParserPool('UTF-8')
+  suite.add('node-expat pool', function () {
+    const parser = pool.acquire()
+    const n = connection(parser)
+    pool.release(parser)
+    return n
+  })
+  suite.on('complete', function () {
+    console.log('pool hit rate ' + pool.getStats().hitRate.toFixed(4))
+  })
+  return suite
+}
 
-suite.on('cycle', function (event) {
-  console.log(event.target.toString())
-})
-  .on('complete', function () {
-    console.log('Fastest is ' + this.filter('fastest').map('name'))
+// Building a tree in JS from events versus natively
+suites.tree = function () {
+  const doc = fs.readFileSync(path.join(__dirname, 'test', 'mystic-library.xml'))
+  const suite = new benchmark.Suite('tree')
+
+  function buildTree (options) {
+    const parser = new expat.Parser('UTF-8', options)
+    const stack = [{}]
+    parser.on('startElement', function (name, attrs) {
+      const node = {}
+      for (const key in attrs) {
+        node['@' + key] = attrs[key]
+      }
+      node['#text'] = ''
+      stack.push(node)
+    })
+    parser.on('text', function (text) {
+      stack[stack.length - 1]['#text'] += text
+    })
+    parser.on('endElement', function (name) {
+      const node = stack.pop()
+      const parent = stack[stack.length - 1]
+      if (parent[name] === undefined) {
+        parent[name] = node
+      } else if (Array.isArray(parent[name])) {
+        parent[name].push(node)
+      } else {
+        parent[name] = [parent[name], node]
+      }
+    })
+    parser.parse(doc, true)
+    return stack[0]
+  }
+  suite.add('node-expat events', function () {
+    return buildTree({})
+  })
+  suite.add('node-expat batch events', function () {
+    return buildTree({ batch: true })
+  })
+  suite.add('node-expat parseToObject', function () {
+    return expat.parseToObject(doc)
   })
-  .run({ async: true })
+  return suite
+}
+
+// Many independent 2-20 KB documents, as on a SOAP or REST gateway:
+// a new Parser each on the main thread versus parseDocuments()
+suites.documents = function () {
+  const count = 1000
+  const docs = []
+  for (let i = 0; i < count; i++) {
+    const item = '<item id="' + i + '"><name>mystic</name><value>library &amp; more</value></item>'
+    docs.push(Buffer.from('<?xml version="1.0"?><envelope><body>' +
+      item.repeat(30 + (i * 37) % 270) + '</body></envelope>'))
+  }
+  const suite = new benchmark.Suite('documents')
+
+  suite.add('node-expat new Parser per document', function () {
+    docs.forEach(function (doc) {
+      const parser = new expat.Parser('UTF-8')
+      parser.on('startElement', function () {})
+      parser.on('text', function () {})
+      parser.parse(doc, true)
+    })
+  })
+  suite.add('node-expat parseDocuments events', {
+    defer: true,
+    fn: function (deferred) {
+      expat.parseDocuments(docs).then(function () {
+        deferred.resolve()
+      })
+    }
+  })
+  suite.add('node-expat parseDocuments tree', {
+    defer: true,
+    fn: function (deferred) {
+      expat.parseDocuments(docs, { output: 'tree' }).then(function () {
+        deferred.resolve()
+      })
+    }
+  })
+  suite.on('cycle', function (event) {
+    console.log('  ' + Math.round(event.target.hz * count) + ' documents/sec')
+  })
+  return suite
+}
+
+// Piping a file through the old Stream interface and through
+// ParserStream, and parsing it with parseFile() and parseFd(). Set
+// BENCHMARK_STREAM_MB to parse a larger file.
+suites.stream = function () {
+  const file = path.join(os.tmpdir(), 'node-expat-stream-benchmark.xml')
+  const megabytes = parseInt(process.env.BENCHMARK_STREAM_MB || '64', 10)
+  const record = '<record id="1"><name>mystic</name><value>library &amp; more</value></record>\n'
+  const out = fs.openSync(file, 'w')
+  const block = record.repeat(Math.ceil(65536 / record.length))
+  fs.writeSync(out, '<records>\n')
+  for (let i = 0; i < megabytes * 1048576 / block.length; i++) {
+    fs.writeSync(out, block)
+  }
+  fs.writeSync(out, '</records>\n')
+  fs.closeSync(out)
+  const suite = new benchmark.Suite('stream')
+  // Memory in use while parsing, sampled every 65536 events
+  let maxMemory = {}
+
+  function track (name) {
+    const usage = process.memoryUsage()
+    maxMemory[name] = Math.max(maxMemory[name] || 0, usage.heapUsed + usage.external)
+  }
+  suite.add('node-expat Stream', {
+    defer: true,
+    fn: function (deferred) {
+      const parser = new expat.Parser('UTF-8')
+      let n = 0
+      parser.on('startElement', function () {
+        if (++n % 65536 === 0) track('node-expat Stream')
+      })
+      parser.on('close', function () { deferred.resolve() })
+      fs.createReadStream(file).pipe(parser)
+    }
+  })
+  function piped (name, options) {
+    suite.add(name, {
+      defer: true,
+      fn: function (deferred) {
+        let n = 0
+        const consumer = new Writable({
+          objectMode: true,
+          highWaterMark: 64,
+          write: function (event, encoding, done) {
+            if (++n % 65536 === 0) track(name)
+            done()
+          }
+        })
+        consumer.on('finish', function () { deferred.resolve() })
+        fs.createReadStream(file)
+          .pipe(new expat.ParserStream('UTF-8', options))
+          .pipe(consumer)
+      }
+    })
+  }
+  piped('node-expat ParserStream', { events: ['startElement'] })
+  piped('node-expat ParserStream batch', { events: ['startElement'], batch: true })
+  suite.add('node-expat parseFile', {
+    defer: true,
+    fn: function (deferred) {
+      let n = 0
+      expat.parseFile(file, {
+        startElement: function () {
+          if (++n % 65536 === 0) track('node-expat parseFile')
+        }
+      }).then(function () {
+        deferred.resolve()
+      })
+    }
+  })
+  suite.add('node-expat parseFd', {
+    defer: true,
+    fn: function (deferred) {
+      const fd = fs.openSync(file, 'r')
+      let n = 0
+      expat.parseFd(fd, {
+        startElement: function () {
+          if (++n % 65536 === 0) track('node-expat parseFd')
+        }
+      }).then(function () {
+        fs.closeSync(fd)
+        deferred.resolve()
+      })
+    }
+  })
+  suite.on('complete', function () {
+    Object.keys(maxMemory).forEach(function (name) {
+      console.log(name + ' max heap + external ' + (maxMemory[name] / 1048576).toFixed(1) + ' MiB')
+    })
+    maxMemory = {}
+    fs.unlinkSync(file)
+  })
+  return suite
+}
+
+// One large document parsed by parseParallel() and parseRecords() on
+// 1 to 16 threads. Set BENCHMARK_PARALLEL_MB for a larger document.
+suites.parallel = function () {
+  const megabytes = parseInt(process.env.BENCHMARK_PARALLEL_MB || '32', 10)
+  const record = '<record id="1"><name>mystic</name><value>library &amp; more</value></record>\n'
+  const doc = Buffer.from('<records>' + record.repeat(megabytes * 1048576 / record.length) + '</records>')
+  const suite = new benchmark.Suite('parallel')
+
+  suite.add('node-expat parse', function () {
+    const parser = new expat.Parser('UTF-8')
+    parser.on('endElement', function () {})
+    parser.parse(doc, true)
+  })
+  const threadCounts = [1, 2, 4, 8, 16]
+  threadCounts.forEach(function (threads) {
+    suite.add('node-expat parseParallel ' + threads + ' threads', {
+      defer: true,
+      fn: function (deferred) {
+        const parser = new expat.Parser('UTF-8')
+        parser.on('endElement', function () {})
+        parser.parseParallel(doc, { threads }).then(function () {
+          deferred.resolve()
+        })
+      }
+    })
+  })
+  threadCounts.forEach(function (threads) {
+    suite.add('node-expat parseRecords ' + threads + ' threads', {
+      defer: true,
+      fn: function (deferred) {
+        const parser = new expat.Parser('UTF-8')
+        parser.on('endElement', function () {})
+        parser.parseRecords(doc, 'record', { threads }).then(function () {
+          deferred.resolve()
+        })
+      }
+    })
+  })
+  suite.add('node-expat parseRecords unordered', {
+    defer: true,
+    fn: function (deferred) {
+      const parser = new expat.Parser('UTF-8')
+      parser.on('endElement', function () {})
+      parser.parseRecords(doc, 'record', { ordered: false }).then(function () {
+        deferred.resolve()
+      })
+    }
+  })
+  return suite
+}
+
+function run (names) {
+  if (names.length === 0) {
+    return
+  }
+  const suite = suites[names[0]]()
+  console.log('# ' + names[0])
+  suite.on('cycle', function (event) {
+    console.log(event.target.toString())
+  })
+    .on('complete', function () {
+      console.log('Fastest is ' + this.filter('fastest').map('name'))
+      run(names.slice(1))
+    })
+    .run({ async: true })
+}
+
+const names = process.argv.slice(2)
+run(names.length > 0 ? names : Object.keys(suites))
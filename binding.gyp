@@ -1,4 +1,7 @@
 {
+  'variables': {
+    'node_module_version%': 0
+  },
   'targets': [
     {
       'target_name': 'node_expat',
@@ -9,6 +12,24 @@
       'cflags': [ "-Wno-cast-function-type" ],
       'dependencies': [
         'deps/libexpat/libexpat.gyp:expat'
+      ],
+      # The binding needs C++17 (std::string_view). Node 18 and later
+      # build addons as gnu++17 or newer, except with MSVC before Node 22;
+      # don't override a newer standard that V8's headers require.
+      'conditions': [
+        ['node_module_version < 108', {
+          'cflags_cc': [ '-std=c++17' ],
+          'xcode_settings': {
+            'CLANG_CXX_LANGUAGE_STANDARD': 'c++17'
+          }
+        }],
+        ['OS=="win" and node_module_version < 127', {
+          'msvs_settings': {
+            'VCCLCompilerTool': {
+              'AdditionalOptions': [ '/std:c++17' ]
+            }
+          }
+        }]
       ]
     }
   ]
@@ -787,6 +787,66 @@ XML_GetBuffer(XML_Parser parser, int len);
 XMLPARSEAPI(enum XML_Status)
 XML_ParseBuffer(XML_Parser parser, int len, int isFinal);
 
+/* Like XML_Parse, but parses s in place instead of copying it into the
+   parser's buffer. Input that cannot be parsed yet (a partial token at
+   the end of s) is not copied either, so s must stay valid and
+   unchanged until the next call on the parser. When the next chunk
+   arrives, only as much of it as is needed to complete that token is
+   copied. Any other call that adds input (XML_GetBuffer, XML_Parse)
+   first copies the pending bytes into the parser's buffer.
+
+   Once XML_ParseExternal returns, the parser holds no pointer into s
+   other than to that partial token: position queries such as
+   XML_GetCurrentLineNumber and XML_GetCurrentByteIndex work from the
+   parser's own state, also after a final chunk or an error. After an
+   error, XML_GetCurrentByteCount is 0 and XML_GetInputContext has no
+   context to show. Callers that free s before the next call must call
+   XML_ReleaseExternal first.
+   This is a node-expat extension.
+*/
+XMLPARSEAPI(enum XML_Status)
+XML_ParseExternal(XML_Parser parser, const char *s, int len, int isFinal);
+
+/* Copies input left over by XML_ParseExternal into the parser's
+   buffer, after which the caller's memory may go away. Returns
+   XML_STATUS_ERROR if that buffer can't be allocated.
+   This is a node-expat extension.
+*/
+XMLPARSEAPI(enum XML_Status)
+XML_ReleaseExternal(XML_Parser parser);
+
+/* Returns the number of input bytes that XML_Parse and
+   XML_ParseExternal copied into the parser's buffer so far.
+   This is a node-expat extension.
+*/
+XMLPARSEAPI(XML_Size)
+XML_GetCopiedByteCount(XML_Parser parser);
+
+typedef struct {
+  size_t bufferBytes;  /* input buffer and character data buffer */
+  size_t poolBytes;    /* temporary string pools, tag and attribute buffers */
+  size_t dtdBytes;     /* DTD string pools and hash tables */
+} XML_MemoryUsage;
+
+/* Fills in the bytes held by the parser's main allocations, as they
+   are currently sized. Hash table entries are counted at their
+   fixed size, without per-element default attribute arrays.
+   This is a node-expat extension.
+*/
+XMLPARSEAPI(void)
+XML_GetMemoryUsage(XML_Parser parser, XML_MemoryUsage *usage);
+
+/* Frees memory that the parser only keeps for reuse: the input buffer
+   beyond max(keep, unparsed input and context) bytes, cached tags,
+   namespace bindings and string pool blocks, and attribute arrays
+   grown by large start tags. Must not be called from within a
+   handler; does nothing while the parser is suspended. Returns the
+   number of bytes freed.
+   This is a node-expat extension.
+*/
+XMLPARSEAPI(size_t)
+XML_TrimMemory(XML_Parser parser, size_t keep);
+
 /* Stops parsing, causing XML_Parse() or XML_ParseBuffer() to return.
    Must be called from within a call-back handler, except when aborting
    (resumable = 0) an already suspended parser. Some call-backs may
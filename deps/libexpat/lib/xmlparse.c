@@ -103,12 +103,23 @@ typedef struct {
   KEY name;
 } NAMED;
 
+#ifdef XML_FAST_HASH_TABLE
+/* Number of recently found entries kept per table, a power of 2. */
+#define HASH_CACHE_SIZE 8
+#endif
+
 typedef struct {
   NAMED **v;
   unsigned char power;
   size_t size;
   size_t used;
   const XML_Memory_Handling_Suite *mem;
+#ifdef XML_FAST_HASH_TABLE
+  /* hash of v[i], so that probes and growth don't touch the keys */
+  unsigned long *hashes;
+  /* entries by key length and first and last character */
+  NAMED *cache[HASH_CACHE_SIZE];
+#endif
 } HASH_TABLE;
 
 static size_t
@@ -141,6 +152,8 @@ typedef struct {
 #define INIT_ATTS_VERSION 0xFFFFFFFF
 #define INIT_BLOCK_SIZE 1024
 #define INIT_BUFFER_SIZE 1024
+/* Initial number of bytes XML_ParseExternal copies to complete a token */
+#define EXTERNAL_BRIDGE_SIZE 64
 
 #define EXPAND_SPARE 24
 
@@ -405,6 +418,10 @@ copyEntityTable(XML_Parser oldParser,
                 HASH_TABLE *, STRING_POOL *, const HASH_TABLE *);
 static NAMED *
 lookup(XML_Parser parser, HASH_TABLE *table, KEY name, size_t createSize);
+#ifdef XML_FAST_HASH_TABLE
+static unsigned long FASTCALL
+hashLen(XML_Parser parser, KEY s, size_t len);
+#endif
 static void FASTCALL
 hashTableInit(HASH_TABLE *, const XML_Memory_Handling_Suite *ms);
 static void FASTCALL hashTableClear(HASH_TABLE *);
@@ -439,6 +456,8 @@ getElementType(XML_Parser parser, const ENCODING *enc,
 
 static unsigned long generate_hash_secret_salt(XML_Parser parser);
 static XML_Bool startParsing(XML_Parser parser);
+static XML_Bool copyInput(XML_Parser parser, const char *s, int len);
+static XML_Bool takeExternalInput(XML_Parser parser);
 
 static XML_Parser
 parserCreate(const XML_Char *encodingName,
@@ -476,6 +495,11 @@ struct XML_ParserStruct {
   const char *m_bufferLim;
   XML_Index m_parseEndByteIndex;
   const char *m_parseEndPtr;
+  /* unparsed input left by XML_ParseExternal, owned by the caller */
+  const char *m_externalPtr;
+  int m_externalLen;
+  /* input bytes copied into buffer by XML_Parse and XML_ParseExternal */
+  XML_Size m_copiedBytes;
   XML_Char *m_dataBuf;
   XML_Char *m_dataBufEnd;
   XML_StartElementHandler m_startElementHandler;
@@ -629,6 +653,9 @@ struct XML_ParserStruct {
 #define bufferEnd (parser->m_bufferEnd)
 #define parseEndByteIndex (parser->m_parseEndByteIndex)
 #define parseEndPtr (parser->m_parseEndPtr)
+#define externalPtr (parser->m_externalPtr)
+#define externalLen (parser->m_externalLen)
+#define copiedBytes (parser->m_copiedBytes)
 #define bufferLim (parser->m_bufferLim)
 #define dataBuf (parser->m_dataBuf)
 #define dataBufEnd (parser->m_dataBufEnd)
@@ -1025,6 +1052,9 @@ parserInit(XML_Parser parser, const XML_Char *encodingName)
   bufferEnd = buffer;
   parseEndByteIndex = 0;
   parseEndPtr = NULL;
+  externalPtr = NULL;
+  externalLen = 0;
+  copiedBytes = 0;
   declElementType = NULL;
   declAttributeId = NULL;
   declEntity = NULL;
@@ -1775,6 +1805,10 @@ XML_Parse(XML_Parser parser, const char *s, int len, int isFinal)
     ps_finalBuffer = (XML_Bool)isFinal;
     if (!isFinal)
       return XML_STATUS_OK;
+    if (!takeExternalInput(parser)) {
+      errorCode = XML_ERROR_NO_MEMORY;
+      return XML_STATUS_ERROR;
+    }
     positionPtr = bufferPtr;
     parseEndPtr = bufferEnd;
 
@@ -1864,6 +1898,7 @@ XML_Parse(XML_Parser parser, const char *s, int len, int isFinal)
         bufferLim = buffer + bytesToAllocate;
       }
       memcpy(buffer, end, nLeftOver);
+      copiedBytes += nLeftOver;
     }
     bufferPtr = buffer;
     bufferEnd = buffer + nLeftOver;
@@ -1880,11 +1915,390 @@ XML_Parse(XML_Parser parser, const char *s, int len, int isFinal)
       return XML_STATUS_ERROR;
     else {
       memcpy(buff, s, len);
+      copiedBytes += len;
       return XML_ParseBuffer(parser, len, isFinal);
     }
   }
 }
 
+/* Appends len bytes at s to the unparsed input in buffer. Unlike
+   XML_GetBuffer this also works while the parser is suspended, and
+   does not count the bytes into parseEndByteIndex.
+*/
+static XML_Bool
+copyInput(XML_Parser parser, const char *s, int len)
+{
+  enum XML_Parsing parsing = ps_parsing;
+  void *buff;
+
+  ps_parsing = XML_PARSING;
+  buff = XML_GetBuffer(parser, len);
+  ps_parsing = parsing;
+  if (buff == NULL)
+    return XML_FALSE;
+  memcpy(buff, s, len);
+  copiedBytes += len;
+  bufferEnd += len;
+  parseEndPtr = bufferEnd;
+  positionPtr = bufferPtr;
+  return XML_TRUE;
+}
+
+/* Moves input left over by XML_ParseExternal into buffer, before the
+   caller's memory may go away or other input gets appended. Left-over
+   bytes are only counted into parseEndByteIndex once they are here.
+*/
+static XML_Bool
+takeExternalInput(XML_Parser parser)
+{
+  const char *s = externalPtr;
+  int len = externalLen;
+
+  if (len == 0)
+    return XML_TRUE;
+  externalPtr = NULL;
+  externalLen = 0;
+  if (!copyInput(parser, s, len))
+    return XML_FALSE;
+  parseEndByteIndex += len;
+  eventPtr = eventEndPtr = bufferPtr;
+  return XML_TRUE;
+}
+
+/* Points everything at the empty buffer once XML_ParseExternal is done
+   with the caller's memory, so that no later position query reads it.
+   Before buffer is first allocated the pointers get a stand-in, which
+   keeps XML_GetCurrentByteIndex working.
+*/
+static void
+detachInput(XML_Parser parser)
+{
+  static const char noInput[1] = "";
+
+  bufferPtr = bufferEnd = buffer;
+  parseEndPtr = buffer ? buffer : noInput;
+  positionPtr = eventPtr = eventEndPtr = parseEndPtr;
+}
+
+enum XML_Status XMLCALL
+XML_ReleaseExternal(XML_Parser parser)
+{
+  if (parser == NULL)
+    return XML_STATUS_ERROR;
+  if (!takeExternalInput(parser)) {
+    errorCode = XML_ERROR_NO_MEMORY;
+    return XML_STATUS_ERROR;
+  }
+  return XML_STATUS_OK;
+}
+
+enum XML_Status XMLCALL
+XML_ParseExternal(XML_Parser parser, const char *s, int len, int isFinal)
+{
+  const char *end;
+  int bridge = EXTERNAL_BRIDGE_SIZE;
+  int nLeftOver;
+  enum XML_Status result;
+
+  if ((parser == NULL) || (len < 0) || ((s == NULL) && (len != 0))) {
+    errorCode = XML_ERROR_INVALID_ARGUMENT;
+    return XML_STATUS_ERROR;
+  }
+  if (len == 0 || ps_parsing == XML_SUSPENDED || ps_parsing == XML_FINISHED)
+    return XML_Parse(parser, s, len, isFinal);
+  if (!takeExternalInput(parser)) {
+    errorCode = XML_ERROR_NO_MEMORY;
+    return XML_STATUS_ERROR;
+  }
+
+  /* A token left over from the previous chunk is completed in buffer
+     with as little of s as possible. Once the remaining unparsed input
+     lies entirely within s, it is dropped from buffer and parsed in
+     place below.
+  */
+  while (bufferPtr != bufferEnd) {
+    int n = len < bridge ? len : bridge;
+    void *buff = XML_GetBuffer(parser, n);
+    if (buff == NULL)
+      return XML_STATUS_ERROR;
+    memcpy(buff, s, n);
+    copiedBytes += n;
+    result = XML_ParseBuffer(parser, n, isFinal && n == len);
+    s += n;
+    len -= n;
+    if (result == XML_STATUS_SUSPENDED && len > 0) {
+      if ((XML_Size)len > ((XML_Size)-1) / 2 - parseEndByteIndex
+          || !copyInput(parser, s, len)) {
+        errorCode = XML_ERROR_NO_MEMORY;
+        eventPtr = eventEndPtr = NULL;
+        processor = errorProcessor;
+        return XML_STATUS_ERROR;
+      }
+      parseEndByteIndex += len;
+    }
+    if (result != XML_STATUS_OK || len == 0)
+      return result;
+    nLeftOver = (int)(bufferEnd - bufferPtr);
+    if (nLeftOver <= n) {
+      s -= nLeftOver;
+      len += nLeftOver;
+      parseEndByteIndex -= nLeftOver;
+      bufferEnd -= nLeftOver;
+      parseEndPtr = bufferEnd;
+    }
+    else
+      bridge *= 2;
+  }
+
+  switch (ps_parsing) {
+  case XML_INITIALIZED:
+    if (parentParser == NULL && !startParsing(parser)) {
+      errorCode = XML_ERROR_NO_MEMORY;
+      return XML_STATUS_ERROR;
+    }
+  default:
+    ps_parsing = XML_PARSING;
+  }
+
+  /* Detect overflow (a+b > MAX <==> b > MAX-a) */
+  if ((XML_Size)len > ((XML_Size)-1) / 2 - parseEndByteIndex) {
+     errorCode = XML_ERROR_NO_MEMORY;
+     eventPtr = eventEndPtr = NULL;
+     processor = errorProcessor;
+     return XML_STATUS_ERROR;
+  }
+  parseEndByteIndex += len;
+  positionPtr = s;
+  ps_finalBuffer = (XML_Bool)isFinal;
+
+  errorCode = processor(parser, s, parseEndPtr = s + len, &end);
+
+  if (errorCode != XML_ERROR_NONE) {
+    /* Keep the position of the error, but not the pointer to it */
+    const char *at = eventPtr;
+    processor = errorProcessor;
+    if (at != NULL && at >= positionPtr && at <= parseEndPtr) {
+      XmlUpdatePosition(encoding, positionPtr, at, &position);
+      parseEndByteIndex -= (XML_Size)(parseEndPtr - at);
+      detachInput(parser);
+    }
+    else {
+      detachInput(parser);
+      eventPtr = eventEndPtr = NULL;
+    }
+    return XML_STATUS_ERROR;
+  }
+  switch (ps_parsing) {
+  case XML_SUSPENDED:
+    result = XML_STATUS_SUSPENDED;
+    break;
+  case XML_INITIALIZED:
+  case XML_PARSING:
+    if (isFinal)
+      ps_parsing = XML_FINISHED;
+    /* fall through */
+  default:
+    result = XML_STATUS_OK;
+  }
+
+  XmlUpdatePosition(encoding, positionPtr, end, &position);
+  nLeftOver = (int)(s + len - end);
+  detachInput(parser);
+  if (result == XML_STATUS_SUSPENDED) {
+    /* XML_ResumeParser only knows about buffer */
+    if (nLeftOver) {
+      if (!copyInput(parser, end, nLeftOver)) {
+        errorCode = XML_ERROR_NO_MEMORY;
+        eventPtr = eventEndPtr = NULL;
+        processor = errorProcessor;
+        return XML_STATUS_ERROR;
+      }
+      eventPtr = eventEndPtr = bufferPtr;
+    }
+  }
+  else {
+    /* Counted again once takeExternalInput copies it */
+    externalPtr = end;
+    externalLen = nLeftOver;
+    parseEndByteIndex -= nLeftOver;
+  }
+  return result;
+}
+
+XML_Size XMLCALL
+XML_GetCopiedByteCount(XML_Parser parser)
+{
+  if (parser == NULL)
+    return 0;
+  return copiedBytes;
+}
+
+static size_t
+poolMemory(const STRING_POOL *pool)
+{
+  size_t n = 0;
+  const BLOCK *b;
+  for (b = pool->blocks; b; b = b->next)
+    n += offsetof(BLOCK, s) + b->size * sizeof(XML_Char);
+  for (b = pool->freeBlocks; b; b = b->next)
+    n += offsetof(BLOCK, s) + b->size * sizeof(XML_Char);
+  return n;
+}
+
+static size_t
+tagListMemory(const TAG *tag)
+{
+  size_t n = 0;
+  for (; tag; tag = tag->parent)
+    n += sizeof(TAG) + (tag->bufEnd - tag->buf);
+  return n;
+}
+
+static size_t
+hashTableMemory(const HASH_TABLE *table, size_t entrySize)
+{
+#ifdef XML_FAST_HASH_TABLE
+  return table->size * (sizeof(NAMED *) + sizeof(unsigned long))
+         + table->used * entrySize;
+#else
+  return table->size * sizeof(NAMED *) + table->used * entrySize;
+#endif
+}
+
+void XMLCALL
+XML_GetMemoryUsage(XML_Parser parser, XML_MemoryUsage *usage)
+{
+  if (parser == NULL || usage == NULL)
+    return;
+  usage->bufferBytes = (bufferLim - buffer) + (dataBufEnd - dataBuf) * sizeof(XML_Char);
+  usage->poolBytes = poolMemory(&tempPool) + poolMemory(&temp2Pool)
+                 + tagListMemory(tagStack) + tagListMemory(freeTagList)
+                 + attsSize * sizeof(ATTRIBUTE);
+  if (nsAtts)
+    usage->poolBytes += ((size_t)1 << nsAttsPower) * sizeof(NS_ATT);
+  usage->dtdBytes = poolMemory(&_dtd->pool) + poolMemory(&_dtd->entityValuePool)
+               + hashTableMemory(&_dtd->generalEntities, sizeof(ENTITY))
+               + hashTableMemory(&_dtd->elementTypes, sizeof(ELEMENT_TYPE))
+               + hashTableMemory(&_dtd->attributeIds, sizeof(ATTRIBUTE_ID))
+               + hashTableMemory(&_dtd->prefixes, sizeof(PREFIX));
+#ifdef XML_DTD
+  usage->dtdBytes += hashTableMemory(&_dtd->paramEntities, sizeof(ENTITY));
+#endif /* XML_DTD */
+}
+
+static size_t
+poolTrim(STRING_POOL *pool)
+{
+  size_t n = 0;
+  while (pool->freeBlocks) {
+    BLOCK *b = pool->freeBlocks;
+    pool->freeBlocks = b->next;
+    n += offsetof(BLOCK, s) + b->size * sizeof(XML_Char);
+    pool->mem->free_fcn(b);
+  }
+  return n;
+}
+
+/* Moves the unparsed input, with up to XML_CONTEXT_BYTES of context,
+   into a buffer of newSize bytes, relocating the pointers into it */
+static XML_Bool
+shrinkBuffer(XML_Parser parser, const char *start, int newSize)
+{
+  char *newBuf = (char *)MALLOC(newSize);
+  if (newBuf == NULL)
+    return XML_FALSE;
+  memcpy(newBuf, start, bufferEnd - start);
+#define RELOCATE(ptr) \
+  if ((ptr) >= buffer && (ptr) <= bufferLim) \
+    (ptr) = newBuf + ((ptr) < start ? 0 : (ptr) - start)
+  RELOCATE(positionPtr);
+  RELOCATE(eventPtr);
+  RELOCATE(eventEndPtr);
+  RELOCATE(parseEndPtr);
+  RELOCATE(bufferPtr);
+  RELOCATE(bufferEnd);
+#undef RELOCATE
+  FREE(buffer);
+  buffer = newBuf;
+  bufferLim = newBuf + newSize;
+  return XML_TRUE;
+}
+
+size_t XMLCALL
+XML_TrimMemory(XML_Parser parser, size_t keep)
+{
+  size_t freed = 0;
+
+  if (parser == NULL || ps_parsing == XML_SUSPENDED)
+    return 0;
+
+  /* Input buffer */
+  if (buffer && (size_t)(bufferLim - buffer) > keep) {
+    const char *start = bufferPtr;
+    size_t needed;
+#ifdef XML_CONTEXT_BYTES
+    if (start - buffer > XML_CONTEXT_BYTES)
+      start -= XML_CONTEXT_BYTES;
+    else
+      start = buffer;
+#endif  /* defined XML_CONTEXT_BYTES */
+    needed = bufferEnd - start;
+    if (needed < keep)
+      needed = keep;
+    if (needed < INIT_BUFFER_SIZE)
+      needed = INIT_BUFFER_SIZE;
+    if (needed < (size_t)(bufferLim - buffer)) {
+      size_t oldSize = bufferLim - buffer;
+      if (shrinkBuffer(parser, start, (int)needed))
+        freed += oldSize - needed;
+    }
+  }
+
+  /* Cached tags, namespace bindings and string pool blocks */
+  while (freeTagList) {
+    TAG *tag = freeTagList;
+    freeTagList = tag->parent;
+    freed += sizeof(TAG) + (tag->bufEnd - tag->buf);
+    FREE(tag->buf);
+    FREE(tag);
+  }
+  while (freeBindingList) {
+    BINDING *b = freeBindingList;
+    freeBindingList = b->nextTagBinding;
+    freed += sizeof(BINDING) + b->uriAlloc * sizeof(XML_Char);
+    FREE(b->uri);
+    FREE(b);
+  }
+  freed += poolTrim(&tempPool);
+  freed += poolTrim(&temp2Pool);
+
+  /* Attribute arrays grow with the largest start tag seen */
+  if (attsSize > INIT_ATTS_SIZE) {
+    ATTRIBUTE *temp = (ATTRIBUTE *)REALLOC((void *)atts, INIT_ATTS_SIZE * sizeof(ATTRIBUTE));
+#ifdef XML_ATTR_INFO
+    XML_AttrInfo *temp2 = NULL;
+    if (temp != NULL) {
+      atts = temp;
+      temp2 = (XML_AttrInfo *)REALLOC((void *)attInfo, INIT_ATTS_SIZE * sizeof(XML_AttrInfo));
+      if (temp2 != NULL)
+        attInfo = temp2;
+    }
+    if (temp != NULL && temp2 != NULL) {
+      freed += (attsSize - INIT_ATTS_SIZE) * (sizeof(ATTRIBUTE) + sizeof(XML_AttrInfo));
+      attsSize = INIT_ATTS_SIZE;
+    }
+#else
+    if (temp != NULL) {
+      atts = temp;
+      freed += (attsSize - INIT_ATTS_SIZE) * sizeof(ATTRIBUTE);
+      attsSize = INIT_ATTS_SIZE;
+    }
+#endif
+  }
+
+  return freed;
+}
+
 enum XML_Status XMLCALL
 XML_ParseBuffer(XML_Parser parser, int len, int isFinal)
 {
@@ -1961,6 +2375,10 @@ XML_GetBuffer(XML_Parser parser, int len)
     return NULL;
   default: ;
   }
+  if (!takeExternalInput(parser)) {
+    errorCode = XML_ERROR_NO_MEMORY;
+    return NULL;
+  }
 
   if (len > bufferLim - bufferEnd) {
 #ifdef XML_CONTEXT_BYTES
@@ -3243,11 +3661,13 @@ storeAtts(XML_Parser parser, const ENCODING *enc,
         ATTRIBUTE_ID *id;
         const BINDING *b;
         unsigned long uriHash;
+#ifndef XML_FAST_HASH_TABLE
         struct siphash sip_state;
         struct sipkey sip_key;
 
         copy_salt_to_sipkey(parser, &sip_key);
         sip24_init(&sip_state, &sip_key);
+#endif
 
         ((XML_Char *)s)[-1] = 0;  /* clear flag */
         id = (ATTRIBUTE_ID *)lookup(parser, &dtd->attributeIds, s, 0);
@@ -3263,19 +3683,29 @@ storeAtts(XML_Parser parser, const ENCODING *enc,
             return XML_ERROR_NO_MEMORY;
         }
 
+#ifndef XML_FAST_HASH_TABLE
         sip24_update(&sip_state, b->uri, b->uriLen * sizeof(XML_Char));
+#endif
 
         while (*s++ != XML_T(ASCII_COLON))
           ;
 
+#ifndef XML_FAST_HASH_TABLE
         sip24_update(&sip_state, s, keylen(s) * sizeof(XML_Char));
+#endif
 
         do {  /* copies null terminator */
           if (!poolAppendChar(&tempPool, *s))
             return XML_ERROR_NO_MEMORY;
         } while (*s++);
 
+#ifdef XML_FAST_HASH_TABLE
+        /* the expanded name, without its null terminator */
+        uriHash = hashLen(parser, poolStart(&tempPool),
+                          poolLength(&tempPool) - 1);
+#else
         uriHash = (unsigned long)sip24_final(&sip_state);
+#endif
 
         { /* Check hash table for duplicate of expanded name (uriName).
              Derived from code in lookup(parser, HASH_TABLE *table, ...).
@@ -6332,6 +6762,125 @@ copy_salt_to_sipkey(XML_Parser parser, struct sipkey * key)
   key->k[1] = get_hash_secret_salt(parser);
 }
 
+#ifdef XML_FAST_HASH_TABLE
+
+/* Hashing with SipHash-1-3 keeps the table keyed by the per-parser salt,
+   so that colliding names can't be precomputed, at about half the cost
+   of SipHash-2-4.  The hash of each entry is kept next to it, and a
+   small cache catches the few names that a document repeats, without
+   hashing them at all.
+*/
+
+#define HASH_CACHE_INDEX(name, len) \
+  (((len) + 3 * (size_t)(name)[0] + ((len) ? (size_t)(name)[(len) - 1] : 0)) \
+   & (HASH_CACHE_SIZE - 1))
+
+static unsigned long FASTCALL
+hashLen(XML_Parser parser, KEY s, size_t len)
+{
+  struct sipkey key;
+  (void)sip_tobin;
+  (void)sip24_valid;
+  copy_salt_to_sipkey(parser, &key);
+  return (unsigned long)siphash13(s, len * sizeof(XML_Char), &key);
+}
+
+static NAMED *
+lookup(XML_Parser parser, HASH_TABLE *table, KEY name, size_t createSize)
+{
+  size_t i;
+  size_t len = keylen(name);
+  NAMED **cached = &table->cache[HASH_CACHE_INDEX(name, len)];
+  unsigned long h;
+  unsigned long mask;
+  unsigned char step = 0;
+  if (*cached && keyeq(name, (*cached)->name))
+    return *cached;
+  if (table->size == 0) {
+    if (!createSize)
+      return NULL;
+    table->power = INIT_POWER;
+    /* table->size is a power of 2 */
+    table->size = (size_t)1 << INIT_POWER;
+    table->v = (NAMED **)table->mem->malloc_fcn(table->size * sizeof(NAMED *));
+    table->hashes = (unsigned long *)table->mem->malloc_fcn(
+        table->size * sizeof(unsigned long));
+    if (!table->v || !table->hashes) {
+      table->mem->free_fcn(table->v);
+      table->mem->free_fcn(table->hashes);
+      table->v = NULL;
+      table->hashes = NULL;
+      table->size = 0;
+      return NULL;
+    }
+    memset(table->v, 0, table->size * sizeof(NAMED *));
+  }
+  h = hashLen(parser, name, len);
+  mask = (unsigned long)table->size - 1;
+  i = h & mask;
+  while (table->v[i]) {
+    if (table->hashes[i] == h && keyeq(name, table->v[i]->name))
+      return *cached = table->v[i];
+    if (!step)
+      step = PROBE_STEP(h, mask, table->power);
+    i < step ? (i += table->size - step) : (i -= step);
+  }
+  if (!createSize)
+    return NULL;
+
+  /* check for overflow (table is half full) */
+  if (table->used >> (table->power - 1)) {
+    unsigned char newPower = table->power + 1;
+    size_t newSize = (size_t)1 << newPower;
+    unsigned long newMask = (unsigned long)newSize - 1;
+    NAMED **newV = (NAMED **)table->mem->malloc_fcn(newSize * sizeof(NAMED *));
+    unsigned long *newHashes = (unsigned long *)table->mem->malloc_fcn(
+        newSize * sizeof(unsigned long));
+    if (!newV || !newHashes) {
+      table->mem->free_fcn(newV);
+      table->mem->free_fcn(newHashes);
+      return NULL;
+    }
+    memset(newV, 0, newSize * sizeof(NAMED *));
+    for (i = 0; i < table->size; i++)
+      if (table->v[i]) {
+        unsigned long oldHash = table->hashes[i];
+        size_t j = oldHash & newMask;
+        step = 0;
+        while (newV[j]) {
+          if (!step)
+            step = PROBE_STEP(oldHash, newMask, newPower);
+          j < step ? (j += newSize - step) : (j -= step);
+        }
+        newV[j] = table->v[i];
+        newHashes[j] = oldHash;
+      }
+    table->mem->free_fcn(table->v);
+    table->mem->free_fcn(table->hashes);
+    table->v = newV;
+    table->hashes = newHashes;
+    table->power = newPower;
+    table->size = newSize;
+    i = h & newMask;
+    step = 0;
+    while (table->v[i]) {
+      if (!step)
+        step = PROBE_STEP(h, newMask, newPower);
+      i < step ? (i += newSize - step) : (i -= step);
+    }
+  }
+  table->v[i] = (NAMED *)table->mem->malloc_fcn(createSize);
+  if (!table->v[i])
+    return NULL;
+  memset(table->v[i], 0, createSize);
+  table->v[i]->name = name;
+  table->hashes[i] = h;
+  (table->used)++;
+  return *cached = table->v[i];
+}
+
+#else /* not XML_FAST_HASH_TABLE */
+
 static unsigned long FASTCALL
 hash(XML_Parser parser, KEY s)
 {
@@ -6339,6 +6888,7 @@ hash(XML_Parser parser, KEY s)
   struct sipkey key;
   (void)sip_tobin;
   (void)sip24_valid;
+  (void)siphash13;
   copy_salt_to_sipkey(parser, &key);
   sip24_init(&state, &key);
   sip24_update(&state, s, keylen(s) * sizeof(XML_Char));
@@ -6424,6 +6974,8 @@ lookup(XML_Parser parser, HASH_TABLE *table, KEY name, size_t createSize)
   return table->v[i];
 }
 
+#endif /* not XML_FAST_HASH_TABLE */
+
 static void FASTCALL
 hashTableClear(HASH_TABLE *table)
 {
@@ -6433,6 +6985,9 @@ hashTableClear(HASH_TABLE *table)
     table->v[i] = NULL;
   }
   table->used = 0;
+#ifdef XML_FAST_HASH_TABLE
+  memset(table->cache, 0, sizeof(table->cache));
+#endif
 }
 
 static void FASTCALL
@@ -6442,6 +6997,9 @@ hashTableDestroy(HASH_TABLE *table)
   for (i = 0; i < table->size; i++)
     table->mem->free_fcn(table->v[i]);
   table->mem->free_fcn(table->v);
+#ifdef XML_FAST_HASH_TABLE
+  table->mem->free_fcn(table->hashes);
+#endif
 }
 
 static void FASTCALL
@@ -6452,6 +7010,10 @@ hashTableInit(HASH_TABLE *p, const XML_Memory_Handling_Suite *ms)
   p->used = 0;
   p->v = NULL;
   p->mem = ms;
+#ifdef XML_FAST_HASH_TABLE
+  p->hashes = NULL;
+  memset(p->cache, 0, sizeof(p->cache));
+#endif
 }
 
 static void FASTCALL
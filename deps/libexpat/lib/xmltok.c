@@ -186,6 +186,17 @@ struct normal_encoding {
   int (PTRFASTCALL *isInvalid2)(const ENCODING *, const char *);
   int (PTRFASTCALL *isInvalid3)(const ENCODING *, const char *);
   int (PTRFASTCALL *isInvalid4)(const ENCODING *, const char *);
+  char plainScan;
+};
+
+/* Values of plainScan: whether runs of plain ASCII data may be skipped
+   a vector at a time, and whether bytes >= 0x80 are plain as well, or
+   plain once validated as UTF-8. */
+enum {
+  PLAIN_SCAN_NONE,
+  PLAIN_SCAN_ASCII,
+  PLAIN_SCAN_LATIN1,
+  PLAIN_SCAN_UTF8
 };
 
 #define AS_NORMAL_ENCODING(enc)   ((const struct normal_encoding *) (enc))
@@ -301,6 +312,338 @@ sb_charMatches(const ENCODING *enc, const char *p, int c)
 #define CHAR_MATCHES(enc, p, c) (*(p) == c)
 #endif
 
+#if !defined(XML_NO_SIMD) && defined(__x86_64__) \
+    && (defined(__clang__) \
+        || (defined(__GNUC__) \
+            && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))))
+#define XML_SIMD_X86 1
+#endif
+
+#ifdef XML_SIMD_X86
+
+#include <immintrin.h>
+
+/* Vector scanners for runs of plain data.  They return a pointer to
+   the first byte below low other than except, to the first byte equal
+   to c1, c2 or c3, or to where less than a vector is left before end;
+   the scalar loop of the tokenizer takes over from there.  In
+   PLAIN_SCAN_ASCII mode bytes >= 0x80 stop the scan, since they start
+   characters that the tokenizer has to check.  Pass except == low to
+   stop at every byte below low.
+*/
+
+static const char *
+scanPlainSse2(int mode, const char *ptr, const char *end,
+              char low, char except, char c1, char c2, char c3)
+{
+  const __m128i vLow = _mm_set1_epi8(low);
+  const __m128i vExcept = _mm_set1_epi8(except);
+  const __m128i v1 = _mm_set1_epi8(c1);
+  const __m128i v2 = _mm_set1_epi8(c2);
+  const __m128i v3 = _mm_set1_epi8(c3);
+  const __m128i vZero = _mm_setzero_si128();
+  const __m128i vHigh = mode == PLAIN_SCAN_LATIN1
+                        ? _mm_set1_epi8(-1) : _mm_setzero_si128();
+  for (; end - ptr >= 16; ptr += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)ptr);
+    /* signed: bytes >= 0x80 compare below low */
+    __m128i plain = _mm_or_si128(_mm_cmpeq_epi8(v, vExcept),
+                                 _mm_and_si128(_mm_cmplt_epi8(v, vZero),
+                                               vHigh));
+    __m128i stop = _mm_andnot_si128(plain, _mm_cmplt_epi8(v, vLow));
+    int mask;
+    stop = _mm_or_si128(stop, _mm_cmpeq_epi8(v, v1));
+    stop = _mm_or_si128(stop, _mm_cmpeq_epi8(v, v2));
+    stop = _mm_or_si128(stop, _mm_cmpeq_epi8(v, v3));
+    mask = _mm_movemask_epi8(stop);
+    if (mask)
+      return ptr + __builtin_ctz(mask);
+  }
+  return ptr;
+}
+
+__attribute__((target("avx2")))
+static const char *
+scanPlainAvx2(int mode, const char *ptr, const char *end,
+              char low, char except, char c1, char c2, char c3)
+{
+  const __m256i vLow = _mm256_set1_epi8(low);
+  const __m256i vExcept = _mm256_set1_epi8(except);
+  const __m256i v1 = _mm256_set1_epi8(c1);
+  const __m256i v2 = _mm256_set1_epi8(c2);
+  const __m256i v3 = _mm256_set1_epi8(c3);
+  const __m256i vZero = _mm256_setzero_si256();
+  const __m256i vHigh = mode == PLAIN_SCAN_LATIN1
+                        ? _mm256_set1_epi8(-1) : _mm256_setzero_si256();
+  for (; end - ptr >= 32; ptr += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)ptr);
+    __m256i plain = _mm256_or_si256(_mm256_cmpeq_epi8(v, vExcept),
+                                    _mm256_and_si256(_mm256_cmpgt_epi8(vZero, v),
+                                                     vHigh));
+    __m256i stop = _mm256_andnot_si256(plain, _mm256_cmpgt_epi8(vLow, v));
+    unsigned mask;
+    stop = _mm256_or_si256(stop, _mm256_cmpeq_epi8(v, v1));
+    stop = _mm256_or_si256(stop, _mm256_cmpeq_epi8(v, v2));
+    stop = _mm256_or_si256(stop, _mm256_cmpeq_epi8(v, v3));
+    mask = (unsigned)_mm256_movemask_epi8(stop);
+    if (mask)
+      return ptr + __builtin_ctz(mask);
+  }
+  return scanPlainSse2(mode, ptr, end, low, except, c1, c2, c3);
+}
+
+/* UTF-8 is validated a vector at a time with the lookup tables of
+   Keiser and Lemire, "Validating UTF-8 In Less Than One Instruction
+   Per Byte": the high and low nibble of a byte and the high nibble of
+   the byte following it each select the errors that they may take
+   part in, and an error is left where all three agree.  In addition,
+   expat rejects U+FFFE and U+FFFF (EF BF BE and EF BF BF).
+
+   The scanners may only stop where the scalar loop can take over, so
+   they never stop inside a character: when a vector holds an error, or
+   when less than a vector is left, they back up to the start of the
+   last character that does not end before the vector, and the scalar
+   loop finds the error at its exact position.
+*/
+
+#define UTF8_TOO_SHORT 0x01
+#define UTF8_TOO_LONG 0x02
+#define UTF8_OVERLONG_3 0x04
+#define UTF8_TOO_LARGE 0x08
+#define UTF8_SURROGATE 0x10
+#define UTF8_OVERLONG_2 0x20
+#define UTF8_TOO_LARGE_1000 0x40
+#define UTF8_OVERLONG_4 0x40
+#define UTF8_TWO_CONTS 0x80
+#define UTF8_CARRY (UTF8_TOO_SHORT | UTF8_TOO_LONG | UTF8_TWO_CONTS)
+
+#define UTF8_BYTE_1_HIGH \
+  UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, \
+  UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, \
+  UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS, \
+  UTF8_TOO_SHORT | UTF8_OVERLONG_2, \
+  UTF8_TOO_SHORT, \
+  UTF8_TOO_SHORT | UTF8_OVERLONG_3 | UTF8_SURROGATE, \
+  UTF8_TOO_SHORT | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4
+
+#define UTF8_BYTE_1_LOW \
+  UTF8_CARRY | UTF8_OVERLONG_3 | UTF8_OVERLONG_2 | UTF8_OVERLONG_4, \
+  UTF8_CARRY | UTF8_OVERLONG_2, \
+  UTF8_CARRY, \
+  UTF8_CARRY, \
+  UTF8_CARRY | UTF8_TOO_LARGE, \
+  UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000, \
+  UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000, \
+  UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000, \
+  UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000, \
+  UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000, \
+  UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000, \
+  UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000, \
+  UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000, \
+  UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_SURROGATE, \
+  UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000, \
+  UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000
+
+#define UTF8_BYTE_2_HIGH \
+  UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, \
+  UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, \
+  UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3 \
+    | UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4, \
+  UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3 \
+    | UTF8_TOO_LARGE, \
+  UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE \
+    | UTF8_TOO_LARGE, \
+  UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE \
+    | UTF8_TOO_LARGE, \
+  UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT
+
+/* ptr follows validated input that starts at a character boundary at
+   start; back up to the lead byte of a character that isn't complete
+   before ptr. */
+static const char *
+utf8Boundary(const char *start, const char *ptr)
+{
+  const char *p = ptr;
+  int trail = 0;
+  unsigned char lead;
+  while (p > start && trail < 3 && ((unsigned char)p[-1] & 0xC0) == 0x80) {
+    p--;
+    trail++;
+  }
+  if (p == start)
+    return ptr;
+  lead = (unsigned char)p[-1];
+  if (lead >= 0xF0 ? trail < 3 : lead >= 0xE0 ? trail < 2 : lead >= 0xC0 ? trail < 1 : 0)
+    return p - 1;
+  return ptr;
+}
+
+__attribute__((target("ssse3")))
+static const char *
+scanUtf8Ssse3(const char *ptr, const char *end,
+              char low, char except, char c1, char c2, char c3)
+{
+  const char *start = ptr;
+  const __m128i byte1High = _mm_setr_epi8(UTF8_BYTE_1_HIGH);
+  const __m128i byte1Low = _mm_setr_epi8(UTF8_BYTE_1_LOW);
+  const __m128i byte2High = _mm_setr_epi8(UTF8_BYTE_2_HIGH);
+  const __m128i vNibble = _mm_set1_epi8(0x0F);
+  const __m128i vLow = _mm_set1_epi8(low);
+  const __m128i vExcept = _mm_set1_epi8(except);
+  const __m128i v1 = _mm_set1_epi8(c1);
+  const __m128i v2 = _mm_set1_epi8(c2);
+  const __m128i v3 = _mm_set1_epi8(c3);
+  const __m128i vZero = _mm_setzero_si128();
+  __m128i prev = vZero;
+  for (; end - ptr >= 16; ptr += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)ptr);
+    __m128i plain = _mm_or_si128(_mm_cmpeq_epi8(v, vExcept),
+                                 _mm_cmplt_epi8(v, vZero));
+    __m128i stop = _mm_andnot_si128(plain, _mm_cmplt_epi8(v, vLow));
+    int stopMask, errorMask = 0;
+    stop = _mm_or_si128(stop, _mm_cmpeq_epi8(v, v1));
+    stop = _mm_or_si128(stop, _mm_cmpeq_epi8(v, v2));
+    stop = _mm_or_si128(stop, _mm_cmpeq_epi8(v, v3));
+    stopMask = _mm_movemask_epi8(stop);
+    if (_mm_movemask_epi8(_mm_or_si128(v, prev))) {
+      __m128i prev1 = _mm_alignr_epi8(v, prev, 15);
+      __m128i prev2 = _mm_alignr_epi8(v, prev, 14);
+      __m128i prev3 = _mm_alignr_epi8(v, prev, 13);
+      __m128i error = _mm_and_si128(
+        _mm_and_si128(
+          _mm_shuffle_epi8(byte1High,
+                           _mm_and_si128(_mm_srli_epi16(prev1, 4), vNibble)),
+          _mm_shuffle_epi8(byte1Low, _mm_and_si128(prev1, vNibble))),
+        _mm_shuffle_epi8(byte2High,
+                         _mm_and_si128(_mm_srli_epi16(v, 4), vNibble)));
+      /* bytes that have to be the 3rd or 4th byte of a character */
+      __m128i must23 = _mm_or_si128(_mm_subs_epu8(prev2, _mm_set1_epi8(0x60)),
+                                    _mm_subs_epu8(prev3, _mm_set1_epi8(0x70)));
+      error = _mm_xor_si128(error,
+                            _mm_and_si128(must23, _mm_set1_epi8((char)0x80)));
+      error = _mm_or_si128(error, _mm_and_si128(
+        _mm_and_si128(_mm_cmpeq_epi8(prev2, _mm_set1_epi8((char)0xEF)),
+                      _mm_cmpeq_epi8(prev1, _mm_set1_epi8((char)0xBF))),
+        _mm_cmpeq_epi8(_mm_max_epu8(v, _mm_set1_epi8((char)0xBE)), v)));
+      errorMask = ~_mm_movemask_epi8(_mm_cmpeq_epi8(error, vZero)) & 0xFFFF;
+    }
+    if (stopMask | errorMask) {
+      if (stopMask) {
+        int k = __builtin_ctz(stopMask);
+        /* an error involving bytes before k is flagged at k or earlier */
+        if (! (errorMask & ((2u << k) - 1)))
+          return ptr + k;
+      }
+      break;
+    }
+    prev = v;
+  }
+  return utf8Boundary(start, ptr);
+}
+
+__attribute__((target("avx2")))
+static const char *
+scanUtf8Avx2(const char *ptr, const char *end,
+             char low, char except, char c1, char c2, char c3)
+{
+  const char *start = ptr;
+  const __m256i byte1High = _mm256_setr_epi8(UTF8_BYTE_1_HIGH,
+                                             UTF8_BYTE_1_HIGH);
+  const __m256i byte1Low = _mm256_setr_epi8(UTF8_BYTE_1_LOW,
+                                            UTF8_BYTE_1_LOW);
+  const __m256i byte2High = _mm256_setr_epi8(UTF8_BYTE_2_HIGH,
+                                             UTF8_BYTE_2_HIGH);
+  const __m256i vNibble = _mm256_set1_epi8(0x0F);
+  const __m256i vLow = _mm256_set1_epi8(low);
+  const __m256i vExcept = _mm256_set1_epi8(except);
+  const __m256i v1 = _mm256_set1_epi8(c1);
+  const __m256i v2 = _mm256_set1_epi8(c2);
+  const __m256i v3 = _mm256_set1_epi8(c3);
+  const __m256i vZero = _mm256_setzero_si256();
+  __m256i prev = vZero;
+  for (; end - ptr >= 32; ptr += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)ptr);
+    __m256i plain = _mm256_or_si256(_mm256_cmpeq_epi8(v, vExcept),
+                                    _mm256_cmpgt_epi8(vZero, v));
+    __m256i stop = _mm256_andnot_si256(plain, _mm256_cmpgt_epi8(vLow, v));
+    unsigned stopMask, errorMask = 0;
+    stop = _mm256_or_si256(stop, _mm256_cmpeq_epi8(v, v1));
+    stop = _mm256_or_si256(stop, _mm256_cmpeq_epi8(v, v2));
+    stop = _mm256_or_si256(stop, _mm256_cmpeq_epi8(v, v3));
+    stopMask = (unsigned)_mm256_movemask_epi8(stop);
+    if (_mm256_movemask_epi8(_mm256_or_si256(v, prev))) {
+      /* the last 16 bytes of prev followed by the first 16 of v */
+      __m256i shifted = _mm256_permute2x128_si256(prev, v, 0x21);
+      __m256i prev1 = _mm256_alignr_epi8(v, shifted, 15);
+      __m256i prev2 = _mm256_alignr_epi8(v, shifted, 14);
+      __m256i prev3 = _mm256_alignr_epi8(v, shifted, 13);
+      __m256i error = _mm256_and_si256(
+        _mm256_and_si256(
+          _mm256_shuffle_epi8(byte1High,
+                              _mm256_and_si256(_mm256_srli_epi16(prev1, 4),
+                                               vNibble)),
+          _mm256_shuffle_epi8(byte1Low, _mm256_and_si256(prev1, vNibble))),
+        _mm256_shuffle_epi8(byte2High,
+                            _mm256_and_si256(_mm256_srli_epi16(v, 4),
+                                             vNibble)));
+      __m256i must23 = _mm256_or_si256(
+        _mm256_subs_epu8(prev2, _mm256_set1_epi8(0x60)),
+        _mm256_subs_epu8(prev3, _mm256_set1_epi8(0x70)));
+      error = _mm256_xor_si256(error, _mm256_and_si256(
+        must23, _mm256_set1_epi8((char)0x80)));
+      error = _mm256_or_si256(error, _mm256_and_si256(
+        _mm256_and_si256(_mm256_cmpeq_epi8(prev2, _mm256_set1_epi8((char)0xEF)),
+                         _mm256_cmpeq_epi8(prev1, _mm256_set1_epi8((char)0xBF))),
+        _mm256_cmpeq_epi8(_mm256_max_epu8(v, _mm256_set1_epi8((char)0xBE)),
+                          v)));
+      errorMask = ~(unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(error,
+                                                                    vZero));
+    }
+    if (stopMask | errorMask) {
+      if (stopMask) {
+        int k = __builtin_ctz(stopMask);
+        if (! (errorMask & ((2u << k) - 1)))
+          return ptr + k;
+      }
+      break;
+    }
+    prev = v;
+  }
+  return utf8Boundary(start, ptr);
+}
+
+static const char *
+scanPlain(int mode, const char *ptr, const char *end,
+          char low, char except, char c1, char c2, char c3)
+{
+  if (mode == PLAIN_SCAN_UTF8) {
+    if (__builtin_cpu_supports("avx2"))
+      return scanUtf8Avx2(ptr, end, low, except, c1, c2, c3);
+    if (__builtin_cpu_supports("ssse3"))
+      return scanUtf8Ssse3(ptr, end, low, except, c1, c2, c3);
+    mode = PLAIN_SCAN_ASCII;
+  }
+  if (__builtin_cpu_supports("avx2"))
+    return scanPlainAvx2(mode, ptr, end, low, except, c1, c2, c3);
+  return scanPlainSse2(mode, ptr, end, low, except, c1, c2, c3);
+}
+
+/* Skip plain data from ptr on; the result is ptr itself when the
+   encoding can't be scanned or too little input is left.
+*/
+#define SKIP_PLAIN(enc, ptr, end, low, except, c1, c2, c3) \
+  (AS_NORMAL_ENCODING(enc)->plainScan != PLAIN_SCAN_NONE \
+   && (end) - (ptr) >= 16 \
+   ? scanPlain(AS_NORMAL_ENCODING(enc)->plainScan, (ptr), (end), \
+               (low), (except), (c1), (c2), (c3)) \
+   : (ptr))
+
+#else /* not XML_SIMD_X86 */
+
+#define SKIP_PLAIN(enc, ptr, end, low, except, c1, c2, c3) (ptr)
+
+#endif /* XML_SIMD_X86 */
+
 #define PREFIX(ident) normal_ ## ident
 #define XML_TOK_IMPL_C
 #include "xmltok_impl.c"
@@ -315,6 +658,10 @@ sb_charMatches(const ENCODING *enc, const char *p, int c)
 #undef IS_NMSTRT_CHAR
 #undef IS_NMSTRT_CHAR_MINBPC
 #undef IS_INVALID_CHAR
+#undef SKIP_PLAIN
+
+/* Only single byte encodings are scanned. */
+#define SKIP_PLAIN(enc, ptr, end, low, except, c1, c2, c3) (ptr)
 
 enum {  /* UTF8_cvalN is value of masked first byte of N byte sequence */
   UTF8_cval1 = 0x00,
@@ -450,7 +797,8 @@ static const struct normal_encoding utf8_encoding_ns = {
 #include "asciitab.h"
 #include "utf8tab.h"
   },
-  STANDARD_VTABLE(sb_) NORMAL_VTABLE(utf8_)
+  STANDARD_VTABLE(sb_) NORMAL_VTABLE(utf8_),
+  PLAIN_SCAN_UTF8
 };
 #endif
 
@@ -462,7 +810,8 @@ static const struct normal_encoding utf8_encoding = {
 #undef BT_COLON
 #include "utf8tab.h"
   },
-  STANDARD_VTABLE(sb_) NORMAL_VTABLE(utf8_)
+  STANDARD_VTABLE(sb_) NORMAL_VTABLE(utf8_),
+  PLAIN_SCAN_UTF8
 };
 
 #ifdef XML_NS
@@ -473,7 +822,8 @@ static const struct normal_encoding internal_utf8_encoding_ns = {
 #include "iasciitab.h"
 #include "utf8tab.h"
   },
-  STANDARD_VTABLE(sb_) NORMAL_VTABLE(utf8_)
+  STANDARD_VTABLE(sb_) NORMAL_VTABLE(utf8_),
+  PLAIN_SCAN_UTF8
 };
 
 #endif
@@ -486,7 +836,8 @@ static const struct normal_encoding internal_utf8_encoding = {
 #undef BT_COLON
 #include "utf8tab.h"
   },
-  STANDARD_VTABLE(sb_) NORMAL_VTABLE(utf8_)
+  STANDARD_VTABLE(sb_) NORMAL_VTABLE(utf8_),
+  PLAIN_SCAN_UTF8
 };
 
 static enum XML_Convert_Result PTRCALL
@@ -536,7 +887,8 @@ static const struct normal_encoding latin1_encoding_ns = {
 #include "asciitab.h"
 #include "latin1tab.h"
   },
-  STANDARD_VTABLE(sb_) NULL_VTABLE
+  STANDARD_VTABLE(sb_) NULL_VTABLE,
+  PLAIN_SCAN_LATIN1
 };
 
 #endif
@@ -549,7 +901,8 @@ static const struct normal_encoding latin1_encoding = {
 #undef BT_COLON
 #include "latin1tab.h"
   },
-  STANDARD_VTABLE(sb_) NULL_VTABLE
+  STANDARD_VTABLE(sb_) NULL_VTABLE,
+  PLAIN_SCAN_LATIN1
 };
 
 static enum XML_Convert_Result PTRCALL
@@ -574,7 +927,8 @@ static const struct normal_encoding ascii_encoding_ns = {
 #include "asciitab.h"
 /* BT_NONXML == 0 */
   },
-  STANDARD_VTABLE(sb_) NULL_VTABLE
+  STANDARD_VTABLE(sb_) NULL_VTABLE,
+  PLAIN_SCAN_ASCII
 };
 
 #endif
@@ -587,7 +941,8 @@ static const struct normal_encoding ascii_encoding = {
 #undef BT_COLON
 /* BT_NONXML == 0 */
   },
-  STANDARD_VTABLE(sb_) NULL_VTABLE
+  STANDARD_VTABLE(sb_) NULL_VTABLE,
+  PLAIN_SCAN_ASCII
 };
 
 static int PTRFASTCALL
@@ -1448,6 +1803,8 @@ XmlInitUnknownEncoding(void *mem,
   struct unknown_encoding *e = (struct unknown_encoding *)mem;
   for (i = 0; i < (int)sizeof(struct normal_encoding); i++)
     ((char *)mem)[i] = ((char *)&latin1_encoding)[i];
+  /* The converter may map any byte to a markup character. */
+  e->normal.plainScan = PLAIN_SCAN_NONE;
   for (i = 0; i < 128; i++)
     if (latin1_encoding.type[i] != BT_OTHER
         && latin1_encoding.type[i] != BT_NONXML
@@ -622,7 +622,9 @@ PREFIX(scanAtts)(const ENCODING *enc, const char *ptr, const char *end,
             *nextTokPtr = ptr;
             return XML_TOK_INVALID;
           default:
-            ptr += MINBPC(enc);
+            ptr = SKIP_PLAIN(enc, ptr + MINBPC(enc), end,
+                             0x20, ASCII_TAB, ASCII_LT, ASCII_AMP,
+                             open == BT_QUOT ? ASCII_QUOT : ASCII_APOS);
             break;
           }
         }
@@ -837,7 +839,8 @@ PREFIX(contentTok)(const ENCODING *enc, const char *ptr, const char *end,
         *nextTokPtr = ptr; \
         return XML_TOK_DATA_CHARS; \
       } \
-      ptr += n; \
+      ptr = SKIP_PLAIN(enc, ptr + n, end, \
+                       0x20, ASCII_TAB, ASCII_LT, ASCII_AMP, ASCII_RSQB); \
       break;
     LEAD_CASE(2) LEAD_CASE(3) LEAD_CASE(4)
 #undef LEAD_CASE
@@ -867,7 +870,8 @@ PREFIX(contentTok)(const ENCODING *enc, const char *ptr, const char *end,
       *nextTokPtr = ptr;
       return XML_TOK_DATA_CHARS;
     default:
-      ptr += MINBPC(enc);
+      ptr = SKIP_PLAIN(enc, ptr + MINBPC(enc), end,
+                       0x20, ASCII_TAB, ASCII_LT, ASCII_AMP, ASCII_RSQB);
       break;
     }
   }
@@ -1204,7 +1208,10 @@ PREFIX(attributeValueTok)(const ENCODING *enc, const char *ptr,
   while (HAS_CHAR(enc, ptr, end)) {
     switch (BYTE_TYPE(enc, ptr)) {
 #define LEAD_CASE(n) \
-    case BT_LEAD ## n: ptr += n; break;
+    case BT_LEAD ## n: \
+      ptr = SKIP_PLAIN(enc, ptr + n, end, \
+                       0x21, 0x21, ASCII_LT, ASCII_AMP, ASCII_AMP); \
+      break;
     LEAD_CASE(2) LEAD_CASE(3) LEAD_CASE(4)
 #undef LEAD_CASE
     case BT_AMP:
@@ -1243,7 +1250,8 @@ PREFIX(attributeValueTok)(const ENCODING *enc, const char *ptr,
       *nextTokPtr = ptr;
       return XML_TOK_DATA_CHARS;
     default:
-      ptr += MINBPC(enc);
+      ptr = SKIP_PLAIN(enc, ptr + MINBPC(enc), end,
+                       0x21, 0x21, ASCII_LT, ASCII_AMP, ASCII_AMP);
       break;
     }
   }
@@ -53,7 +53,8 @@
       ],
       'defines': [
         'PIC',
-        'HAVE_EXPAT_CONFIG_H'
+        'HAVE_EXPAT_CONFIG_H',
+        'XML_FAST_HASH_TABLE'
       ],
       'cflags': [
         '-Wno-missing-field-initializers'
@@ -0,0 +1,141 @@
+/* Microbenchmarks for the hash tables of element types, attribute IDs
+   and prefixes.
+
+   The first part times the keyed hash functions on names of several
+   lengths.  The second part parses generated documents whose start
+   tags look up few or many distinct names.  Build it once with and
+   once without XML_FAST_HASH_TABLE to compare the table
+   implementations.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "expat.h"
+#include "siphash.h"
+
+#define NR_OF_NAMES 256
+
+static char names[NR_OF_NAMES][40];
+static volatile uint64_t sink;
+
+static void
+makeNames(size_t len)
+{
+  int i;
+  size_t j;
+  for (i = 0; i < NR_OF_NAMES; i++) {
+    for (j = 0; j < len; j++)
+      names[i][j] = (char)('a' + (i * 7 + j * 13) % 26);
+    names[i][len] = 0;
+  }
+}
+
+static void
+benchHashes(long loops)
+{
+  static const size_t lengths[] = { 1, 4, 8, 12, 16, 24, 32 };
+  struct sipkey key;
+  size_t l;
+  (void)sip_tobin;
+  (void)sip24_valid;
+  key.k[0] = 0;
+  key.k[1] = 0x5eed;
+  printf("%-6s %14s %14s\n", "length", "siphash24 ns", "siphash13 ns");
+  for (l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++) {
+    clock_t t0, t1, t2;
+    long n;
+    makeNames(lengths[l]);
+    /* as lookup() hashed before: keylen, then through H->buf */
+    t0 = clock();
+    for (n = 0; n < loops; n++) {
+      const char *s = names[n & (NR_OF_NAMES - 1)];
+      struct siphash state;
+      sip24_init(&state, &key);
+      sip24_update(&state, s, strlen(s));
+      sink += sip24_final(&state);
+    }
+    t1 = clock();
+    for (n = 0; n < loops; n++) {
+      const char *s = names[n & (NR_OF_NAMES - 1)];
+      sink += siphash13(s, strlen(s), &key);
+    }
+    t2 = clock();
+    printf("%-6lu %14.2f %14.2f\n", (unsigned long)lengths[l],
+           (double)(t1 - t0) / CLOCKS_PER_SEC * 1e9 / loops,
+           (double)(t2 - t1) / CLOCKS_PER_SEC * 1e9 / loops);
+  }
+}
+
+/* elements with 5 attributes each, cycling through distinct names of
+   element types and attributes */
+static char *
+makeDocument(int distinct, int elements, int *len)
+{
+  char *doc = malloc((size_t)elements * 160 + 64);
+  char *p = doc;
+  int i, a;
+  p += sprintf(p, "<doc xmlns:x='urn:x'>");
+  for (i = 0; i < elements; i++) {
+    int k = i % distinct;
+    p += sprintf(p, "<x:element%d", k);
+    for (a = 0; a < 5; a++)
+      p += sprintf(p, " x:attribute%d='v'", k * 5 + a);
+    p += sprintf(p, "/>");
+  }
+  p += sprintf(p, "</doc>");
+  *len = (int)(p - doc);
+  return doc;
+}
+
+static void
+benchLookups(int ns, int loops)
+{
+  static const int distinct[] = { 4, 64, 4096 };
+  const int elements = 20000;
+  size_t d;
+  printf("\n%s, %d elements with 5 attributes\n",
+         ns ? "namespace processing" : "no namespace processing", elements);
+  printf("%-14s %14s\n", "distinct names", "ns per element");
+  for (d = 0; d < sizeof(distinct) / sizeof(distinct[0]); d++) {
+    int len, i;
+    char *doc = makeDocument(distinct[d], elements, &len);
+    double cpuTime = 0.0;
+    XML_Parser parser = ns ? XML_ParserCreateNS(NULL, '!')
+                           : XML_ParserCreate(NULL);
+    for (i = 0; i < loops; i++) {
+      clock_t tstart = clock();
+      if (!XML_Parse(parser, doc, len, 1)) {
+        fprintf(stderr, "error '%s'\n",
+                XML_ErrorString(XML_GetErrorCode(parser)));
+        exit(4);
+      }
+      cpuTime += (double)(clock() - tstart) / CLOCKS_PER_SEC;
+      XML_ParserReset(parser, NULL);
+    }
+    printf("%-14d %14.1f\n", distinct[d],
+           cpuTime * 1e9 / loops / elements);
+    XML_ParserFree(parser);
+    free(doc);
+  }
+}
+
+int
+main(int argc, char *argv[])
+{
+  int loops = argc > 1 ? atoi(argv[1]) : 20;
+  if (loops <= 0) {
+    fprintf(stderr, "usage: %s [nr_of_loops]\n", argv[0]);
+    return 1;
+  }
+#ifdef XML_FAST_HASH_TABLE
+  printf("XML_FAST_HASH_TABLE\n\n");
+#else
+  printf("SipHash-2-4 table\n\n");
+#endif
+  benchHashes((long)loops * 500000);
+  benchLookups(0, loops);
+  benchLookups(1, loops);
+  return 0;
+}
@@ -2392,6 +2392,88 @@ START_TEST(test_invalid_tag_in_dtd)
 }
 END_TEST
 
+/* Parses text in chunks of chunkSize with XML_Parse and with
+   XML_ParseExternal, each chunk of the latter in memory that is
+   overwritten once the parser no longer needs it, and checks that
+   positions agree after every call. Returns the final status.
+*/
+static enum XML_Status
+check_external_positions(const char *text, int chunkSize, int release)
+{
+    XML_Parser copying = XML_ParserCreate(NULL);
+    XML_Parser external = XML_ParserCreate(NULL);
+    int len = (int)strlen(text);
+    char *chunks[2];
+    int pos = 0, i = 0;
+    enum XML_Status copied = XML_STATUS_OK, result = XML_STATUS_OK;
+
+    chunks[0] = (char *)malloc(chunkSize);
+    chunks[1] = (char *)malloc(chunkSize);
+    if (copying == NULL || external == NULL ||
+        chunks[0] == NULL || chunks[1] == NULL)
+        fail("Could not create parsers");
+    while (copied == XML_STATUS_OK && result == XML_STATUS_OK && pos < len) {
+        int n = len - pos < chunkSize ? len - pos : chunkSize;
+        int isFinal = pos + n == len;
+        char *chunk = chunks[i++ % 2];
+
+        memcpy(chunk, text + pos, n);
+        copied = XML_Parse(copying, text + pos, n, isFinal);
+        result = XML_ParseExternal(external, chunk, n, isFinal);
+        /* The previous chunk is no longer needed, this one only
+           after XML_ReleaseExternal or at the end */
+        memset(chunks[i % 2], 'x', chunkSize);
+        if (release || isFinal || result != XML_STATUS_OK) {
+            if (XML_ReleaseExternal(external) != XML_STATUS_OK)
+                fail("XML_ReleaseExternal failed");
+            memset(chunk, 'x', chunkSize);
+        }
+        pos += n;
+        if (copied != result)
+            fail("XML_ParseExternal status differs from XML_Parse");
+        if (XML_GetCurrentByteIndex(external)
+            != XML_GetCurrentByteIndex(copying))
+            fail("XML_ParseExternal byte index differs from XML_Parse");
+        if (XML_GetCurrentLineNumber(external)
+            != XML_GetCurrentLineNumber(copying))
+            fail("XML_ParseExternal line number differs from XML_Parse");
+        if (XML_GetCurrentColumnNumber(external)
+            != XML_GetCurrentColumnNumber(copying))
+            fail("XML_ParseExternal column number differs from XML_Parse");
+    }
+    free(chunks[0]);
+    free(chunks[1]);
+    XML_ParserFree(copying);
+    XML_ParserFree(external);
+    return result;
+}
+
+/* Test that XML_ParseExternal reports positions like XML_Parse */
+START_TEST(test_parse_external_positions)
+{
+    const char *text =
+        "<?xml version='1.0'?>\n"
+        "<doc a='1'>\n"
+        "  <e>text</e>\n"
+        "  <e b='long attribute value'>more &amp; text</e>\n"
+        "  <![CDATA[cdata]]><!-- comment -->\n"
+        "</doc>\n";
+    const char *bad = "<doc>\n  <e>text</e>\n  <e></doc>\n";
+    int chunkSize;
+
+    for (chunkSize = 1; chunkSize <= (int)strlen(text); chunkSize++) {
+        if (check_external_positions(text, chunkSize, 0) != XML_STATUS_OK)
+            fail("XML_ParseExternal failed on a well-formed document");
+        if (check_external_positions(text, chunkSize, 1) != XML_STATUS_OK)
+            fail("XML_ParseExternal failed after XML_ReleaseExternal");
+    }
+    for (chunkSize = 1; chunkSize <= (int)strlen(bad); chunkSize++) {
+        if (check_external_positions(bad, chunkSize, 0) != XML_STATUS_ERROR)
+            fail("XML_ParseExternal accepted a mismatched tag");
+    }
+}
+END_TEST
+
 
 /*
  * Namespaces tests.
@@ -3540,6 +3622,7 @@ make_suite(void)
     tcase_add_test(tc_basic, test_byte_info_at_error);
     tcase_add_test(tc_basic, test_byte_info_at_cdata);
     tcase_add_test(tc_basic, test_invalid_tag_in_dtd);
+    tcase_add_test(tc_basic, test_parse_external_positions);
 
     suite_add_tcase(s, tc_namespace);
     tcase_add_checked_fixture(tc_namespace,
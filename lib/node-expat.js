@@ -1,13 +1,71 @@
 'use strict'
 
+const os = require('os')
 const util = require('util')
 const expat = require('bindings')('node_expat')
 const Stream = require('stream').Stream
+const Transform = require('stream').Transform
 
-const Parser = function (encoding) {
+// Number of arguments following each event name in a batch, in the
+// binding's event order
+const batchArity = {
+  startElement: 2,
+  endElement: 1,
+  text: 1,
+  startCdata: 0,
+  endCdata: 0,
+  processingInstruction: 2,
+  comment: 1,
+  xmlDecl: 3,
+  entityDecl: 7,
+  startNamespaceDecl: 2,
+  endNamespaceDecl: 1
+}
+
+// Element events also carry the namespace URI in namespace mode
+const namespaceBatchArity = Object.assign({}, batchArity, {
+  startElement: 3,
+  endElement: 2
+})
+
+// Bits for setEventMask(), in the binding's event order
+const eventBits = {}
+Object.keys(batchArity).forEach(function (name, i) {
+  eventBits[name] = 1 << i
+})
+
+const Parser = function (encoding, options) {
   this.encoding = encoding
+  this.options = options || {}
   this._getNewParser()
-  this.parser.emit = this.emit.bind(this)
+  this._batchArity = this.options.namespaces ? namespaceBatchArity : batchArity
+  if (this.options.batch) {
+    this.parser.emit = this._emitBatch.bind(this)
+  } else {
+    this.parser.emit = this.emit.bind(this)
+  }
+
+  // Only let expat report events that somebody listens to. These hooks
+  // update the mask at once, even from a handler in the middle of a
+  // parse, but a chunk on the threadpool finishes with the old one. As
+  // removeAllListeners() takes them along, _syncEventMask() also
+  // derives it from the listeners whenever a parse starts.
+  this._eventMask = 0
+  this.parser.setEventMask(this._eventMask)
+  this.on('newListener', function (event) {
+    const bit = eventBits[event]
+    if (bit && !(this._eventMask & bit)) {
+      this._eventMask |= bit
+      this.parser.setEventMask(this._eventMask)
+    }
+  })
+  this.on('removeListener', function (event) {
+    const bit = eventBits[event]
+    if (bit && this.listenerCount(event) === 0) {
+      this._eventMask &= ~bit
+      this.parser.setEventMask(this._eventMask)
+    }
+  })
 
   // Stream API
   this.writable = true
@@ -16,13 +74,192 @@ const Parser = function (encoding) {
 util.inherits(Parser, Stream)
 
 Parser.prototype._getNewParser = function () {
-  this.parser = new expat.Parser(this.encoding)
+  this.parser = new expat.Parser(this.encoding, this.options)
+}
+
+// In batch mode the binding calls emit('batch', events) once per
+// parse() with all events flattened into one array.
+Parser.prototype._emitBatch = function (event, events) {
+  if (event !== 'batch') {
+    return this.emit.apply(this, arguments)
+  }
+  this._replay(events)
+}
+
+Parser.prototype._replay = function (events) {
+  const batchArity = this._batchArity
+  let i = 0
+  while (i < events.length) {
+    const name = events[i]
+    switch (batchArity[name]) {
+      case 0:
+        this.emit(name)
+        break
+      case 1:
+        this.emit(name, events[i + 1])
+        break
+      case 2:
+        this.emit(name, events[i + 1], events[i + 2])
+        break
+      default:
+        this.emit.apply(this, events.slice(i, i + 1 + batchArity[name]))
+    }
+    i += 1 + batchArity[name]
+  }
+}
+
+Parser.prototype._syncEventMask = function () {
+  let mask = 0
+  for (const event in eventBits) {
+    if (this.listenerCount(event) > 0) {
+      mask |= eventBits[event]
+    }
+  }
+  if (mask !== this._eventMask) {
+    this._eventMask = mask
+    this.parser.setEventMask(mask)
+  }
 }
 
 Parser.prototype.parse = function (buf, isFinal) {
+  this._syncEventMask()
   return this.parser.parse(buf, isFinal)
 }
 
+// Parses on the libuv threadpool. Calls are queued so that events are
+// emitted in input order; the returned promise resolves like parse()
+// once the events of this chunk have been emitted.
+Parser.prototype.parseAsync = function (buf, isFinal) {
+  const self = this
+  if (typeof buf === 'string') {
+    buf = Buffer.from(buf)
+  }
+  return this._enqueue(function (done) {
+    self.parser.parseAsync(buf, !!isFinal, done)
+  })
+}
+
+// Parses a whole document on up to options.threads threads: slices of
+// at least options.minSliceSize bytes are parsed speculatively by
+// separate expat instances, and the events are emitted as if one parser
+// had parsed the document. Falls back to parseAsync(buf, true) where
+// the slices can't be parsed on their own.
+Parser.prototype.parseParallel = function (buf, options) {
+  const self = this
+  options = options || {}
+  if (typeof buf === 'string') {
+    buf = Buffer.from(buf)
+  }
+  const threads = options.threads || os.cpus().length
+  const minSliceSize = options.minSliceSize === undefined ? 1048576 : options.minSliceSize
+  return this._enqueue(function (done) {
+    self.parser.parseParallel(buf, threads, minSliceSize, done)
+  })
+}
+
+// Parses a document made of many records, like the items of
+// <root><item/><item/>...</root>: elements named record that are not
+// inside another one. Batches of neighbouring records are parsed on up
+// to options.threads threads by separate expat instances, and only the
+// events inside records are emitted, a batch at a time: in document
+// order, or as soon as each batch is done with options.ordered false.
+// Resolves to the number of records.
+Parser.prototype.parseRecords = function (buf, record, options) {
+  const self = this
+  options = options || {}
+  if (typeof buf === 'string') {
+    buf = Buffer.from(buf)
+  }
+  const threads = options.threads || os.cpus().length
+  const ordered = options.ordered !== false
+  return this._enqueueBatches(function (progress, done) {
+    self.parser.parseRecords(buf, record, threads, ordered, progress, done)
+  })
+}
+
+// Parses a whole file like parseAsync(buf, true) without reading it
+// into a Buffer: the file is memory-mapped and parsed on the libuv
+// threadpool, options.batchSize bytes at a time (default 4 MiB), and
+// the events of each batch are emitted while the next one is parsed.
+// Rejects if the file can't be opened; resolves like parse() otherwise.
+Parser.prototype.parseFile = function (path, options) {
+  const self = this
+  options = options || {}
+  const batchSize = options.batchSize || 4194304
+  return this._enqueueBatches(function (progress, done) {
+    self.parser.parseFile(path, batchSize, progress, done)
+  })
+}
+
+// Parses everything left to read from the file descriptor fd, a file
+// from its current offset or a pipe or socket until its end, like
+// parseFile(). A native thread reads ahead into options.buffers
+// buffers (default 3, at least 2) of options.batchSize bytes (default
+// 1 MiB) while the previous ones are parsed. fd is not closed, and
+// nothing else may read it until the promise settles.
+Parser.prototype.parseFd = function (fd, options) {
+  const self = this
+  options = options || {}
+  const batchSize = options.batchSize || 1048576
+  const buffers = options.buffers || 3
+  return this._enqueueBatches(function (progress, done) {
+    self.parser.parseFd(fd, batchSize, buffers, progress, done)
+  })
+}
+
+// Like _enqueue(), for native calls that send the events of each
+// batch to progress(events) as they go instead of all at the end
+Parser.prototype._enqueueBatches = function (start) {
+  const self = this
+  return this._enqueue(function (done) {
+    let error = null
+    start(function (events) {
+      if (error) {
+        return
+      }
+      try {
+        self._replay(events)
+      } catch (e) {
+        error = e
+      }
+    }, function (err, result) {
+      done(err || error, result, [])
+    })
+  })
+}
+
+// Runs start(done) after the previous parseAsync() or parseParallel()
+// is done; the promise resolves once the events have been emitted.
+Parser.prototype._enqueue = function (start) {
+  const self = this
+  function run () {
+    return new Promise(function (resolve, reject) {
+      self._syncEventMask()
+      start(function (err, result, events) {
+        if (err) {
+          return reject(err)
+        }
+        try {
+          self._replay(events)
+        } catch (e) {
+          return reject(e)
+        }
+        resolve(result)
+      })
+    })
+  }
+  const previous = this._asyncQueue
+  const current = previous ? previous.then(run, run) : run()
+  function settled () {
+    if (self._asyncQueue === current) {
+      self._asyncQueue = null
+    }
+  }
+  this._asyncQueue = current
+  current.then(settled, settled)
+  return current
+}
+
 Parser.prototype.setEncoding = function (encoding) {
   this.encoding = encoding
   return this.parser.setEncoding(this.encoding)
@@ -42,6 +279,7 @@ Parser.prototype.pause = function () {
   return this.stop()
 }
 Parser.prototype.resume = function () {
+  this._syncEventMask()
   return this.parser.resume()
 }
 
@@ -103,9 +341,231 @@ Parser.prototype.getCurrentColumnNumber = function () {
 Parser.prototype.getCurrentByteIndex = function () {
   return this.parser.getCurrentByteIndex()
 }
+Parser.prototype.getStats = function () {
+  return this.parser.getStats()
+}
+Parser.prototype.getMemoryUsage = function () {
+  return this.parser.getMemoryUsage()
+}
 
 exports.Parser = Parser
 
+// A Transform stream from XML bytes to events. Each event is pushed as
+// an array [name, ...args] in the format of batch mode. When the
+// readable side holds eventHighWaterMark events, the parser is
+// suspended in the middle of its chunk and the chunk is not
+// acknowledged until the consumer reads again, so a slow consumer
+// stops the writer instead of letting events or input pile up.
+const ParserStream = function (encoding, options) {
+  const self = this
+  options = options || {}
+  // Events wait in the readable buffer, so they can't share one view
+  if (options.attributes === 'lazy') {
+    options = Object.assign({}, options, { attributes: 'object' })
+  }
+  Transform.call(this, {
+    readableObjectMode: true,
+    writableHighWaterMark: options.highWaterMark,
+    readableHighWaterMark: options.eventHighWaterMark
+  })
+  this.parser = new Parser(encoding, options)
+  // Pending transform or flush callback while the parser is suspended
+  this._continue = null
+  this._suspended = false
+
+  const events = options.events || Object.keys(this.parser._batchArity)
+  events.forEach(function (name) {
+    self.parser.on(name, function () {
+      const event = [name]
+      for (let i = 0; i < arguments.length; i++) {
+        event.push(arguments[i])
+      }
+      if (!self.push(event) && !self._suspended) {
+        self._suspended = self.parser.parser.suspend()
+      }
+    })
+  })
+}
+util.inherits(ParserStream, Transform)
+
+ParserStream.prototype._transform = function (chunk, encoding, callback) {
+  this._parse(chunk, false, callback)
+}
+
+ParserStream.prototype._flush = function (callback) {
+  this._parse('', true, callback)
+}
+
+ParserStream.prototype._parse = function (chunk, isFinal, callback) {
+  let result
+  try {
+    result = this.parser.parse(chunk, isFinal)
+  } catch (e) {
+    return callback(e)
+  }
+  this._settle(result, callback)
+}
+
+// Acknowledges the chunk once expat consumed all of it
+ParserStream.prototype._settle = function (result, callback) {
+  if (!result) {
+    return callback(new Error(this.parser.getError()))
+  }
+  if (this._suspended) {
+    this._continue = callback
+  } else {
+    callback()
+  }
+}
+
+ParserStream.prototype._read = function (size) {
+  const callback = this._continue
+  if (callback) {
+    this._continue = null
+    this._suspended = false
+    let result
+    try {
+      result = this.parser.resume()
+    } catch (e) {
+      return callback(e)
+    }
+    this._settle(result, callback)
+  }
+  // Let Transform ask for the next chunk once this one is done
+  if (!this._continue) {
+    Transform.prototype._read.call(this, size)
+  }
+}
+
+exports.ParserStream = ParserStream
+
+// Hands out parsers and takes them back for reuse. Releasing a parser
+// resets it with XML_ParserReset, which keeps the buffers, name cache
+// and native objects a fresh parser would have to allocate again.
+const ParserPool = function (encoding, options, size) {
+  this.encoding = encoding
+  this.options = options
+  this.size = size === undefined ? 64 : size
+  this._idle = []
+  this._hits = 0
+  this._misses = 0
+}
+
+ParserPool.prototype.acquire = function () {
+  if (this._idle.length > 0) {
+    this._hits++
+    return this._idle.pop()
+  }
+  this._misses++
+  return new Parser(this.encoding, this.options)
+}
+
+// Returns true if the parser was kept for reuse. Parsers with a
+// pending parseAsync() are dropped.
+ParserPool.prototype.release = function (parser) {
+  if (this._idle.length >= this.size || parser._asyncQueue) {
+    return false
+  }
+  // The Parser's own newListener/removeListener hooks keep the event
+  // mask in sync while the others go
+  parser.eventNames().forEach(function (event) {
+    if (event !== 'newListener' && event !== 'removeListener') {
+      parser.removeAllListeners(event)
+    }
+  })
+  const reset = this.encoding
+    ? parser.parser.reset(this.encoding)
+    : parser.parser.reset()
+  if (!reset) {
+    return false
+  }
+  parser.encoding = this.encoding
+  parser.writable = true
+  parser.readable = true
+  this._idle.push(parser)
+  return true
+}
+
+ParserPool.prototype.getStats = function () {
+  const requests = this._hits + this._misses
+  return {
+    hits: this._hits,
+    misses: this._misses,
+    hitRate: requests === 0 ? 0 : this._hits / requests,
+    idle: this._idle.length
+  }
+}
+
+exports.ParserPool = ParserPool
+
+// Parses a whole document into nested objects in native code
+exports.parseToObject = function (data, options) {
+  if (typeof data === 'string') {
+    data = Buffer.from(data)
+  }
+  return expat.parseToObject(data, options || {})
+}
+
+// Parses independent documents, such as many small requests, on the
+// libuv threadpool with pooled native parsers, in options.threads runs
+// (default: the threadpool size). Resolves to one result per document:
+// { events } flattened as in batch mode, { tree } as from
+// parseToObject() with options.output 'tree', or { error }.
+exports.parseDocuments = function (buffers, options) {
+  options = options || {}
+  const converter = new expat.Parser(options.encoding || null, options)
+  const tree = options.output === 'tree' ? options : null
+  const threads = options.threads || parseInt(process.env.UV_THREADPOOL_SIZE, 10) || 4
+  const size = Math.ceil(buffers.length / threads)
+  const runs = []
+  for (let i = 0; i < buffers.length; i += size) {
+    const run = buffers.slice(i, i + size).map(function (buf) {
+      return typeof buf === 'string' ? Buffer.from(buf) : buf
+    })
+    runs.push(new Promise(function (resolve, reject) {
+      converter.parseDocuments(run, tree, function (err, results) {
+        if (err) {
+          return reject(err)
+        }
+        resolve(results)
+      })
+    }))
+  }
+  return Promise.all(runs).then(function (results) {
+    return [].concat.apply([], results)
+  })
+}
+
+// Parses the file at path with Parser.prototype.parseFile(), calling
+// handlers.startElement, handlers.text and so on for its events.
+// options are the Parser's, plus encoding and batchSize. Rejects with
+// expat's message on a parse error.
+exports.parseFile = function (path, handlers, options) {
+  return parseWithHandlers(handlers, options, function (parser) {
+    return parser.parseFile(path, options)
+  })
+}
+
+// Same for the file descriptor fd, with Parser.prototype.parseFd()
+exports.parseFd = function (fd, handlers, options) {
+  return parseWithHandlers(handlers, options, function (parser) {
+    return parser.parseFd(fd, options)
+  })
+}
+
+function parseWithHandlers (handlers, options, parse) {
+  options = options || {}
+  const parser = new Parser(options.encoding || null, options)
+  Object.keys(handlers || {}).forEach(function (event) {
+    parser.on(event, handlers[event])
+  })
+  return parse(parser).then(function (result) {
+    if (!result) {
+      throw new Error(parser.getError())
+    }
+  })
+}
+
 exports.createParser = function (cb) {
   const parser = new Parser()
   if (cb) {
@@ -1,4 +1,29 @@
 #include <nan.h>
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <climits>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 extern "C" {
 #include <expat.h>
 }
@@ -6,493 +31,4393 @@ extern "C" {
 using namespace v8;
 using namespace node;
 
-class Parser : public Nan::ObjectWrap {
+/**
+ * Compact native record of SAX events.
+ *
+ * In batch mode, and while parseAsync() runs on a worker thread, the
+ * expat callbacks append to a tape instead of calling into JS. Each
+ * event is its type followed by its arguments; strings are stored as
+ * (length, offset) into one character buffer, null and booleans as a
+ * single marker word. A tape holds no V8 handles, so it may be filled
+ * without a HandleScope.
+ */
+class EventTape {
 public:
-  static void Initialize(Local<Object> target)
+  enum Type {
+    START_ELEMENT,
+    END_ELEMENT,
+    TEXT,
+    START_CDATA,
+    END_CDATA,
+    PROCESSING_INSTRUCTION,
+    COMMENT,
+    XML_DECL,
+    ENTITY_DECL,
+    START_NAMESPACE_DECL,
+    END_NAMESPACE_DECL,
+    TYPE_COUNT
+  };
+
+  /* Words hold types, counts, string lengths and offsets into chars,
+     which may pass 4 GiB for a whole document parsed in slices */
+  typedef uint64_t Word;
+
+  /* Value markers, all above any string length we store */
+  enum : Word {
+    NULL_VALUE = 0xffffffff,
+    FALSE_VALUE = 0xfffffffe,
+    TRUE_VALUE = 0xfffffffd
+  };
+
+  void Begin(Type type)
   {
-    Nan::HandleScope scope;
-    Local<FunctionTemplate> t = Nan::New<FunctionTemplate>(New);
+    words.push_back(type);
+    events++;
+  }
 
-    t->InstanceTemplate()->SetInternalFieldCount(1);
+  void PushString(const XML_Char *s)
+  {
+    if (s)
+      PushString(s, strlen(s));
+    else
+      PushNull();
+  }
 
-    Nan::SetPrototypeMethod(t, "parse", Parse);
-    Nan::SetPrototypeMethod(t, "setEncoding", SetEncoding);
-    Nan::SetPrototypeMethod(t, "setUnknownEncoding", SetUnknownEncoding);
-    Nan::SetPrototypeMethod(t, "getError", GetError);
-    Nan::SetPrototypeMethod(t, "stop", Stop);
-    Nan::SetPrototypeMethod(t, "resume", Resume);
-    Nan::SetPrototypeMethod(t, "reset", Reset);
-    Nan::SetPrototypeMethod(t, "getCurrentLineNumber", GetCurrentLineNumber);
-    Nan::SetPrototypeMethod(t, "getCurrentColumnNumber", GetCurrentColumnNumber);
-    Nan::SetPrototypeMethod(t, "getCurrentByteIndex", GetCurrentByteIndex);
+  void PushString(const XML_Char *s, size_t len)
+  {
+    words.push_back(len);
+    words.push_back(chars.size());
+    chars.append(s, len);
+  }
 
-    Nan::Set(target, Nan::New("Parser").ToLocalChecked(), Nan::GetFunction(t).ToLocalChecked());
+  void PushNull()
+  {
+    words.push_back(NULL_VALUE);
   }
 
-protected:
-  /*** Constructor ***/
+  void PushBool(bool value)
+  {
+    words.push_back(value ? TRUE_VALUE : FALSE_VALUE);
+  }
 
-  static NAN_METHOD(New)
+  void PushCount(uint32_t n)
   {
-    Nan::HandleScope scope;
-    XML_Char *encoding = NULL;
-    if (info.Length() == 1 && info[0]->IsString())
+    words.push_back(n);
+  }
+
+  /* Recording of expat's callbacks */
+
+  void StartElement(const XML_Char *name, const XML_Char **atts)
+  {
+    uint32_t count = 0;
+    for(const XML_Char **atts1 = atts; *atts1; atts1 += 2)
+      count++;
+    Begin(START_ELEMENT);
+    PushString(name);
+    PushCount(count);
+    for(const XML_Char **atts1 = atts; *atts1; atts1 += 2)
       {
-        Nan::Utf8String encodingArg(info[0]);
-        encoding = new XML_Char[encodingArg.length() + 1];
-        strcpy(encoding, *encodingArg);
+        PushString(atts1[0]);
+        PushString(atts1[1]);
       }
+  }
 
-    Parser *parser = new Parser(encoding);
-    if (encoding)
-      delete[] encoding;
-    parser->Wrap(info.This());
-    info.GetReturnValue().Set(info.This());
+  void EndElement(const XML_Char *name)
+  {
+    Begin(END_ELEMENT);
+    PushString(name);
   }
 
-  Parser(const XML_Char *encoding)
-    : Nan::ObjectWrap()
+  void Text(const XML_Char *s, int len)
   {
-    parser = XML_ParserCreate(encoding);
-    assert(parser != NULL);
+    Begin(TEXT);
+    PushString(s, len);
+  }
 
-    attachHandlers();
+  void ProcessingInstruction(const XML_Char *target, const XML_Char *data)
+  {
+    Begin(PROCESSING_INSTRUCTION);
+    PushString(target);
+    PushString(data);
   }
 
-  ~Parser()
+  void Comment(const XML_Char *data)
   {
-    XML_ParserFree(parser);
+    Begin(COMMENT);
+    PushString(data);
   }
 
-  void attachHandlers()
+  void XmlDecl(const XML_Char *version, const XML_Char *encoding, int standalone)
   {
-    XML_SetUserData(parser, this);
-    XML_SetElementHandler(parser, StartElement, EndElement);
-    XML_SetCharacterDataHandler(parser, Text);
-    XML_SetCdataSectionHandler(parser, StartCdata, EndCdata);
-    XML_SetProcessingInstructionHandler(parser, ProcessingInstruction);
-    XML_SetCommentHandler(parser, Comment);
-    XML_SetXmlDeclHandler(parser, XmlDecl);
-    XML_SetEntityDeclHandler(parser, EntityDecl);
-    XML_SetUnknownEncodingHandler(parser, UnknownEncoding, this);
+    Begin(XML_DECL);
+    PushString(version);
+    PushString(encoding);
+    PushBool(standalone);
   }
 
-  /*** parse() ***/
+  void EntityDecl(const XML_Char *entityName, int is_parameter_entity,
+                  const XML_Char *value, int value_length, const XML_Char *base,
+                  const XML_Char *systemId, const XML_Char *publicId, const XML_Char *notationName)
+  {
+    Begin(ENTITY_DECL);
+    PushString(entityName);
+    PushBool(is_parameter_entity);
+    if (value)
+      PushString(value, value_length);
+    else
+      PushNull();
+    PushString(base);
+    PushString(systemId);
+    PushString(publicId);
+    PushString(notationName);
+  }
 
-  static NAN_METHOD(Parse)
+  void StartNamespaceDecl(const XML_Char *prefix, const XML_Char *uri)
   {
-    Parser *parser = Nan::ObjectWrap::Unwrap<Parser>(info.This());
-    Nan::HandleScope scope;
-    int isFinal = 0;
+    Begin(START_NAMESPACE_DECL);
+    PushString(prefix);
+    PushString(uri);
+  }
 
-    /* Argument 2: isFinal :: Bool */
-    if (info.Length() >= 2)
-      {
-        isFinal = info[1]->IsTrue();
-      }
+  void EndNamespaceDecl(const XML_Char *prefix)
+  {
+    Begin(END_NAMESPACE_DECL);
+    PushString(prefix);
+  }
 
-    /* Argument 1: buf :: String or Buffer */
-    if (info.Length() >= 1 && info[0]->IsString())
-      {
-        Local<String> str = Nan::To<String>(info[0]).ToLocalChecked();
-        info.GetReturnValue().Set(parser->parseString(str, isFinal) ? Nan::True() : Nan::False());
-      }
-    else if (info.Length() >= 1 && info[0]->IsObject())
-      {
-        Local<Object> obj = Nan::To<Object>(info[0]).ToLocalChecked();
-        if (Buffer::HasInstance(obj))
-        {
-          info.GetReturnValue().Set(parser->parseBuffer(obj, isFinal) ? Nan::True() : Nan::False());
-        }
-        else
+  /** Makes room at the end for events that CopyAt() fills in */
+  void Grow(size_t moreWords, size_t moreChars, size_t moreEvents)
+  {
+    words.resize(words.size() + moreWords);
+    chars.resize(chars.size() + moreChars);
+    events += moreEvents;
+  }
+
+  /**
+   * Copies the events of another tape to words[wordPos...] and
+   * chars[charPos...], made room for with Grow(). Tapes may be copied
+   * into different places of one tape concurrently.
+   */
+  void CopyAt(const EventTape &other, size_t wordPos, size_t charPos)
+  {
+    std::copy(other.words.begin(), other.words.end(), words.begin() + wordPos);
+    std::copy(other.chars.begin(), other.chars.end(), chars.begin() + charPos);
+    Word base = charPos;
+    size_t pos = wordPos;
+    size_t end = wordPos + other.words.size();
+    /* Move the string offsets past the characters before */
+    while (pos < end) {
+      Type type = static_cast<Type>(words[pos++]);
+      int values = ValueCount(type);
+      if (type == START_ELEMENT)
         {
-          Nan::ThrowTypeError("Parse buffer must be String or Buffer");
-          return;
+          /* name, attribute count, then the attribute strings */
+          words[pos + 1] += base;
+          pos += 2;
+          values = 2 * words[pos++];
         }
-      }
-    else {
-      Nan::ThrowTypeError("Parse buffer must be String or Buffer");
-      return;
+      for (; values > 0; values--)
+        if (words[pos++] < TRUE_VALUE)
+          words[pos++] += base;
     }
   }
 
-  /** Parse a v8 String by first writing it to the expat parser's
-      buffer */
-  bool parseString(Local<String> str, int isFinal)
+  void Clear()
   {
-    int len = Nan::Utf8String(str).length();
-    if (len == 0)
-      return true;
-
+    words.clear();
+    chars.clear();
+    events = 0;
+  }
 
-    void *buf = XML_GetBuffer(parser, len);
-    assert(buf != NULL);
-    assert(Nan::DecodeWrite(static_cast<char *>(buf), len, str, Nan::Encoding::UTF8) == len);
+  bool IsEmpty() const
+  {
+    return events == 0;
+  }
 
-    return XML_ParseBuffer(parser, len, isFinal) != XML_STATUS_ERROR;
+  size_t EventCount() const
+  {
+    return events;
   }
 
-  /** Parse a node.js Buffer directly */
-  bool parseBuffer(Local<Object> buffer, int isFinal)
+  size_t Capacity() const
   {
-    return XML_Parse(parser, Buffer::Data(buffer), Buffer::Length(buffer), isFinal) != XML_STATUS_ERROR;
+    return words.capacity() * sizeof(Word) + chars.capacity();
   }
 
-  /*** setEncoding() ***/
+  /** Releases the storage of an empty tape, returns the bytes freed */
+  size_t Trim()
+  {
+    size_t before = Capacity();
+    std::vector<Word>().swap(words);
+    std::string().swap(chars);
+    return before - Capacity();
+  }
 
-  static NAN_METHOD(SetEncoding)
+  /* Number of plain values following each event type. START_ELEMENT
+     is special: name, attribute count, then count name/value pairs.
+     Element and attribute names are stored as expat reports them. */
+  static int ValueCount(Type type)
   {
-    Parser *parser = Nan::ObjectWrap::Unwrap<Parser>(info.This());
-    Nan::HandleScope scope;
+    static const int counts[TYPE_COUNT] = { 1, 1, 1, 0, 0, 2, 1, 3, 7, 2, 1 };
+    return counts[type];
+  }
 
-    if (info.Length() == 1 && info[0]->IsString())
-      {
-        Nan::Utf8String encoding(info[0]);
-        int status = parser->setEncoding(*encoding);
+  std::vector<Word> words;
+  std::string chars;
 
-        info.GetReturnValue().Set(status ? Nan::True() : Nan::False());
-      }
-    else
-      info.GetReturnValue().Set(Nan::False());
-  }
+private:
+  size_t events = 0;
+};
 
-  int setEncoding(XML_Char *encoding)
+/**
+ * Bounded LRU table of element and attribute names.
+ *
+ * Maps expat's names to internalized V8 strings so that the few
+ * distinct names of a document are transcoded once instead of on
+ * every event. A capacity of 0 disables caching.
+ */
+class NameCache {
+public:
+  explicit NameCache(size_t capacity)
+    : capacity(capacity)
   {
-    return XML_SetEncoding(parser, encoding) != 0;
   }
 
-  /*** getError() ***/
+  Local<String> Get(const XML_Char *name)
+  {
+    return Get(name, strlen(name));
+  }
 
-  static NAN_METHOD(GetError)
+  Local<String> Get(const XML_Char *name, size_t len)
   {
-    Nan::HandleScope scope;
-    Parser *parser = Nan::ObjectWrap::Unwrap<Parser>(info.This());
+    if (capacity == 0)
+      return Nan::New(name, static_cast<int>(len)).ToLocalChecked();
 
-    const XML_LChar *error = parser->getError();
-    if (error)
-      info.GetReturnValue().Set(Nan::New(error).ToLocalChecked());
-    else
-      info.GetReturnValue().Set(Nan::Null());
+    auto found = index.find(std::string_view(name, len));
+    if (found != index.end())
+      {
+        /* Move to front */
+        entries.splice(entries.begin(), entries, found->second);
+        return Nan::New(found->second->value);
+      }
+
+    if (entries.size() >= capacity)
+      {
+        index.erase(entries.back().key);
+        entries.pop_back();
+      }
+
+    Local<String> value = String::NewFromUtf8(Isolate::GetCurrent(), name,
+                                              NewStringType::kInternalized,
+                                              static_cast<int>(len)).ToLocalChecked();
+    entries.emplace_front();
+    Entry &entry = entries.front();
+    entry.key.assign(name, len);
+    entry.value.Reset(value);
+    /* Keys point into the list node, which never moves */
+    index.emplace(entry.key, entries.begin());
+    return value;
   }
 
-  /*** stop() ***/
+private:
+  struct Entry {
+    std::string key;
+    Nan::Persistent<String> value;
+  };
 
-  static NAN_METHOD(Stop)
-  {
-    Nan::HandleScope scope;
-    Parser *parser = Nan::ObjectWrap::Unwrap<Parser>(info.This());
+  size_t capacity;
+  std::list<Entry> entries;
+  std::unordered_map<std::string_view, std::list<Entry>::iterator> index;
+};
 
-    int status = parser->stop();
+/**
+ * Per-parser memory for expat, passed with XML_ParserCreate_MM.
+ *
+ * Every parser allocates through an arena so that its footprint is
+ * known. In pooled mode (the arena option), blocks up to MAX_CLASS
+ * bytes are carved from CHUNK_SIZE chunks and recycled through
+ * power-of-two size-class free lists; larger ones, and all blocks
+ * otherwise, come from malloc. expat's memory suite has no user data, so new
+ * blocks go to the arena made current on this thread by an
+ * Arena::Scope around calls into expat, and every block starts with a
+ * header naming its arena for realloc and free. The chunks are released
+ * together when the arena is destroyed.
+ */
+class Arena {
+public:
+  struct Stats {
+    /* bytes handed to expat, rounded up to size classes */
+    size_t bytesInUse = 0;
+    /* chunks plus large blocks */
+    size_t bytesReserved = 0;
+    size_t allocations = 0;
+    size_t frees = 0;
+  };
 
-    info.GetReturnValue().Set(status ? Nan::True() : Nan::False());
+  class Scope {
+  public:
+    explicit Scope(Arena *arena)
+      : previous(current)
+    {
+      current = arena;
+    }
+
+    ~Scope()
+    {
+      current = previous;
+    }
+
+  private:
+    Arena *previous;
+  };
+
+  explicit Arena(bool pooled)
+    : pooled(pooled), chunkPos(NULL), chunkEnd(NULL)
+  {
+    for (size_t i = 0; i < CLASS_COUNT; i++)
+      freeLists[i] = NULL;
   }
 
-  int stop()
+  ~Arena()
   {
-    return XML_StopParser(parser, XML_TRUE) != 0;
+    for (char *chunk : chunks)
+      free(chunk);
   }
 
-  /*** resume() ***/
+  const Stats &GetStats() const
+  {
+    return stats;
+  }
 
-  static NAN_METHOD(Resume)
+  bool IsPooled() const
   {
-    Nan::HandleScope scope;
-    Parser *parser = Nan::ObjectWrap::Unwrap<Parser>(info.This());
+    return pooled;
+  }
 
-    int status = parser->resume();
+  static const XML_Memory_Handling_Suite suite;
 
-    info.GetReturnValue().Set(status ? Nan::True() : Nan::False());
+private:
+  struct Header {
+    /* NULL for blocks allocated outside any Scope */
+    Arena *owner;
+    /* usable size */
+    size_t size;
+  };
+
+  static const size_t MIN_CLASS = 16;
+  static const size_t CLASS_COUNT = 12;
+  static const size_t MAX_CLASS = MIN_CLASS << (CLASS_COUNT - 1);
+  static const size_t CHUNK_SIZE = 64 * 1024;
+
+  static thread_local Arena *current;
+
+  /* Index of the smallest class holding size bytes, or -1 for malloc */
+  int SizeClass(size_t size) const
+  {
+    if (!pooled || size > MAX_CLASS)
+      return -1;
+    int cls = 0;
+    while ((MIN_CLASS << cls) < size)
+      cls++;
+    return cls;
   }
 
-  int resume()
+  static void *Malloc(size_t size)
   {
-    return XML_ResumeParser(parser) != 0;
+    Header *header;
+    if (current)
+      header = current->allocate(size);
+    else
+      {
+        header = static_cast<Header *>(malloc(sizeof(Header) + size));
+        if (header)
+          {
+            header->owner = NULL;
+            header->size = size;
+          }
+      }
+    return header ? header + 1 : NULL;
   }
 
-  static NAN_METHOD(Reset)
+  static void *Realloc(void *ptr, size_t size)
   {
-    Nan::HandleScope scope;
-    Parser *parser = Nan::ObjectWrap::Unwrap<Parser>(info.This());
-    XML_Char *encoding = NULL;
-    if (info.Length() == 1 && info[0]->IsString())
+    if (!ptr)
+      return Malloc(size);
+    Header *header = static_cast<Header *>(ptr) - 1;
+    if (size <= header->size)
+      return ptr;
+
+    Arena *owner = header->owner;
+    if (!owner)
       {
-        Nan::Utf8String encodingArg(info[0]);
-        encoding = new XML_Char[encodingArg.length() + 1];
-        strcpy(encoding, *encodingArg);
+        header = static_cast<Header *>(realloc(header, sizeof(Header) + size));
+        if (!header)
+          return NULL;
+        header->size = size;
+        return header + 1;
       }
 
-    int status = parser->reset(encoding);
-    if (encoding)
-      delete[] encoding;
-    if (status)
-      parser->attachHandlers();
-    info.GetReturnValue().Set(status ? Nan::True() : Nan::False());
+    /* Grow within the block's own arena */
+    Header *grown = owner->allocate(size);
+    if (!grown)
+      return NULL;
+    memcpy(grown + 1, ptr, header->size);
+    owner->release(header);
+    return grown + 1;
   }
 
-  int reset(XML_Char *encoding)
+  static void Free(void *ptr)
   {
-      return XML_ParserReset(parser, encoding) != 0;
+    if (!ptr)
+      return;
+    Header *header = static_cast<Header *>(ptr) - 1;
+    if (header->owner)
+      header->owner->release(header);
+    else
+      free(header);
   }
-  const XML_LChar *getError()
+
+  Header *allocate(size_t size)
   {
-    enum XML_Error code;
-    code = XML_GetErrorCode(parser);
-    return XML_ErrorString(code);
+    Header *header;
+    int cls = SizeClass(size);
+    if (cls < 0)
+      {
+        header = static_cast<Header *>(malloc(sizeof(Header) + size));
+        if (!header)
+          return NULL;
+        header->size = size;
+        stats.bytesReserved += size;
+      }
+    else if (freeLists[cls])
+      {
+        header = freeLists[cls];
+        freeLists[cls] = *reinterpret_cast<Header **>(header + 1);
+      }
+    else
+      {
+        size_t need = sizeof(Header) + (MIN_CLASS << cls);
+        if (static_cast<size_t>(chunkEnd - chunkPos) < need)
+          {
+            char *chunk = static_cast<char *>(malloc(CHUNK_SIZE));
+            if (!chunk)
+              return NULL;
+            chunks.push_back(chunk);
+            chunkPos = chunk;
+            chunkEnd = chunk + CHUNK_SIZE;
+            stats.bytesReserved += CHUNK_SIZE;
+          }
+        header = reinterpret_cast<Header *>(chunkPos);
+        chunkPos += need;
+        header->size = MIN_CLASS << cls;
+      }
+    header->owner = this;
+    stats.bytesInUse += header->size;
+    stats.allocations++;
+    return header;
   }
 
-  static NAN_METHOD(GetCurrentLineNumber)
+  void release(Header *header)
   {
-    Nan::HandleScope scope;
-    Parser *parser = Nan::ObjectWrap::Unwrap<Parser>(info.This());
+    stats.bytesInUse -= header->size;
+    stats.frees++;
+    int cls = SizeClass(header->size);
+    if (cls < 0)
+      {
+        stats.bytesReserved -= header->size;
+        free(header);
+        return;
+      }
+    /* The free list link lives in the block's payload */
+    *reinterpret_cast<Header **>(header + 1) = freeLists[cls];
+    freeLists[cls] = header;
+  }
 
-    info.GetReturnValue().Set(Nan::New(parser->getCurrentLineNumber()));
+  bool pooled;
+  std::vector<char *> chunks;
+  char *chunkPos;
+  char *chunkEnd;
+  Header *freeLists[CLASS_COUNT];
+  Stats stats;
+};
+
+thread_local Arena *Arena::current = NULL;
+const XML_Memory_Handling_Suite Arena::suite = { Arena::Malloc, Arena::Realloc, Arena::Free };
+
+/**
+ * Streaming evaluation of simple path expressions such as
+ * /stream/message/body, //item[@type="book"]/title or
+ * /feed/entry/summary/text().
+ *
+ * Steps are element names or *, separated by / (child) or //
+ * (descendant), with optional [@attr] or [@attr="value"] predicates. A
+ * trailing /text() selects only the text of matching elements.
+ *
+ * For every open element outside a match, the selector keeps the set
+ * of (path, step) pairs that may still match below it. Start() and
+ * End() tell the callbacks whether to emit an element; content is
+ * emitted only inside matching subtrees.
+ */
+class Selector {
+public:
+  /* Compiles expr, returns an error message or NULL */
+  const char *Add(const std::string &expr)
+  {
+    Path path;
+    size_t pos = 0;
+    while (pos < expr.size())
+      {
+        if (expr[pos] != '/')
+          return "Selector steps must start with / or //";
+        Step step;
+        pos++;
+        if (pos < expr.size() && expr[pos] == '/')
+          {
+            step.descendant = true;
+            pos++;
+          }
+        if (expr.compare(pos, std::string::npos, "text()") == 0 && !step.descendant)
+          {
+            if (path.steps.empty())
+              return "Selector needs an element before text()";
+            path.textOnly = true;
+            break;
+          }
+        step.name = ReadName(expr, pos);
+        if (step.name.empty())
+          return "Selector step has no element name";
+        while (pos < expr.size() && expr[pos] == '[')
+          {
+            Predicate predicate;
+            if (++pos >= expr.size() || expr[pos++] != '@')
+              return "Selector predicates must test an @attribute";
+            predicate.attr = ReadName(expr, pos);
+            if (predicate.attr.empty())
+              return "Selector predicate has no attribute name";
+            if (pos < expr.size() && expr[pos] == '=')
+              {
+                if (++pos >= expr.size() || (expr[pos] != '"' && expr[pos] != '\''))
+                  return "Selector attribute value must be quoted";
+                size_t end = expr.find(expr[pos], pos + 1);
+                if (end == std::string::npos)
+                  return "Selector attribute value is not terminated";
+                predicate.hasValue = true;
+                predicate.value = expr.substr(pos + 1, end - pos - 1);
+                pos = end + 1;
+              }
+            if (pos >= expr.size() || expr[pos++] != ']')
+              return "Selector predicate is not terminated";
+            step.predicates.push_back(predicate);
+          }
+        path.steps.push_back(step);
+      }
+    if (path.steps.empty())
+      return "Selector is empty";
+
+    paths.push_back(path);
+    Reset();
+    return NULL;
   }
 
-  uint32_t getCurrentLineNumber()
+  void Reset()
   {
-    return XML_GetCurrentLineNumber(parser);
+    depth = 0;
+    matchDepth = 0;
+    matchTextOnly = false;
+    states.clear();
+    levels.clear();
+    for (size_t i = 0; i < paths.size(); i++)
+      states.push_back(State { static_cast<uint32_t>(i), 0 });
+    levels.push_back(0);
   }
 
-  static NAN_METHOD(GetCurrentColumnNumber)
+  /* Whether to emit the start tag */
+  bool Start(const XML_Char *name, const XML_Char **atts)
   {
-    Nan::HandleScope scope;
-    Parser *parser = Nan::ObjectWrap::Unwrap<Parser>(info.This());
+    depth++;
+    if (matchDepth)
+      return !matchTextOnly;
 
-    info.GetReturnValue().Set(Nan::New(parser->getCurrentColumnNumber()));
+    size_t begin = levels.back(), end = states.size();
+    levels.push_back(end);
+    for (size_t i = begin; i < end; i++)
+      {
+        State state = states[i];
+        const Path &path = paths[state.path];
+        const Step &step = path.steps[state.step];
+        if (step.descendant)
+          Push(state);
+        if (!step.Matches(name, atts))
+          continue;
+        if (state.step + 1 == path.steps.size())
+          {
+            /* Everything below is emitted, so no more states needed */
+            matchDepth = depth;
+            matchTextOnly = path.textOnly;
+            states.resize(levels.back());
+            return !matchTextOnly;
+          }
+        Push(State { state.path, state.step + 1 });
+      }
+    return false;
   }
 
-  uint32_t getCurrentColumnNumber()
+  /* Whether to emit the end tag */
+  bool End()
   {
-    return XML_GetCurrentColumnNumber(parser);
+    bool emit = matchDepth && !matchTextOnly;
+    if (matchDepth && matchDepth < depth)
+      {
+        depth--;
+        return emit;
+      }
+    matchDepth = 0;
+    states.resize(levels.back());
+    levels.pop_back();
+    depth--;
+    return emit;
   }
 
-  static NAN_METHOD(GetCurrentByteIndex)
+  /* Text is emitted in matching elements */
+  bool InMatch() const
   {
-    Nan::HandleScope scope;
-    Parser *parser = Nan::ObjectWrap::Unwrap<Parser>(info.This());
-
-    info.GetReturnValue().Set(Nan::New(parser->getCurrentByteIndex()));
+    return matchDepth != 0;
   }
 
-  int32_t getCurrentByteIndex()
+  /* CDATA markers, comments and PIs only with whole subtrees */
+  bool InSubtree() const
   {
-    return XML_GetCurrentByteIndex(parser);
+    return matchDepth != 0 && !matchTextOnly;
   }
 
 private:
-  /* expat instance */
-  XML_Parser parser;
+  struct Predicate {
+    std::string attr;
+    bool hasValue = false;
+    std::string value;
+  };
 
-  /* no default ctor */
-  Parser();
+  struct Step {
+    bool descendant = false;
+    std::string name;
+    std::vector<Predicate> predicates;
+
+    bool Matches(const XML_Char *elementName, const XML_Char **atts) const
+    {
+      if (name != "*" && name != elementName)
+        return false;
+      for (const Predicate &predicate : predicates)
+        {
+          const XML_Char **atts1 = atts;
+          while (*atts1 && predicate.attr != atts1[0])
+            atts1 += 2;
+          if (!*atts1 || (predicate.hasValue && predicate.value != atts1[1]))
+            return false;
+        }
+      return true;
+    }
+  };
+
+  struct Path {
+    std::vector<Step> steps;
+    bool textOnly = false;
+  };
+
+  struct State {
+    uint32_t path;
+    uint32_t step;
+  };
+
+  static std::string ReadName(const std::string &expr, size_t &pos)
+  {
+    size_t begin = pos;
+    while (pos < expr.size() && !strchr("/[]@=\"' \t", expr[pos]))
+      pos++;
+    return expr.substr(begin, pos - begin);
+  }
+
+  /* Adds a state to the innermost level, once */
+  void Push(State state)
+  {
+    for (size_t i = levels.back(); i < states.size(); i++)
+      if (states[i].path == state.path && states[i].step == state.step)
+        return;
+    states.push_back(state);
+  }
+
+  std::vector<Path> paths;
+  /* open element depth, and where the current match started */
+  size_t depth;
+  size_t matchDepth;
+  bool matchTextOnly;
+  /* states of all open elements outside a match, innermost last */
+  std::vector<State> states;
+  /* offset into states for each level */
+  std::vector<size_t> levels;
+};
+
+/* How startElement receives attributes */
+enum AttributesMode {
+  /* { name: value, ... } */
+  ATTRIBUTES_OBJECT,
+  /* [name, value, name, value, ...] */
+  ATTRIBUTES_ARRAY,
+  /* read-only view of expat's atts, valid during the callback */
+  ATTRIBUTES_LAZY
+};
+
+struct ParserOptions {
+  /* Deliver events once per parse() call */
+  bool batch = false;
+  /* Number of distinct names kept in the NameCache */
+  uint32_t nameCacheSize = 256;
+  /* Parse Buffers in place with XML_ParseExternal */
+  bool zeroCopy = false;
+  /* Emit only elements matching these paths */
+  std::unique_ptr<Selector> selector;
+  /* Join adjacent text callbacks into one text event */
+  bool coalesceText = false;
+  AttributesMode attributes = ATTRIBUTES_OBJECT;
+  /* Resolve namespaces with XML_ParserCreateNS */
+  bool namespaces = false;
+  /* Allocate expat's memory from a per-parser Arena */
+  bool arena = false;
+  /* Trim memory above this many bytes between parse() calls, 0 never */
+  uint32_t memoryHighWaterMark = 0;
+  /* ...once it stayed above the mark for this many calls */
+  uint32_t memoryDecay = 1;
+};
+
+class Parser : public Nan::ObjectWrap {
+public:
+  static void Initialize(Local<Object> target)
+  {
+    Nan::HandleScope scope;
+    Local<FunctionTemplate> t = Nan::New<FunctionTemplate>(New);
+
+    t->InstanceTemplate()->SetInternalFieldCount(1);
+
+    Nan::SetPrototypeMethod(t, "parse", Parse);
+    Nan::SetPrototypeMethod(t, "parseAsync", ParseAsync);
+    Nan::SetPrototypeMethod(t, "parseParallel", ParseParallel);
+    Nan::SetPrototypeMethod(t, "parseRecords", ParseRecords);
+    Nan::SetPrototypeMethod(t, "parseDocuments", ParseDocuments);
+    Nan::SetPrototypeMethod(t, "parseFile", ParseFile);
+    Nan::SetPrototypeMethod(t, "parseFd", ParseFd);
+    Nan::SetPrototypeMethod(t, "setEncoding", SetEncoding);
+    Nan::SetPrototypeMethod(t, "setUnknownEncoding", SetUnknownEncoding);
+    Nan::SetPrototypeMethod(t, "getError", GetError);
+    Nan::SetPrototypeMethod(t, "stop", Stop);
+    Nan::SetPrototypeMethod(t, "resume", Resume);
+    Nan::SetPrototypeMethod(t, "suspend", Suspend);
+    Nan::SetPrototypeMethod(t, "reset", Reset);
+    Nan::SetPrototypeMethod(t, "getCurrentLineNumber", GetCurrentLineNumber);
+    Nan::SetPrototypeMethod(t, "getCurrentColumnNumber", GetCurrentColumnNumber);
+    Nan::SetPrototypeMethod(t, "getCurrentByteIndex", GetCurrentByteIndex);
+    Nan::SetPrototypeMethod(t, "getStats", GetStats);
+    Nan::SetPrototypeMethod(t, "getMemoryUsage", GetMemoryUsage);
+    Nan::SetPrototypeMethod(t, "setEventMask", SetEventMask);
+    Nan::SetAccessor(t->InstanceTemplate(), Nan::New("emit").ToLocalChecked(), GetEmit, SetEmit);
+
+    static const char *names[EVENT_COUNT] = {
+      "startElement", "endElement", "text", "startCdata", "endCdata",
+      "processingInstruction", "comment", "xmlDecl", "entityDecl",
+      "startNamespaceDecl", "endNamespaceDecl", "unknownEncoding", "batch"
+    };
+    for (int i = 0; i < EVENT_COUNT; i++)
+      eventNames[i].Reset(Nan::New(names[i]).ToLocalChecked());
+
+    Local<ObjectTemplate> attrs = Nan::New<ObjectTemplate>();
+    attrs->SetInternalFieldCount(2);
+    Nan::SetNamedPropertyHandler(attrs, GetAttribute, SetAttribute,
+                                 QueryAttribute, 0, EnumerateAttributes);
+    lazyAttributesTemplate.Reset(attrs);
+
+    Nan::Set(target, Nan::New("Parser").ToLocalChecked(), Nan::GetFunction(t).ToLocalChecked());
+  }
+
+protected:
+  /*** Constructor ***/
+
+  static NAN_METHOD(New)
+  {
+    Nan::HandleScope scope;
+    XML_Char *encoding = NULL;
+    if (info.Length() >= 1 && info[0]->IsString())
+      {
+        Nan::Utf8String encodingArg(info[0]);
+        encoding = new XML_Char[encodingArg.length() + 1];
+        strcpy(encoding, *encodingArg);
+      }
+
+    /* Argument 2: options :: Object */
+    ParserOptions options;
+    if (info.Length() >= 2 && info[1]->IsObject())
+      {
+        Local<Object> obj = Nan::To<Object>(info[1]).ToLocalChecked();
+        options.batch = GetBoolOption(obj, "batch");
+        options.nameCacheSize = GetUint32Option(obj, "nameCacheSize", options.nameCacheSize);
+        options.zeroCopy = GetBoolOption(obj, "zeroCopy");
+        options.coalesceText = GetBoolOption(obj, "coalesceText");
+        options.namespaces = GetBoolOption(obj, "namespaces");
+        options.arena = GetBoolOption(obj, "arena");
+        options.memoryHighWaterMark = GetUint32Option(obj, "memoryHighWaterMark", options.memoryHighWaterMark);
+        options.memoryDecay = GetUint32Option(obj, "memoryDecay", options.memoryDecay);
+        if (!GetAttributesOption(obj, options.attributes))
+          {
+            if (encoding)
+              delete[] encoding;
+            return;
+          }
+
+        Local<Value> select = Nan::Get(obj, Nan::New("select").ToLocalChecked()).ToLocalChecked();
+        if (!select->IsUndefined() && !GetSelector(select, options.selector))
+          {
+            if (encoding)
+              delete[] encoding;
+            return;
+          }
+      }
+
+    Parser *parser = new Parser(encoding, options);
+    if (encoding)
+      delete[] encoding;
+    parser->Wrap(info.This());
+    info.GetReturnValue().Set(info.This());
+  }
+
+  /* select :: String or Array of Strings */
+  static bool GetSelector(Local<Value> select, std::unique_ptr<Selector> &selector)
+  {
+    selector.reset(new Selector());
+    Local<Array> exprs;
+    if (select->IsArray())
+      exprs = select.As<Array>();
+    else
+      {
+        exprs = Nan::New<Array>();
+        Nan::Set(exprs, 0, select);
+      }
+    for (uint32_t i = 0; i < exprs->Length(); i++)
+      {
+        Local<Value> expr = Nan::Get(exprs, i).ToLocalChecked();
+        const char *error = "Selector must be a string";
+        if (expr->IsString())
+          error = selector->Add(*Nan::Utf8String(expr));
+        if (error)
+          {
+            Nan::ThrowTypeError(error);
+            return false;
+          }
+      }
+    return true;
+  }
+
+  /* attributes :: 'object', 'array' or 'lazy' */
+  static bool GetAttributesOption(Local<Object> options, AttributesMode &mode)
+  {
+    Local<Value> value = Nan::Get(options, Nan::New("attributes").ToLocalChecked()).ToLocalChecked();
+    if (value->IsUndefined())
+      return true;
+    std::string name = value->IsString() ? *Nan::Utf8String(value) : "";
+    if (name == "object")
+      mode = ATTRIBUTES_OBJECT;
+    else if (name == "array")
+      mode = ATTRIBUTES_ARRAY;
+    else if (name == "lazy")
+      mode = ATTRIBUTES_LAZY;
+    else
+      {
+        Nan::ThrowTypeError("attributes must be 'object', 'array' or 'lazy'");
+        return false;
+      }
+    return true;
+  }
+
+  static bool GetBoolOption(Local<Object> options, const char *name)
+  {
+    Local<Value> value = Nan::Get(options, Nan::New(name).ToLocalChecked()).ToLocalChecked();
+    return Nan::To<bool>(value).FromJust();
+  }
+
+  static uint32_t GetUint32Option(Local<Object> options, const char *name, uint32_t defaultValue)
+  {
+    Local<Value> value = Nan::Get(options, Nan::New(name).ToLocalChecked()).ToLocalChecked();
+    if (value->IsUndefined())
+      return defaultValue;
+    return Nan::To<uint32_t>(value).FromJust();
+  }
+
+  Parser(const XML_Char *encoding, ParserOptions &options)
+    : Nan::ObjectWrap(), arena(new Arena(options.arena)), reportedMemory(0),
+      batch(options.batch), recording(options.batch),
+      busy(false), parsing(false), eventMask(~0u), pendingMask(0), maskPending(false),
+      names(options.nameCacheSize),
+      zeroCopy(options.zeroCopy), selector(std::move(options.selector)),
+      coalesceText(options.coalesceText), attributes(options.attributes),
+      currentAtts(NULL), namespaces(options.namespaces),
+      memoryHighWaterMark(options.memoryHighWaterMark),
+      memoryDecay(options.memoryDecay), callsAboveMark(0), bytesReclaimed(0),
+      parallelSlices(0), parallelEnded(false),
+      endLine(1), endColumn(0), endByteIndex(-1)
+  {
+    Arena::Scope memory(arena.get());
+    XML_Char separator[2] = { NS_SEPARATOR, '\0' };
+    parser = XML_ParserCreate_MM(encoding, &Arena::suite,
+                                 namespaces ? separator : NULL);
+    assert(parser != NULL);
+    if (encoding)
+      encodingName = encoding;
+
+    attachHandlers();
+    reportMemory();
+  }
+
+  ~Parser()
+  {
+    XML_ParserFree(parser);
+    /* arena now releases all of its chunks */
+    adjustExternalMemory(-reportedMemory);
+  }
+
+  /** Installs handlers only for events in eventMask, so that expat
+      skips the others without calling us */
+  void attachHandlers()
+  {
+    /* The selector has to see every element, and text is only joined
+       within element boundaries */
+    bool elements = selector != nullptr || coalesceText;
+
+    XML_SetUserData(parser, this);
+    XML_SetStartElementHandler(parser, elements || listening(EventTape::START_ELEMENT) ? StartElement : NULL);
+    XML_SetEndElementHandler(parser, elements || listening(EventTape::END_ELEMENT) ? EndElement : NULL);
+    XML_SetCharacterDataHandler(parser, listening(EventTape::TEXT) ? Text : NULL);
+    XML_SetStartCdataSectionHandler(parser, listening(EventTape::START_CDATA) ? StartCdata : NULL);
+    XML_SetEndCdataSectionHandler(parser, listening(EventTape::END_CDATA) ? EndCdata : NULL);
+    XML_SetProcessingInstructionHandler(parser, listening(EventTape::PROCESSING_INSTRUCTION) ? ProcessingInstruction : NULL);
+    XML_SetCommentHandler(parser, listening(EventTape::COMMENT) ? Comment : NULL);
+    XML_SetXmlDeclHandler(parser, listening(EventTape::XML_DECL) ? XmlDecl : NULL);
+    XML_SetEntityDeclHandler(parser, listening(EventTape::ENTITY_DECL) ? EntityDecl : NULL);
+    if (namespaces)
+      XML_SetNamespaceDeclHandler(parser,
+                                  listening(EventTape::START_NAMESPACE_DECL) ? StartNamespaceDecl : NULL,
+                                  listening(EventTape::END_NAMESPACE_DECL) ? EndNamespaceDecl : NULL);
+    XML_SetUnknownEncodingHandler(parser, UnknownEncoding, this);
+  }
+
+  bool listening(EventTape::Type type) const
+  {
+    return (eventMask & (1u << type)) != 0;
+  }
+
+  /*** setEventMask() ***/
+
+  /**
+   * Argument: bit (1 << type) set for each event with listeners, in
+   * the order of EventTape::Type. lib/node-expat.js keeps it up to date.
+   */
+  static NAN_METHOD(SetEventMask)
+  {
+    Parser *parser = Nan::ObjectWrap::Unwrap<Parser>(info.This());
+    Nan::HandleScope scope;
+
+    if (info.Length() < 1 || !info[0]->IsUint32())
+      {
+        Nan::ThrowTypeError("setEventMask expects an unsigned integer");
+        return;
+      }
+    uint32_t mask = Nan::To<uint32_t>(info[0]).FromJust();
+    /* A running worker reads the mask off the main thread: it keeps
+       the old one, and this one applies once it is done */
+    if (parser->busy)
+      {
+        parser->pendingMask = mask;
+        parser->maskPending = true;
+        return;
+      }
+    parser->eventMask = mask;
+    parser->attachHandlers();
+  }
+
+  /*** parse() ***/
+
+  static NAN_METHOD(Parse)
+  {
+    Parser *parser = Nan::ObjectWrap::Unwrap<Parser>(info.This());
+    Nan::HandleScope scope;
+    int isFinal = 0;
+
+    if (!parser->checkIdle())
+      return;
+
+    /* Argument 2: isFinal :: Bool */
+    if (info.Length() >= 2)
+      {
+        isFinal = info[1]->IsTrue();
+      }
+
+    /* Argument 1: buf :: String or Buffer */
+    bool result;
+    if (info.Length() >= 1 && info[0]->IsString())
+      {
+        Local<String> str = Nan::To<String>(info[0]).ToLocalChecked();
+        result = parser->parseString(str, isFinal);
+      }
+    else if (info.Length() >= 1 && info[0]->IsObject())
+      {
+        Local<Object> obj = Nan::To<Object>(info[0]).ToLocalChecked();
+        if (Buffer::HasInstance(obj))
+        {
+          result = parser->parseBuffer(obj, isFinal);
+        }
+        else
+        {
+          Nan::ThrowTypeError("Parse buffer must be String or Buffer");
+          return;
+        }
+      }
+    else {
+      Nan::ThrowTypeError("Parse buffer must be String or Buffer");
+      return;
+    }
+
+    parser->flushText();
+    parser->flushBatch();
+    parser->trimMemory(false);
+    parser->reportMemory();
+    info.GetReturnValue().Set(result ? Nan::True() : Nan::False());
+  }
+
+  /** Parse a v8 String by first writing it to the expat parser's
+      buffer */
+  bool parseString(Local<String> str, int isFinal)
+  {
+    Arena::Scope memory(arena.get());
+    ParsingScope calling(parsing);
+    Isolate *isolate = Isolate::GetCurrent();
+    int len = str->Utf8Length(isolate);
+    /* expat has no buffer to give for nothing, but must still learn
+       that the document ends, unless it was stopped (as by destroy()) */
+    if (len == 0)
+      {
+        XML_ParsingStatus status;
+        XML_GetParsingStatus(parser, &status);
+        if (!isFinal || status.parsing == XML_SUSPENDED || status.parsing == XML_FINISHED)
+          return true;
+        return XML_Parse(parser, NULL, 0, isFinal) != XML_STATUS_ERROR;
+      }
+
+    char *buf = static_cast<char *>(XML_GetBuffer(parser, len));
+    if (buf == NULL)
+      return false;
+
+    if (str->IsOneByte() && len == str->Length())
+      /* Pure ASCII: the Latin-1 representation already is UTF-8 */
+      str->WriteOneByte(isolate, reinterpret_cast<uint8_t *>(buf), 0, len,
+                        String::NO_NULL_TERMINATION);
+    else
+      str->WriteUtf8(isolate, buf, len, NULL,
+                     String::NO_NULL_TERMINATION | String::REPLACE_INVALID_UTF8);
+
+    return XML_ParseBuffer(parser, len, isFinal) != XML_STATUS_ERROR;
+  }
+
+  /** Parse a node.js Buffer directly */
+  bool parseBuffer(Local<Object> buffer, int isFinal)
+  {
+    /* expat may keep pointing into the Buffer until the next call */
+    if (zeroCopy)
+      lastBuffer.Reset(buffer);
+    return parseBytes(Buffer::Data(buffer), Buffer::Length(buffer), isFinal);
+  }
+
+  /** Touches no V8 state, so parseAsync() may call it off the main
+      thread. inPlace is for data that outlives the parse, like
+      parseFile()'s mapping, which expat then needn't copy. */
+  bool parseBytes(const char *data, size_t len, int isFinal, bool inPlace = false)
+  {
+    Arena::Scope memory(arena.get());
+    ParsingScope calling(parsing);
+    if (zeroCopy || inPlace)
+      return XML_ParseExternal(parser, data, len, isFinal) != XML_STATUS_ERROR;
+    return XML_Parse(parser, data, len, isFinal) != XML_STATUS_ERROR;
+  }
+
+  /*** parseAsync() ***/
+
+  static NAN_METHOD(ParseAsync);
+
+  /*** parseParallel() ***/
+
+  static NAN_METHOD(ParseParallel);
+  static NAN_METHOD(ParseRecords);
+  static NAN_METHOD(ParseDocuments);
+  static NAN_METHOD(ParseFile);
+  static NAN_METHOD(ParseFd);
+
+  /** Throws if parseAsync() is still working on this parser */
+  bool checkIdle()
+  {
+    if (busy)
+      {
+        Nan::ThrowError("Parser is busy with parseAsync()");
+        return false;
+      }
+    return true;
+  }
+
+  /** Hands the parser back to the main thread when a worker is done,
+      with the event mask set meanwhile */
+  void idle()
+  {
+    busy = false;
+    if (maskPending)
+      {
+        eventMask = pendingMask;
+        maskPending = false;
+      }
+    recording = batch;
+    attachHandlers();
+  }
+
+  /*** setEncoding() ***/
+
+  static NAN_METHOD(SetEncoding)
+  {
+    Parser *parser = Nan::ObjectWrap::Unwrap<Parser>(info.This());
+    Nan::HandleScope scope;
+
+    if (!parser->checkIdle())
+      return;
+
+    if (info.Length() == 1 && info[0]->IsString())
+      {
+        Nan::Utf8String encoding(info[0]);
+        int status = parser->setEncoding(*encoding);
+        parser->reportMemory();
+
+        info.GetReturnValue().Set(status ? Nan::True() : Nan::False());
+      }
+    else
+      info.GetReturnValue().Set(Nan::False());
+  }
+
+  int setEncoding(XML_Char *encoding)
+  {
+    Arena::Scope memory(arena.get());
+    if (XML_SetEncoding(parser, encoding) == 0)
+      return 0;
+    encodingName = encoding;
+    return 1;
+  }
+
+  /*** getError() ***/
+
+  static NAN_METHOD(GetError)
+  {
+    Nan::HandleScope scope;
+    Parser *parser = Nan::ObjectWrap::Unwrap<Parser>(info.This());
+
+    if (!parser->checkIdle())
+      return;
+
+    const XML_LChar *error = parser->getError();
+    if (error)
+      info.GetReturnValue().Set(Nan::New(error).ToLocalChecked());
+    else
+      info.GetReturnValue().Set(Nan::Null());
+  }
+
+  /*** stop() ***/
+
+  static NAN_METHOD(Stop)
+  {
+    Nan::HandleScope scope;
+    Parser *parser = Nan::ObjectWrap::Unwrap<Parser>(info.This());
+
+    if (!parser->checkIdle())
+      return;
+
+    int status = parser->stop();
+
+    info.GetReturnValue().Set(status ? Nan::True() : Nan::False());
+  }
+
+  int stop()
+  {
+    return XML_StopParser(parser, XML_TRUE) != 0;
+  }
+
+  /*** resume() ***/
+
+  static NAN_METHOD(Resume)
+  {
+    Nan::HandleScope scope;
+    Parser *parser = Nan::ObjectWrap::Unwrap<Parser>(info.This());
+
+    if (!parser->checkIdle())
+      return;
+
+    int status = parser->resume();
+    parser->flushText();
+    parser->flushBatch();
+    parser->trimMemory(false);
+    parser->reportMemory();
+
+    info.GetReturnValue().Set(status ? Nan::True() : Nan::False());
+  }
+
+  int resume()
+  {
+    Arena::Scope memory(arena.get());
+    ParsingScope calling(parsing);
+    return XML_ResumeParser(parser) != 0;
+  }
+
+  /*** suspend() ***/
+
+  /**
+   * Like stop(), but only takes effect from an event handler while
+   * expat is inside parse() or resume(). That call then returns and
+   * the rest of its input waits in expat for resume(). Returns whether
+   * the parser was suspended; events recorded in batch mode are
+   * emitted after expat returned, so it never is there.
+   */
+  static NAN_METHOD(Suspend)
+  {
+    Nan::HandleScope scope;
+    Parser *parser = Nan::ObjectWrap::Unwrap<Parser>(info.This());
+
+    if (!parser->checkIdle())
+      return;
+
+    info.GetReturnValue().Set(parser->suspend() ? Nan::True() : Nan::False());
+  }
+
+  bool suspend()
+  {
+    return parsing && XML_StopParser(parser, XML_TRUE) == XML_STATUS_OK;
+  }
+
+  /** Sets a flag for the duration of a call into expat */
+  class ParsingScope {
+  public:
+    explicit ParsingScope(bool &flag)
+      : flag(flag)
+    {
+      flag = true;
+    }
+
+    ~ParsingScope()
+    {
+      flag = false;
+    }
+
+  private:
+    bool &flag;
+  };
+
+  static NAN_METHOD(Reset)
+  {
+    Nan::HandleScope scope;
+    Parser *parser = Nan::ObjectWrap::Unwrap<Parser>(info.This());
+
+    if (!parser->checkIdle())
+      return;
+
+    XML_Char *encoding = NULL;
+    if (info.Length() == 1 && info[0]->IsString())
+      {
+        Nan::Utf8String encodingArg(info[0]);
+        encoding = new XML_Char[encodingArg.length() + 1];
+        strcpy(encoding, *encodingArg);
+      }
+
+    int status = parser->reset(encoding);
+    if (encoding)
+      delete[] encoding;
+    if (status)
+      parser->attachHandlers();
+    parser->trimMemory(true);
+    parser->reportMemory();
+    info.GetReturnValue().Set(status ? Nan::True() : Nan::False());
+  }
+
+  int reset(XML_Char *encoding)
+  {
+      tape.Clear();
+      lastBuffer.Reset();
+      pendingText.clear();
+      if (selector)
+        selector->Reset();
+      encodingName = encoding ? encoding : "";
+      parallelEnded = false;
+      Arena::Scope memory(arena.get());
+      return XML_ParserReset(parser, encoding) != 0;
+  }
+  const XML_LChar *getError()
+  {
+    enum XML_Error code;
+    code = XML_GetErrorCode(parser);
+    return XML_ErrorString(code);
+  }
+
+  static NAN_METHOD(GetCurrentLineNumber)
+  {
+    Nan::HandleScope scope;
+    Parser *parser = Nan::ObjectWrap::Unwrap<Parser>(info.This());
+
+    if (!parser->checkIdle())
+      return;
+
+    info.GetReturnValue().Set(Nan::New(parser->getCurrentLineNumber()));
+  }
+
+  uint32_t getCurrentLineNumber()
+  {
+    if (parallelEnded)
+      return endLine;
+    return XML_GetCurrentLineNumber(parser);
+  }
+
+  static NAN_METHOD(GetCurrentColumnNumber)
+  {
+    Nan::HandleScope scope;
+    Parser *parser = Nan::ObjectWrap::Unwrap<Parser>(info.This());
+
+    if (!parser->checkIdle())
+      return;
+
+    info.GetReturnValue().Set(Nan::New(parser->getCurrentColumnNumber()));
+  }
+
+  uint32_t getCurrentColumnNumber()
+  {
+    if (parallelEnded)
+      return endColumn;
+    return XML_GetCurrentColumnNumber(parser);
+  }
+
+  static NAN_METHOD(GetCurrentByteIndex)
+  {
+    Nan::HandleScope scope;
+    Parser *parser = Nan::ObjectWrap::Unwrap<Parser>(info.This());
+
+    if (!parser->checkIdle())
+      return;
+
+    info.GetReturnValue().Set(Nan::New(parser->getCurrentByteIndex()));
+  }
+
+  int32_t getCurrentByteIndex()
+  {
+    if (parallelEnded)
+      return endByteIndex;
+    return XML_GetCurrentByteIndex(parser);
+  }
+
+  /*** getStats() ***/
+
+  static NAN_METHOD(GetStats)
+  {
+    Nan::HandleScope scope;
+    Parser *parser = Nan::ObjectWrap::Unwrap<Parser>(info.This());
+
+    if (!parser->checkIdle())
+      return;
+
+    Local<Object> stats = Nan::New<Object>();
+    Nan::Set(stats, Nan::New("bytesCopied").ToLocalChecked(),
+             Nan::New<Number>(static_cast<double>(XML_GetCopiedByteCount(parser->parser))));
+    Nan::Set(stats, Nan::New("bytesReclaimed").ToLocalChecked(),
+             Nan::New<Number>(parser->bytesReclaimed));
+    Nan::Set(stats, Nan::New("parallelSlices").ToLocalChecked(),
+             Nan::New<Number>(parser->parallelSlices));
+    if (parser->arena->IsPooled())
+      {
+        const Arena::Stats &memory = parser->arena->GetStats();
+        Local<Object> arena = Nan::New<Object>();
+        Nan::Set(arena, Nan::New("bytesInUse").ToLocalChecked(),
+                 Nan::New<Number>(static_cast<double>(memory.bytesInUse)));
+        Nan::Set(arena, Nan::New("bytesReserved").ToLocalChecked(),
+                 Nan::New<Number>(static_cast<double>(memory.bytesReserved)));
+        Nan::Set(arena, Nan::New("allocations").ToLocalChecked(),
+                 Nan::New<Number>(static_cast<double>(memory.allocations)));
+        Nan::Set(arena, Nan::New("frees").ToLocalChecked(),
+                 Nan::New<Number>(static_cast<double>(memory.frees)));
+        Nan::Set(stats, Nan::New("arena").ToLocalChecked(), arena);
+      }
+    info.GetReturnValue().Set(stats);
+  }
+
+  /*** getMemoryUsage() ***/
+
+  /** Native bytes held by expat and the event tape */
+  size_t memoryFootprint() const
+  {
+    return arena->GetStats().bytesReserved + tape.Capacity();
+  }
+
+  /**
+   * memoryHighWaterMark option: between parse() calls, once expat and
+   * the tape have held more than the mark for memoryDecay calls in a
+   * row, returns expat's oversized buffers and cached blocks and the
+   * tape's storage. force skips the decay, for reset().
+   */
+  void trimMemory(bool force)
+  {
+    if (memoryHighWaterMark == 0)
+      return;
+    if (arena->GetStats().bytesInUse + tape.Capacity() <= memoryHighWaterMark)
+      {
+        callsAboveMark = 0;
+        return;
+      }
+    if (!force && ++callsAboveMark < memoryDecay)
+      return;
+    callsAboveMark = 0;
+
+    /* Blocks freed into a pooled arena's free lists stay reserved:
+       only what the footprint loses counts as reclaimed */
+    size_t before = memoryFootprint();
+    {
+      Arena::Scope memory(arena.get());
+      XML_TrimMemory(parser, 0);
+    }
+    if (tape.IsEmpty())
+      tape.Trim();
+    size_t after = memoryFootprint();
+    if (after < before)
+      bytesReclaimed += before - after;
+  }
+
+  /** Tells V8 about native memory growth and shrinkage, so that
+      paused parsers holding large buffers count towards GC pressure */
+  void reportMemory()
+  {
+    int64_t current = static_cast<int64_t>(memoryFootprint());
+    if (current != reportedMemory)
+      {
+        adjustExternalMemory(current - reportedMemory);
+        reportedMemory = current;
+      }
+  }
+
+  /* Nan::AdjustExternalMemory() takes an int, too small for footprints
+     past 2 GiB */
+  static void adjustExternalMemory(int64_t change)
+  {
+    Isolate::GetCurrent()->AdjustAmountOfExternalAllocatedMemory(change);
+  }
+
+  static NAN_METHOD(GetMemoryUsage)
+  {
+    Nan::HandleScope scope;
+    Parser *parser = Nan::ObjectWrap::Unwrap<Parser>(info.This());
+
+    if (!parser->checkIdle())
+      return;
+
+    XML_MemoryUsage usage;
+    XML_GetMemoryUsage(parser->parser, &usage);
+    size_t expat = parser->arena->GetStats().bytesReserved;
+    size_t known = usage.bufferBytes + usage.poolBytes + usage.dtdBytes;
+    size_t events = parser->memoryFootprint() - expat;
+
+    Local<Object> result = Nan::New<Object>();
+    Nan::Set(result, Nan::New("total").ToLocalChecked(),
+             Nan::New<Number>(static_cast<double>(expat + events)));
+    Nan::Set(result, Nan::New("buffer").ToLocalChecked(),
+             Nan::New<Number>(static_cast<double>(usage.bufferBytes)));
+    Nan::Set(result, Nan::New("pools").ToLocalChecked(),
+             Nan::New<Number>(static_cast<double>(usage.poolBytes)));
+    Nan::Set(result, Nan::New("dtd").ToLocalChecked(),
+             Nan::New<Number>(static_cast<double>(usage.dtdBytes)));
+    Nan::Set(result, Nan::New("other").ToLocalChecked(),
+             Nan::New<Number>(static_cast<double>(expat > known ? expat - known : 0)));
+    Nan::Set(result, Nan::New("events").ToLocalChecked(),
+             Nan::New<Number>(static_cast<double>(events)));
+    info.GetReturnValue().Set(result);
+  }
+
+private:
+  /* allocates expat's memory; outlives parser */
+  std::unique_ptr<Arena> arena;
+  /* bytes last reported to V8 with adjustExternalMemory() */
+  int64_t reportedMemory;
+
+  /* expat instance */
+  XML_Parser parser;
+  /* encoding given to the constructor, setEncoding() or reset() */
+  std::string encodingName;
+
+  /* batch mode: record events and emit them once per parse() */
+  bool batch;
+  /* callbacks append to tape: batch mode or parseAsync() running */
+  bool recording;
+  EventTape tape;
+
+  /* parseAsync() owns the expat instance until it completes */
+  bool busy;
+  /* expat is reporting events from parse() or resume(), see suspend() */
+  bool parsing;
+
+  /* events with listeners, see setEventMask() */
+  uint32_t eventMask;
+  /* set while busy, applied by idle() */
+  uint32_t pendingMask;
+  bool maskPending;
+
+  /* element and attribute names */
+  NameCache names;
+
+  /* zero-copy mode: holds the input that expat may still refer to */
+  bool zeroCopy;
+  Nan::Persistent<Object> lastBuffer;
+
+  /* select option, if any */
+  std::unique_ptr<Selector> selector;
+
+  /* coalesceText: character data not yet emitted */
+  bool coalesceText;
+  std::string pendingText;
+
+  /* attributes option; the lazy view reads currentAtts */
+  AttributesMode attributes;
+  const XML_Char **currentAtts;
+  Nan::Persistent<Object> lazyAttributes;
+  std::vector<Local<Value> > attributeValues;
+
+  /* namespaces option: expat reports names as uri NS_SEPARATOR local */
+  static const XML_Char NS_SEPARATOR = '\x01';
+  bool namespaces;
+  std::string clarkName;
+
+  /* memoryHighWaterMark and memoryDecay options, see trimMemory() */
+  uint32_t memoryHighWaterMark;
+  uint32_t memoryDecay;
+  uint32_t callsAboveMark;
+  double bytesReclaimed;
+
+  /* slices the last parseParallel() parsed concurrently, 1 for none */
+  double parallelSlices;
+  /* Set once slices parsed the document: expat is then marked finished
+     without having seen it, and the position getters report its end */
+  bool parallelEnded;
+  XML_Size endLine;
+  XML_Size endColumn;
+  XML_Index endByteIndex;
+
+  /* parser.emit, set by lib/node-expat.js */
+  Nan::Callback emitCallback;
+
+  /* no default ctor */
+  Parser();
 
   /*** SAX callbacks ***/
   /* Should a local HandleScope be used in those callbacks? */
 
-  static void StartElement(void *userData,
-                           const XML_Char *name, const XML_Char **atts)
+  static void StartElement(void *userData,
+                           const XML_Char *name, const XML_Char **atts)
+  {
+    Parser *parser = reinterpret_cast<Parser *>(userData);
+    parser->flushText();
+
+    if (parser->selector && !parser->selector->Start(parser->localName(name), atts))
+      return;
+    if (!parser->listening(EventTape::START_ELEMENT))
+      return;
+
+    if (parser->recording)
+      {
+        parser->tape.StartElement(name, atts);
+        return;
+      }
+
+    Nan::HandleScope scope;
+
+    Local<Value> attr;
+    if (parser->attributes == ATTRIBUTES_ARRAY)
+      {
+        for(const XML_Char **atts1 = atts; *atts1; atts1 += 2)
+          {
+            parser->attributeValues.push_back(parser->attributeName(atts1[0]));
+            parser->attributeValues.push_back(Nan::New(atts1[1]).ToLocalChecked());
+          }
+        attr = parser->takeAttributeArray();
+      }
+    else if (parser->attributes == ATTRIBUTES_LAZY)
+      {
+        attr = parser->getLazyAttributes();
+        parser->currentAtts = atts;
+      }
+    else
+      {
+        /* Collect atts into JS object */
+        Local<Object> obj = Nan::New<Object>();
+        for(const XML_Char **atts1 = atts; *atts1; atts1 += 2)
+          Nan::Set(obj, parser->attributeName(atts1[0]), Nan::New(atts1[1]).ToLocalChecked());
+        attr = obj;
+      }
+
+    /* Trigger event */
+    Local<Value> argv[4] = { EventName(EventTape::START_ELEMENT),
+                              Local<Value>(),
+                              attr,
+                              Local<Value>() };
+    parser->elementName(name, argv[1], argv[3]);
+    parser->Emit(parser->namespaces ? 4 : 3, argv);
+    parser->currentAtts = NULL;
+  }
+
+  /*** Namespaces ***/
+
+  /** Name as the selector sees it: the local name in namespace mode */
+  const XML_Char *localName(const XML_Char *name) const
+  {
+    if (namespaces)
+      {
+        const XML_Char *sep = strchr(name, NS_SEPARATOR);
+        if (sep)
+          return sep + 1;
+      }
+    return name;
+  }
+
+  /**
+   * Element name arguments: the name, or in namespace mode the local
+   * name and the namespace URI (null outside any namespace), both
+   * interned.
+   */
+  void elementName(std::string_view name, Local<Value> &local, Local<Value> &uri)
+  {
+    size_t sep = namespaces ? name.find(NS_SEPARATOR) : std::string_view::npos;
+    if (sep == std::string_view::npos)
+      {
+        local = names.Get(name.data(), name.size());
+        uri = Nan::Null();
+      }
+    else
+      {
+        local = names.Get(name.data() + sep + 1, name.size() - sep - 1);
+        uri = names.Get(name.data(), sep);
+      }
+  }
+
+  /** Namespaced attributes are keyed in Clark notation, {uri}local */
+  std::string_view attributeKey(std::string_view name)
+  {
+    size_t sep = namespaces ? name.find(NS_SEPARATOR) : std::string_view::npos;
+    if (sep == std::string_view::npos)
+      return name;
+    clarkName.assign("{");
+    clarkName.append(name.data(), sep);
+    clarkName.append("}");
+    clarkName.append(name.data() + sep + 1, name.size() - sep - 1);
+    return clarkName;
+  }
+
+  Local<String> attributeName(std::string_view name)
+  {
+    std::string_view key = attributeKey(name);
+    return names.Get(key.data(), key.size());
+  }
+
+  /** Builds [name, value, ...] from attributeValues in one call */
+  Local<Array> takeAttributeArray()
+  {
+    Local<Array> array = Array::New(Isolate::GetCurrent(),
+                                    attributeValues.data(),
+                                    attributeValues.size());
+    attributeValues.clear();
+    return array;
+  }
+
+  /**
+   * The object through which the lazy view is read, reused across
+   * callbacks. It keeps the parser alive while JS holds on to it; the
+   * parser only holds it weakly.
+   */
+  Local<Object> getLazyAttributes()
+  {
+    if (lazyAttributes.IsEmpty())
+      {
+        Local<Object> obj = Nan::NewInstance(Nan::New(lazyAttributesTemplate)).ToLocalChecked();
+        Nan::SetInternalFieldPointer(obj, 0, this);
+        obj->SetInternalField(1, handle());
+        lazyAttributes.Reset(obj);
+        lazyAttributes.SetWeak();
+      }
+    return Nan::New(lazyAttributes);
+  }
+
+  /*** Lazy attributes view ***/
+
+  /** Value of the attribute while its startElement is emitted, or NULL */
+  const XML_Char *findAttribute(Local<String> property)
+  {
+    if (!currentAtts || !property->IsString())
+      return NULL;
+    Nan::Utf8String name(property);
+    std::string_view wanted(*name, name.length());
+    for(const XML_Char **atts1 = currentAtts; *atts1; atts1 += 2)
+      if (attributeKey(atts1[0]) == wanted)
+        return atts1[1];
+    return NULL;
+  }
+
+  static Parser *AttributesOwner(Local<Object> holder)
+  {
+    return static_cast<Parser *>(Nan::GetInternalFieldPointer(holder, 0));
+  }
+
+  static NAN_PROPERTY_GETTER(GetAttribute)
+  {
+    const XML_Char *value = AttributesOwner(info.Holder())->findAttribute(property);
+    if (value)
+      info.GetReturnValue().Set(Nan::New(value).ToLocalChecked());
+  }
+
+  /* The view is read-only: assignments are swallowed */
+  static NAN_PROPERTY_SETTER(SetAttribute)
+  {
+    info.GetReturnValue().Set(value);
+  }
+
+  static NAN_PROPERTY_QUERY(QueryAttribute)
+  {
+    if (AttributesOwner(info.Holder())->findAttribute(property))
+      info.GetReturnValue().Set(Nan::New<Integer>(static_cast<int32_t>(ReadOnly)));
+  }
+
+  static NAN_PROPERTY_ENUMERATOR(EnumerateAttributes)
+  {
+    Parser *parser = AttributesOwner(info.Holder());
+    Local<Array> keys = Nan::New<Array>();
+    uint32_t index = 0;
+    if (parser->currentAtts)
+      for(const XML_Char **atts1 = parser->currentAtts; *atts1; atts1 += 2)
+        Nan::Set(keys, index++, parser->attributeName(atts1[0]));
+    info.GetReturnValue().Set(keys);
+  }
+
+  static void EndElement(void *userData,
+                         const XML_Char *name)
+  {
+    Parser *parser = reinterpret_cast<Parser *>(userData);
+    parser->flushText();
+
+    if (parser->selector && !parser->selector->End())
+      return;
+    if (!parser->listening(EventTape::END_ELEMENT))
+      return;
+
+    if (parser->recording)
+      {
+        parser->tape.EndElement(name);
+        return;
+      }
+
+    Nan::HandleScope scope;
+
+    /* Trigger event */
+    Local<Value> argv[3] = { EventName(EventTape::END_ELEMENT) };
+    parser->elementName(name, argv[1], argv[2]);
+    parser->Emit(parser->namespaces ? 3 : 2, argv);
+  }
+
+  /* prefix is null for the default namespace, uri for xmlns="" */
+  static void StartNamespaceDecl(void *userData,
+                                 const XML_Char *prefix, const XML_Char *uri)
+  {
+    Parser *parser = reinterpret_cast<Parser *>(userData);
+    parser->flushText();
+
+    if (parser->selector && !parser->selector->InSubtree())
+      return;
+
+    if (parser->recording)
+      {
+        parser->tape.StartNamespaceDecl(prefix, uri);
+        return;
+      }
+
+    Nan::HandleScope scope;
+
+    /* Trigger event */
+    Local<Value> argv[3];
+
+                argv[0] = EventName(EventTape::START_NAMESPACE_DECL);
+    if (prefix) argv[1] = parser->names.Get(prefix);
+    else        argv[1] = Nan::Null();
+    if (uri)    argv[2] = parser->names.Get(uri);
+    else        argv[2] = Nan::Null();
+
+    parser->Emit(3, argv);
+  }
+
+  static void EndNamespaceDecl(void *userData,
+                               const XML_Char *prefix)
+  {
+    Parser *parser = reinterpret_cast<Parser *>(userData);
+    parser->flushText();
+
+    if (parser->selector && !parser->selector->InSubtree())
+      return;
+
+    if (parser->recording)
+      {
+        parser->tape.EndNamespaceDecl(prefix);
+        return;
+      }
+
+    Nan::HandleScope scope;
+
+    /* Trigger event */
+    Local<Value> argv[2];
+
+                argv[0] = EventName(EventTape::END_NAMESPACE_DECL);
+    if (prefix) argv[1] = parser->names.Get(prefix);
+    else        argv[1] = Nan::Null();
+
+    parser->Emit(2, argv);
+  }
+
+  static void StartCdata(void *userData)
+  {
+    Parser *parser = reinterpret_cast<Parser *>(userData);
+    parser->flushText();
+
+    if (parser->selector && !parser->selector->InSubtree())
+      return;
+
+    if (parser->recording)
+      {
+        parser->tape.Begin(EventTape::START_CDATA);
+        return;
+      }
+
+    Nan::HandleScope scope;
+
+    /* Trigger event */
+    Local<Value> argv[1] = { EventName(EventTape::START_CDATA) };
+    parser->Emit(1, argv);
+  }
+
+  static void EndCdata(void *userData)
+  {
+    Parser *parser = reinterpret_cast<Parser *>(userData);
+    parser->flushText();
+
+    if (parser->selector && !parser->selector->InSubtree())
+      return;
+
+    if (parser->recording)
+      {
+        parser->tape.Begin(EventTape::END_CDATA);
+        return;
+      }
+
+    Nan::HandleScope scope;
+
+    /* Trigger event */
+    Local<Value> argv[1] = { EventName(EventTape::END_CDATA) };
+    parser->Emit(1, argv);
+  }
+
+  static void Text(void *userData,
+                   const XML_Char *s, int len)
+  {
+    Parser *parser = reinterpret_cast<Parser *>(userData);
+
+    if (parser->selector && !parser->selector->InMatch())
+      return;
+
+    if (parser->coalesceText)
+      parser->pendingText.append(s, len);
+    else
+      parser->emitText(s, len);
+  }
+
+  void emitText(const XML_Char *s, int len)
+  {
+    if (recording)
+      {
+        tape.Text(s, len);
+        return;
+      }
+
+    Nan::HandleScope scope;
+
+    /* Trigger event */
+    Local<Value> argv[2] = { EventName(EventTape::TEXT),
+                              Nan::New(s, len).ToLocalChecked() };
+    Emit(2, argv);
+  }
+
+  /** Emits text joined by coalesceText, before any other event */
+  void flushText()
+  {
+    if (pendingText.empty())
+      return;
+
+    emitText(pendingText.data(), pendingText.size());
+    pendingText.clear();
+  }
+
+  static void ProcessingInstruction(void *userData,
+                                    const XML_Char *target, const XML_Char *data)
+  {
+    Parser *parser = reinterpret_cast<Parser *>(userData);
+    parser->flushText();
+
+    if (parser->selector && !parser->selector->InSubtree())
+      return;
+
+    if (parser->recording)
+      {
+        parser->tape.ProcessingInstruction(target, data);
+        return;
+      }
+
+    Nan::HandleScope scope;
+
+    /* Trigger event */
+    Local<Value> argv[3] = { EventName(EventTape::PROCESSING_INSTRUCTION),
+                              Nan::New(target).ToLocalChecked(),
+                              Nan::New(data).ToLocalChecked() };
+    parser->Emit(3, argv);
+  }
+
+  static void Comment(void *userData,
+                      const XML_Char *data)
+  {
+    Parser *parser = reinterpret_cast<Parser *>(userData);
+    parser->flushText();
+
+    if (parser->selector && !parser->selector->InSubtree())
+      return;
+
+    if (parser->recording)
+      {
+        parser->tape.Comment(data);
+        return;
+      }
+
+    Nan::HandleScope scope;
+
+    /* Trigger event */
+    Local<Value> argv[2] = { EventName(EventTape::COMMENT), Nan::New(data).ToLocalChecked() };
+    parser->Emit(2, argv);
+  }
+
+  static void XmlDecl(void *userData,
+                      const XML_Char *version, const XML_Char *encoding,
+                      int standalone)
+  {
+    Parser *parser = reinterpret_cast<Parser *>(userData);
+    parser->flushText();
+
+    if (parser->recording)
+      {
+        parser->tape.XmlDecl(version, encoding, standalone);
+        return;
+      }
+
+    Nan::HandleScope scope;
+
+    /* Trigger event */
+    Local<Value> argv[4];
+
+                    argv[0] = EventName(EventTape::XML_DECL);
+    if (version)    argv[1] = Nan::New(version).ToLocalChecked();
+    else            argv[1] = Nan::Null();
+    if (encoding)   argv[2] = Nan::New(encoding).ToLocalChecked();
+    else            argv[2] = Nan::Null();
+    if (standalone) argv[3] = Nan::True();
+    else            argv[3] = Nan::False();
+
+    parser->Emit(4, argv);
+  }
+
+  static void EntityDecl(void *userData, const XML_Char *entityName, int is_parameter_entity,
+                         const XML_Char *value, int value_length, const XML_Char *base,
+                         const XML_Char *systemId, const XML_Char *publicId, const XML_Char *notationName)
+  {
+    Parser *parser = reinterpret_cast<Parser *>(userData);
+    parser->flushText();
+
+    if (parser->recording)
+      {
+        parser->tape.EntityDecl(entityName, is_parameter_entity, value, value_length,
+                                base, systemId, publicId, notationName);
+        return;
+      }
+
+    Nan::HandleScope scope;
+
+    /* Trigger event */
+    Local<Value> argv[8];
+
+                             argv[0] = EventName(EventTape::ENTITY_DECL);
+    if (entityName)          argv[1] = Nan::New(entityName).ToLocalChecked();
+    else                     argv[1] = Nan::Null();
+    if (is_parameter_entity) argv[2] = Nan::True();
+    else                     argv[2] = Nan::False();
+    if (value)               argv[3] = Nan::New(value, value_length).ToLocalChecked();
+    else                     argv[3] = Nan::Null();
+    if (base)                argv[4] = Nan::New(base).ToLocalChecked();
+    else                     argv[4] = Nan::Null();
+    if (systemId)            argv[5] = Nan::New(systemId).ToLocalChecked();
+    else                     argv[5] = Nan::Null();
+    if (publicId)            argv[6] = Nan::New(publicId).ToLocalChecked();
+    else                     argv[6] = Nan::Null();
+    if (notationName)        argv[7] = Nan::New(notationName).ToLocalChecked();
+    else                     argv[7] = Nan::Null();
+
+    parser->Emit(8, argv);
+  }
+
+  XML_Encoding *xmlEncodingInfo;
+
+  static int UnknownEncoding(void *encodingHandlerData, const XML_Char *name, XML_Encoding *info)
+  {
+    Parser *parser = reinterpret_cast<Parser *>(encodingHandlerData);
+
+    /* No JS handler can answer on a worker thread */
+    if (parser->busy)
+      return XML_STATUS_ERROR;
+
+    /* Must be answered synchronously, so deliver what came before */
+    parser->flushText();
+    parser->flushBatch();
+
+    Nan::HandleScope scope;
+
+    /* Trigger event */
+    parser->xmlEncodingInfo = info;
+    Local<Value> argv[2];
+
+              argv[0] = EventName(UNKNOWN_ENCODING);
+    if (name) argv[1] = Nan::New(name).ToLocalChecked();
+    else      argv[1] = Nan::Null();
+
+    parser->Emit(2, argv);
+
+    /* Did no event handler invoke setUnknownEncoding()? */
+    if (parser->xmlEncodingInfo) {
+      parser->xmlEncodingInfo = NULL;
+      return XML_STATUS_ERROR;
+    } else {
+      return XML_STATUS_OK;
+    }
+  }
+
+  /**
+   * Fills xmlEncodingInfo
+   */
+  static NAN_METHOD(SetUnknownEncoding)
+  {
+    Parser *parser = Nan::ObjectWrap::Unwrap<Parser>(info.This());
+    Nan::HandleScope scope;
+
+    if (!parser->xmlEncodingInfo)
+      Nan::ThrowError("setUnknownEncoding() must be synchronously invoked from an unknownEncoding event handler");
+
+    if (info.Length() >= 1 && info[0]->IsArray()) {
+      Local<Array> map = info[0].As<Array>();
+      /* Copy map */
+      for(int i = 0; i < 256; i++) {
+        Local<Value> m = Nan::Get(map, Nan::New(i)).ToLocalChecked();
+        if (m->IsInt32())
+          parser->xmlEncodingInfo->map[i] = Nan::To<int32_t>(m).FromJust();
+        else
+          Nan::ThrowTypeError("UnknownEncoding map must consist of 256 ints");
+      }
+    } else
+      Nan::ThrowTypeError("SetUnknownEncoding expects a map array");
+
+    parser->xmlEncodingInfo = NULL;
+    return;
+  }
+
+  /*** emit property ***/
+
+  /**
+   * The JS wrapper assigns parser.emit once. Keep it in a persistent
+   * handle so that events don't have to look it up on every call.
+   */
+  static NAN_GETTER(GetEmit)
+  {
+    Parser *parser = Nan::ObjectWrap::Unwrap<Parser>(info.Holder());
+
+    if (!parser->emitCallback.IsEmpty())
+      info.GetReturnValue().Set(parser->emitCallback.GetFunction());
+  }
+
+  static NAN_SETTER(SetEmit)
+  {
+    Parser *parser = Nan::ObjectWrap::Unwrap<Parser>(info.Holder());
+
+    if (value->IsFunction())
+      parser->emitCallback.Reset(value.As<Function>());
+    else
+      parser->emitCallback.Reset();
+  }
+
+  void Emit(int argc, Local<Value> argv[])
+  {
+    Nan::HandleScope scope;
+
+    if (emitCallback.IsEmpty())
+      return;
+    Nan::Call(emitCallback, argc, argv);
+  }
+
+  /* Event names, interned once when the module is loaded */
+  enum {
+    UNKNOWN_ENCODING = EventTape::TYPE_COUNT,
+    BATCH,
+    EVENT_COUNT
+  };
+  static Nan::Persistent<String> eventNames[EVENT_COUNT];
+  /* Template of the lazy attributes view */
+  static Nan::Persistent<ObjectTemplate> lazyAttributesTemplate;
+
+  static Local<String> EventName(int event)
+  {
+    return Nan::New(eventNames[event]);
+  }
+
+  /*** batch mode ***/
+
+  static Local<Value> TapeValue(const EventTape &tape, size_t &pos)
+  {
+    EventTape::Word word = tape.words[pos++];
+    switch (word) {
+    case EventTape::NULL_VALUE:
+      return Nan::Null();
+    case EventTape::FALSE_VALUE:
+      return Nan::False();
+    case EventTape::TRUE_VALUE:
+      return Nan::True();
+    default:
+      EventTape::Word offset = tape.words[pos++];
+      return Nan::New(tape.chars.data() + offset, static_cast<int>(word)).ToLocalChecked();
+    }
+  }
+
+  /* Element and attribute names are never null */
+  static std::string_view TapeName(const EventTape &tape, size_t &pos)
+  {
+    EventTape::Word len = tape.words[pos++];
+    EventTape::Word offset = tape.words[pos++];
+    return std::string_view(tape.chars.data() + offset, len);
+  }
+
+  /**
+   * Hands all recorded events to JS at once as
+   * emit('batch', [event, args..., event, args...])
+   */
+  void flushBatch()
+  {
+    if (tape.IsEmpty())
+      return;
+
+    Nan::HandleScope scope;
+    Local<Value> argv[2] = { EventName(BATCH), takeEvents() };
+    Emit(2, argv);
+  }
+
+  /** Converts the tape to a flat [event, args..., event, args...]
+      array and clears it */
+  Local<Array> takeEvents()
+  {
+    return takeEvents(tape);
+  }
+
+  /** Same for a tape recorded elsewhere */
+  Local<Array> takeEvents(EventTape &tape)
+  {
+    Nan::EscapableHandleScope scope;
+    Local<Array> events = Nan::New<Array>();
+    uint32_t index = 0;
+    size_t pos = 0;
+    while (pos < tape.words.size()) {
+      EventTape::Type type = static_cast<EventTape::Type>(tape.words[pos++]);
+      Nan::Set(events, index++, EventName(type));
+
+      if (type == EventTape::START_ELEMENT) {
+        Local<Value> name, uri;
+        elementName(TapeName(tape, pos), name, uri);
+        Nan::Set(events, index++, name);
+        uint32_t count = tape.words[pos++];
+        /* The lazy view needs expat's atts, so recorded events get objects */
+        if (attributes == ATTRIBUTES_ARRAY) {
+          for (uint32_t i = 0; i < count; i++) {
+            attributeValues.push_back(attributeName(TapeName(tape, pos)));
+            attributeValues.push_back(TapeValue(tape, pos));
+          }
+          Nan::Set(events, index++, takeAttributeArray());
+        } else {
+          Local<Object> attr = Nan::New<Object>();
+          for (uint32_t i = 0; i < count; i++) {
+            Local<String> key = attributeName(TapeName(tape, pos));
+            Local<Value> value = TapeValue(tape, pos);
+            Nan::Set(attr, key, value);
+          }
+          Nan::Set(events, index++, attr);
+        }
+        if (namespaces)
+          Nan::Set(events, index++, uri);
+      } else if (type == EventTape::END_ELEMENT) {
+        Local<Value> name, uri;
+        elementName(TapeName(tape, pos), name, uri);
+        Nan::Set(events, index++, name);
+        if (namespaces)
+          Nan::Set(events, index++, uri);
+      } else {
+        for (int i = EventTape::ValueCount(type); i > 0; i--)
+          Nan::Set(events, index++, TapeValue(tape, pos));
+      }
+    }
+    tape.Clear();
+
+    return scope.Escape(events);
+  }
+
+  friend class ParseWorker;
+  friend class RecordsWorker;
+  friend class DocumentsWorker;
+  friend class FileWorker;
+};
+
+/**
+ * Speculative parallel parsing of one document for parseParallel().
+ *
+ * The document is cut into slices, each right before a start or end
+ * tag. Every slice is first scanned for its tags alone: the end tags
+ * that close elements opened before it, and the start tags it leaves
+ * open. Joining the scans in order predicts the open elements at each
+ * cut. Then each slice is parsed by an expat instance of its own as a
+ * document made of the start tags open at the cut, the slice, and end
+ * tags for the elements the slice leaves open, recording only events
+ * from inside the slice. Namespace declarations come along with the
+ * copied start tags. Each slice parser checks that the elements open
+ * at the end of its slice are exactly the predicted start tags, so the
+ * tapes joined in order hold what one parser would have recorded.
+ *
+ * Anything unexpected makes the caller parse the whole document with
+ * one parser instead: a DOCTYPE (entities and default attributes), a
+ * cut inside a comment, CDATA section or processing instruction, a
+ * UTF-16 document, or any error.
+ */
+namespace slices {
+
+/* A start tag somewhere in the document */
+struct Tag {
+  const char *start;
+  size_t len;
+  size_t nameLen;
+
+  std::string_view Name() const
+  {
+    return std::string_view(start + 1, nameLen);
+  }
+};
+
+/* Result of scanning one slice for its tags */
+struct Scan {
+  /* names of end tags for elements opened before the slice */
+  std::vector<std::string_view> closed;
+  /* start tags still open at the end of the slice */
+  std::vector<Tag> opened;
+  bool ok = true;
+  /* ran into the end in the middle of markup */
+  bool unfinished = false;
+};
+
+static bool IsNameEnd(char c)
+{
+  return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '/' || c == '>';
+}
+
+/* Position after the next terminator, or NULL */
+static const char *Skip(const char *p, const char *end, std::string_view terminator)
+{
+  size_t found = std::string_view(p, end - p).find(terminator);
+  if (found == std::string_view::npos)
+    return NULL;
+  return p + found + terminator.size();
+}
+
+static bool StartsWith(const char *p, const char *end, std::string_view prefix)
+{
+  return static_cast<size_t>(end - p) >= prefix.size() &&
+         std::string_view(p, prefix.size()) == prefix;
+}
+
+/** Position of the '>' ending a tag at p, or NULL */
+static const char *TagEnd(const char *p, const char *end)
+{
+  const char *gt = static_cast<const char *>(memchr(p, '>', end - p));
+  /* '>' may appear in attribute values */
+  for (;;)
+    {
+      if (!gt)
+        return NULL;
+      while (p < gt && *p != '"' && *p != '\'')
+        p++;
+      if (p == gt)
+        return gt;
+      const char *close = static_cast<const char *>(memchr(p + 1, *p, end - p - 1));
+      if (!close)
+        return NULL;
+      p = close + 1;
+      if (close > gt)
+        gt = static_cast<const char *>(memchr(p, '>', end - p));
+    }
+}
+
+/* ScanTags() visitor for when the Scan is all that matters */
+struct NoVisitor {
+  void Start(const Tag &) {}
+  void Empty(const Tag &) {}
+  void End(std::string_view, const char *) {}
+};
+
+/**
+ * Finds the tags of [p, end) without checking anything else, and
+ * shows each start, empty element and end tag to visitor.
+ */
+template <typename Visitor>
+static void ScanTags(const char *p, const char *end, Scan &scan, Visitor &visitor)
+{
+  while ((p = static_cast<const char *>(memchr(p, '<', end - p))) != NULL)
+    {
+      const char *q = p + 1;
+      char c = q < end ? *q : '\0';
+      if (c == '!' || c == '?')
+        {
+          if (StartsWith(q, end, "!--"))
+            scan.unfinished = (p = Skip(q + 3, end, "-->")) == NULL;
+          else if (StartsWith(q, end, "![CDATA["))
+            scan.unfinished = (p = Skip(q + 8, end, "]]>")) == NULL;
+          else if (c == '?')
+            scan.unfinished = (p = Skip(q + 1, end, "?>")) == NULL;
+          else
+            /* DOCTYPE */
+            p = NULL;
+        }
+      else
+        {
+          bool isEnd = c == '/';
+          if (isEnd)
+            q++;
+          const char *name = q;
+          while (q < end && !IsNameEnd(*q))
+            q++;
+          size_t nameLen = q - name;
+          q = TagEnd(q, end);
+          if (q == NULL)
+            scan.unfinished = true;
+          if (q == NULL || nameLen == 0)
+            p = NULL;
+          else if (isEnd)
+            {
+              std::string_view closing(name, nameLen);
+              if (scan.opened.empty())
+                scan.closed.push_back(closing);
+              else if (scan.opened.back().Name() == closing)
+                scan.opened.pop_back();
+              else
+                p = NULL;
+              if (p)
+                visitor.End(closing, q + 1);
+            }
+          else
+            {
+              Tag tag { p, static_cast<size_t>(q + 1 - p), nameLen };
+              if (q[-1] == '/')
+                visitor.Empty(tag);
+              else
+                {
+                  scan.opened.push_back(tag);
+                  visitor.Start(tag);
+                }
+            }
+          if (p)
+            p = q + 1;
+        }
+      if (!p)
+        {
+          scan.ok = false;
+          return;
+        }
+    }
+}
+
+static void ScanTags(const char *p, const char *end, Scan &scan)
+{
+  NoVisitor none;
+  ScanTags(p, end, scan, none);
+}
+
+/**
+ * Parses one slice with the elements open before and after it
+ * predicted, and records its events. Given a record element name, it
+ * records only the events of those elements that are children of the
+ * elements open before the slice.
+ */
+class SliceParser {
+public:
+  SliceParser(const XML_Char *encoding, XML_Char separator, uint32_t eventMask,
+              std::string_view record = std::string_view())
+    : encoding(encoding ? encoding : ""), eventMask(eventMask), record(record),
+      reachedEnd(false)
+  {
+    parser = separator ? XML_ParserCreateNS(encoding, separator)
+                       : XML_ParserCreate(encoding);
+    assert(parser != NULL);
+    attachHandlers();
+  }
+
+  ~SliceParser()
+  {
+    XML_ParserFree(parser);
+  }
+
+  /** Lends the expat instance to another recorder; Reset() takes it back */
+  XML_Parser Borrow()
+  {
+    return parser;
+  }
+
+  /** Gets ready to parse another slice */
+  void Reset()
+  {
+    XML_ParserReset(parser, encoding.empty() ? NULL : encoding.c_str());
+    attachHandlers();
+    prefixOffsets.clear();
+    open.clear();
+    openAtEnd.clear();
+    reachedEnd = false;
+  }
+
+  /** Parses before + [begin, end) + closing tags for after */
+  bool Parse(const std::vector<Tag> &before, const char *begin, const char *end,
+             const std::vector<Tag> &after)
+  {
+    this->before = &before;
+    this->begin = begin;
+    this->end = end;
+    inRecord = false;
+    recordEnd = -1;
+    std::string suffix;
+    for (auto tag = after.rbegin(); tag != after.rend(); ++tag)
+      {
+        suffix.append("</");
+        suffix.append(tag->Name());
+        suffix.append(">");
+      }
+    size_t len = 0;
+    for (const Tag &tag : before)
+      {
+        prefixOffsets.push_back(len);
+        len += tag.len;
+      }
+    sliceStart = len;
+    sliceEnd = len + (end - begin);
+    len = sliceEnd + suffix.size();
+    if (len > INT_MAX)
+      return false;
+
+    /* One buffer, as when one parser gets the whole document. expat
+       has no buffer to give for an empty one. */
+    XML_Status status;
+    if (len == 0)
+      status = XML_Parse(parser, "", 0, 1);
+    else
+      {
+        char *buf = static_cast<char *>(XML_GetBuffer(parser, static_cast<int>(len)));
+        if (buf == NULL)
+          return false;
+        for (const Tag &tag : before)
+          buf = std::copy(tag.start, tag.start + tag.len, buf);
+        buf = std::copy(begin, end, buf);
+        std::copy(suffix.begin(), suffix.end(), buf);
+        status = XML_ParseBuffer(parser, static_cast<int>(len), 1);
+      }
+    if (status == XML_STATUS_ERROR)
+      return false;
+
+    if (!reachedEnd)
+      openAtEnd = open;
+    if (openAtEnd.size() != after.size())
+      return false;
+    for (size_t i = 0; i < after.size(); i++)
+      if (openAtEnd[i] != after[i].start)
+        return false;
+    return true;
+  }
+
+  /** Why Parse() failed, with the position in the document */
+  std::string Error(const char *data)
+  {
+    XML_Error code = XML_GetErrorCode(parser);
+    std::string message = code == XML_ERROR_NONE ? "unexpected end of slice"
+                                                 : XML_ErrorString(code);
+    message += " at byte ";
+    message += std::to_string(position(XML_GetCurrentByteIndex(parser)) - data);
+    return message;
+  }
+
+  EventTape tape;
+
+private:
+  XML_Parser parser;
+  std::string encoding;
+  uint32_t eventMask;
+  std::string_view record;
+
+  /* The slice within the document parsed, in bytes */
+  XML_Index sliceStart, sliceEnd;
+  const std::vector<Tag> *before;
+  std::vector<size_t> prefixOffsets;
+  const char *begin;
+  const char *end;
+
+  /* Open elements as pointers to their start tags in the document */
+  std::vector<const char *> open;
+  std::vector<const char *> openAtEnd;
+  bool reachedEnd;
+
+  /* Inside a record element; where one just ended */
+  bool inRecord;
+  XML_Index recordEnd;
+
+  void attachHandlers()
+  {
+    XML_SetUserData(parser, this);
+    /* Element handlers also track the open elements */
+    XML_SetElementHandler(parser, StartElement, EndElement);
+    XML_SetCharacterDataHandler(parser, listening(EventTape::TEXT) ? Text : NULL);
+    XML_SetCdataSectionHandler(parser,
+                               listening(EventTape::START_CDATA) ? StartCdata : NULL,
+                               listening(EventTape::END_CDATA) ? EndCdata : NULL);
+    XML_SetProcessingInstructionHandler(parser, listening(EventTape::PROCESSING_INSTRUCTION) ? ProcessingInstruction : NULL);
+    XML_SetCommentHandler(parser, listening(EventTape::COMMENT) ? Comment : NULL);
+    XML_SetXmlDeclHandler(parser, listening(EventTape::XML_DECL) ? XmlDecl : NULL);
+    XML_SetEntityDeclHandler(parser, listening(EventTape::ENTITY_DECL) ? EntityDecl : NULL);
+    XML_SetNamespaceDeclHandler(parser,
+                                listening(EventTape::START_NAMESPACE_DECL) ? StartNamespaceDecl : NULL,
+                                listening(EventTape::END_NAMESPACE_DECL) ? EndNamespaceDecl : NULL);
+  }
+
+  bool listening(EventTape::Type type) const
+  {
+    return (eventMask & (1u << type)) != 0;
+  }
+
+  /* Is the current event part of the slice? */
+  bool inSlice()
+  {
+    return XML_GetCurrentByteIndex(parser) >= sliceStart && !pastSlice();
+  }
+
+  /* Has the current event come from the closing tags we appended?
+     expat reports the end of an empty element tag at its end. */
+  bool pastSlice()
+  {
+    XML_Index index = XML_GetCurrentByteIndex(parser);
+    return index > sliceEnd ||
+           (index == sliceEnd && XML_GetCurrentByteCount(parser) > 0);
+  }
+
+  /* Should the current event be recorded? */
+  bool wanted()
+  {
+    return record.empty() ? inSlice() : inRecord;
+  }
+
+  /* Is the current start tag that of a record? */
+  bool startsRecord()
+  {
+    if (open.size() != before->size())
+      return false;
+    const char *p = tagStart() + 1;
+    for (char c : record)
+      if (*p++ != c)
+        return false;
+    return IsNameEnd(*p);
+  }
+
+  /* Where a byte of the parsed buffer is in the real document. expat
+     has no index before it parsed anything: that is the slice start. */
+  const char *position(XML_Index index)
+  {
+    if (index < 0)
+      return begin;
+    if (index >= sliceEnd)
+      return end;
+    if (index >= sliceStart)
+      return begin + (index - sliceStart);
+    size_t i = std::upper_bound(prefixOffsets.begin(), prefixOffsets.end(),
+                                static_cast<size_t>(index)) - prefixOffsets.begin();
+    if (i == 0)
+      return begin;
+    return (*before)[i - 1].start + (index - prefixOffsets[i - 1]);
+  }
+
+  /* Where the current start tag is in the real document */
+  const char *tagStart()
+  {
+    return position(XML_GetCurrentByteIndex(parser));
+  }
+
+  static void StartElement(void *userData,
+                           const XML_Char *name, const XML_Char **atts)
+  {
+    SliceParser *slice = reinterpret_cast<SliceParser *>(userData);
+    slice->recordEnd = -1;
+    if (!slice->record.empty() && slice->open.size() == slice->before->size())
+      slice->inRecord = slice->startsRecord();
+    slice->open.push_back(slice->tagStart());
+    if (slice->listening(EventTape::START_ELEMENT) && slice->wanted())
+      slice->tape.StartElement(name, atts);
+  }
+
+  static void EndElement(void *userData,
+                         const XML_Char *name)
+  {
+    SliceParser *slice = reinterpret_cast<SliceParser *>(userData);
+    if (!slice->reachedEnd && slice->pastSlice())
+      {
+        /* The first of the closing tags we appended */
+        slice->openAtEnd = slice->open;
+        slice->reachedEnd = true;
+      }
+    slice->open.pop_back();
+    slice->recordEnd = -1;
+    if (slice->listening(EventTape::END_ELEMENT) && slice->wanted())
+      slice->tape.EndElement(name);
+    if (slice->inRecord && slice->open.size() == slice->before->size())
+      {
+        slice->inRecord = false;
+        slice->recordEnd = XML_GetCurrentByteIndex(slice->parser);
+      }
+  }
+
+  static void Text(void *userData,
+                   const XML_Char *s, int len)
+  {
+    SliceParser *slice = reinterpret_cast<SliceParser *>(userData);
+    if (slice->wanted())
+      slice->tape.Text(s, len);
+  }
+
+  static void StartCdata(void *userData)
+  {
+    SliceParser *slice = reinterpret_cast<SliceParser *>(userData);
+    if (slice->wanted())
+      slice->tape.Begin(EventTape::START_CDATA);
+  }
+
+  static void EndCdata(void *userData)
+  {
+    SliceParser *slice = reinterpret_cast<SliceParser *>(userData);
+    if (slice->wanted())
+      slice->tape.Begin(EventTape::END_CDATA);
+  }
+
+  static void ProcessingInstruction(void *userData,
+                                    const XML_Char *target, const XML_Char *data)
+  {
+    SliceParser *slice = reinterpret_cast<SliceParser *>(userData);
+    if (slice->wanted())
+      slice->tape.ProcessingInstruction(target, data);
+  }
+
+  static void Comment(void *userData,
+                      const XML_Char *data)
+  {
+    SliceParser *slice = reinterpret_cast<SliceParser *>(userData);
+    if (slice->wanted())
+      slice->tape.Comment(data);
+  }
+
+  static void XmlDecl(void *userData,
+                      const XML_Char *version, const XML_Char *encoding,
+                      int standalone)
+  {
+    SliceParser *slice = reinterpret_cast<SliceParser *>(userData);
+    if (slice->wanted())
+      slice->tape.XmlDecl(version, encoding, standalone);
+  }
+
+  static void EntityDecl(void *userData, const XML_Char *entityName, int is_parameter_entity,
+                         const XML_Char *value, int value_length, const XML_Char *base,
+                         const XML_Char *systemId, const XML_Char *publicId, const XML_Char *notationName)
+  {
+    SliceParser *slice = reinterpret_cast<SliceParser *>(userData);
+    if (slice->wanted())
+      slice->tape.EntityDecl(entityName, is_parameter_entity, value, value_length,
+                             base, systemId, publicId, notationName);
+  }
+
+  static void StartNamespaceDecl(void *userData,
+                                 const XML_Char *prefix, const XML_Char *uri)
+  {
+    SliceParser *slice = reinterpret_cast<SliceParser *>(userData);
+    /* Reported before the start tag declaring it */
+    if (slice->record.empty() ? slice->inSlice()
+                              : slice->inRecord || slice->startsRecord())
+      slice->tape.StartNamespaceDecl(prefix, uri);
+  }
+
+  static void EndNamespaceDecl(void *userData,
+                               const XML_Char *prefix)
+  {
+    SliceParser *slice = reinterpret_cast<SliceParser *>(userData);
+    /* Reported after the end tag */
+    if (slice->record.empty() ? slice->inSlice()
+                              : slice->inRecord ||
+                                XML_GetCurrentByteIndex(slice->parser) == slice->recordEnd)
+      slice->tape.EndNamespaceDecl(prefix);
+  }
+};
+
+/** Calls fn(0) ... fn(count - 1) on up to threads threads */
+template <typename Fn>
+static void ForEach(size_t count, size_t threads, Fn fn)
+{
+  std::atomic<size_t> next(0);
+  auto work = [&]() {
+    for (size_t i = next++; i < count; i = next++)
+      fn(i);
+  };
+  std::vector<std::thread> workers;
+  for (size_t i = 1; i < std::min(count, threads); i++)
+    workers.emplace_back(work);
+  work();
+  for (std::thread &worker : workers)
+    worker.join();
+}
+
+/**
+ * Encoding for the slices after the first, which have no XML
+ * declaration: the declared one unless the parser has its own. Returns
+ * false for documents that can't be cut into bytes this way.
+ */
+static bool SliceEncoding(const char *data, size_t len, std::string &encoding)
+{
+  /* UTF-16, with or without byte order mark */
+  if (len < 2 || data[0] == '\0' || data[1] == '\0' ||
+      (data[0] & 0xfe) == 0xfe)
+    return false;
+  if (!encoding.empty() || !StartsWith(data, data + len, "<?xml"))
+    return true;
+  const char *end = Skip(data, data + len, "?>");
+  if (!end)
+    return false;
+  std::string_view decl(data, end - data);
+  size_t found = decl.find("encoding");
+  if (found == std::string_view::npos)
+    return true;
+  size_t open = decl.find_first_of("'\"", found);
+  if (open == std::string_view::npos)
+    return false;
+  size_t close = decl.find(decl[open], open + 1);
+  if (close == std::string_view::npos)
+    return false;
+  encoding.assign(decl.substr(open + 1, close - open - 1));
+  return true;
+}
+
+/**
+ * Where expat's position getters would stand after parsing all of data,
+ * counted on up to threads threads: lines end at LF, CR or CRLF, and
+ * columns count characters, which in the ASCII-compatible encodings
+ * sliced here are the bytes that don't continue a UTF-8 sequence, or
+ * all bytes in single-byte encodings. Returns the number of bytes expat
+ * consumes: a CR ending the input stays unparsed, as it might start a
+ * CRLF.
+ */
+static size_t EndPosition(const char *data, size_t len, bool utf8, size_t threads,
+                          XML_Size &line, XML_Size &column)
+{
+  if (len > 0 && data[len - 1] == '\r')
+    len--;
+  const char *end = data + len;
+  std::vector<XML_Size> lines(threads);
+  ForEach(threads, threads, [&](size_t i) {
+    const char *p = data + len / threads * i;
+    const char *q = i + 1 < threads ? data + len / threads * (i + 1) : end;
+    XML_Size n = std::count(p, q, '\n');
+    for (const char *r = p; (r = static_cast<const char *>(memchr(r, '\r', q - r))) != NULL; r++)
+      if (r + 1 == end || r[1] != '\n')
+        n++;
+    lines[i] = n;
+  });
+  line = 1;
+  for (XML_Size n : lines)
+    line += n;
+
+  const char *last = end;
+  while (last > data && last[-1] != '\n' && last[-1] != '\r')
+    last--;
+  column = utf8 ? std::count_if(last, end, [](char c) { return (c & 0xc0) != 0x80; })
+                : end - last;
+  return len;
+}
+
+/** Cuts data into up to count slices, each right before a tag */
+static std::vector<const char *> Cut(const char *data, size_t len, size_t count)
+{
+  const char *end = data + len;
+  std::vector<const char *> cuts { data };
+  for (size_t i = 1; i < count; i++)
+    {
+      const char *p = std::max(data + len / count * i, cuts.back() + 1);
+      while (p < end && (p = static_cast<const char *>(memchr(p, '<', end - p))) != NULL)
+        {
+          unsigned char next = p + 1 < end ? p[1] : 0;
+          if (next == '/' || next == '_' || next == ':' || next >= 0x80 ||
+              static_cast<unsigned>((next | 0x20) - 'a') < 26)
+            break;
+          p++;
+        }
+      if (p == NULL || p >= end)
+        break;
+      cuts.push_back(p);
+    }
+  cuts.push_back(end);
+  return cuts;
+}
+
+/**
+ * Scans the slices between cuts and predicts the open elements at each
+ * cut. Slices ending in unfinished markup are joined with the next.
+ * Returns false if the document can't be split like this.
+ */
+static bool Predict(std::vector<const char *> &cuts, size_t threads,
+                    std::vector<std::vector<Tag> > &stacks)
+{
+  size_t count = cuts.size() - 1;
+  std::vector<Scan> scans(count);
+  ForEach(count, threads, [&](size_t i) {
+    ScanTags(cuts[i], cuts[i + 1], scans[i]);
+  });
+
+  /* A cut inside a comment, CDATA section or processing instruction
+     leaves the slice before it unfinished: join it with the next */
+  for (size_t i = 0; i + 1 < scans.size(); )
+    if (!scans[i].unfinished)
+      i++;
+    else
+      {
+        cuts.erase(cuts.begin() + i + 1);
+        scans.erase(scans.begin() + i + 1);
+        scans[i] = Scan();
+        ScanTags(cuts[i], cuts[i + 1], scans[i]);
+      }
+  count = scans.size();
+
+  stacks.assign(count + 1, std::vector<Tag>());
+  for (size_t i = 0; i < count; i++)
+    {
+      if (!scans[i].ok)
+        return false;
+      std::vector<Tag> &stack = stacks[i + 1];
+      stack = stacks[i];
+      for (std::string_view name : scans[i].closed)
+        {
+          if (stack.empty() || stack.back().Name() != name)
+            return false;
+          stack.pop_back();
+        }
+      stack.insert(stack.end(), scans[i].opened.begin(), scans[i].opened.end());
+      /* Tags after the root element are an error */
+      if (stack.empty() && i + 1 < count)
+        return false;
+    }
+  /* An unfinished document gets its error from one parser */
+  return stacks[count].empty();
+}
+
+/**
+ * Parses data in up to threads slices of at least minSlice bytes and
+ * appends its events to tape. Returns the number of slices, or 0 if
+ * the document has to be parsed by one parser: then tape is untouched.
+ * line, column and index get the position at the end of data.
+ */
+static size_t Parse(const char *data, size_t len, const std::string &encoding,
+                    XML_Char separator, uint32_t eventMask,
+                    size_t threads, size_t minSlice, EventTape &tape,
+                    XML_Size &line, XML_Size &column, XML_Index &index)
+{
+  std::string laterEncoding = encoding;
+  size_t count = std::min(threads, len / std::max<size_t>(minSlice, 1));
+  if (count < 2 || !SliceEncoding(data, len, laterEncoding))
+    return 0;
+
+  std::vector<const char *> cuts = Cut(data, len, count);
+  std::vector<std::vector<Tag> > stacks;
+  if (cuts.size() < 3 || !Predict(cuts, threads, stacks))
+    return 0;
+  count = cuts.size() - 1;
+  if (count < 2)
+    return 0;
+
+  std::vector<std::unique_ptr<SliceParser> > parsers(count);
+  std::atomic<bool> ok(true);
+  ForEach(count, threads, [&](size_t i) {
+    if (!ok)
+      return;
+    const std::string &name = i == 0 ? encoding : laterEncoding;
+    parsers[i].reset(new SliceParser(name.empty() ? NULL : name.c_str(),
+                                     separator, eventMask));
+    if (!parsers[i]->Parse(stacks[i], cuts[i], cuts[i + 1], stacks[i + 1]))
+      ok = false;
+  });
+  if (!ok)
+    return 0;
+
+  /* Join the tapes, each copied by a thread of its own */
+  std::vector<size_t> wordPos(count + 1, tape.words.size());
+  std::vector<size_t> charPos(count + 1, tape.chars.size());
+  size_t events = 0;
+  for (size_t i = 0; i < count; i++)
+    {
+      wordPos[i + 1] = wordPos[i] + parsers[i]->tape.words.size();
+      charPos[i + 1] = charPos[i] + parsers[i]->tape.chars.size();
+      events += parsers[i]->tape.EventCount();
+    }
+  tape.Grow(wordPos[count] - wordPos[0], charPos[count] - charPos[0], events);
+  ForEach(count, threads, [&](size_t i) {
+    tape.CopyAt(parsers[i]->tape, wordPos[i], charPos[i]);
+    parsers[i].reset();
+  });
+
+  std::string name = laterEncoding;
+  std::transform(name.begin(), name.end(), name.begin(), ::toupper);
+  index = EndPosition(data, len, name.empty() || name == "UTF-8",
+                      threads, line, column);
+  return count;
+}
+
+/*
+ * Record-sharded parsing for parseRecords() splits documents like
+ * <root><record>...</record><record>...</record>...</root> at the
+ * records: elements of the given name not inside another one. The
+ * slices scanned as above are scanned again, now following every tag,
+ * to collect the records in batches of neighbours under the same
+ * parent. Each batch is parsed as a slice whose events outside records
+ * are dropped, and what lies between batches is checked by one more
+ * parser with the batches left out.
+ */
+
+/* Consecutive records with the same parent, parsed as one slice */
+struct Batch {
+  const char *begin = NULL;
+  const char *end = NULL;
+  size_t records = 0;
+  /* Start tags of the elements around the records */
+  std::vector<Tag> ancestors;
+  /* Only finishes the last record of the batch before */
+  bool continued = false;
+
+  EventTape tape;
+  std::string error;
+};
+
+/** Collects the batches of one slice while ScanTags() goes through it */
+class RecordVisitor {
+public:
+  RecordVisitor(std::string_view record, const std::vector<Tag> &open, size_t target)
+    : record(record), stack(open), depth(0), target(target)
+  {
+    for (const Tag &tag : open)
+      if (tag.Name() == record)
+        depth++;
+    if (depth > 0)
+      {
+        batches.emplace_back();
+        batches.back().continued = true;
+      }
+  }
+
+  void Start(const Tag &tag)
+  {
+    if (tag.Name() == record && depth++ == 0)
+      Begin(tag.start);
+    stack.push_back(tag);
+  }
+
+  void Empty(const Tag &tag)
+  {
+    if (depth == 0 && tag.Name() == record)
+      {
+        Begin(tag.start);
+        batches.back().end = tag.start + tag.len;
+      }
+  }
+
+  void End(std::string_view name, const char *after)
+  {
+    /* Unless the slice closes more than was open before it */
+    if (!stack.empty())
+      stack.pop_back();
+    if (name == record && depth > 0 && --depth == 0)
+      batches.back().end = after;
+  }
+
+  std::vector<Batch> batches;
+
+private:
+  std::string_view record;
+  std::vector<Tag> stack;
+  /* Open elements named like records */
+  size_t depth;
+  size_t target;
+
+  void Begin(const char *p)
+  {
+    Batch *last = batches.empty() ? NULL : &batches.back();
+    bool sameParent = last && last->ancestors.size() == stack.size() &&
+                      (stack.empty() || last->ancestors.back().start == stack.back().start);
+    if (!sameParent || last->continued || static_cast<size_t>(p - last->begin) >= target)
+      {
+        batches.emplace_back();
+        batches.back().begin = p;
+        batches.back().ancestors = stack;
+      }
+    batches.back().records++;
+  }
+};
+
+/**
+ * Finds the records of data in batches of about target bytes, scanning
+ * up to threads slices at once. Returns false if the document can't be
+ * split at its tags.
+ */
+static bool FindRecords(const char *data, size_t len, std::string_view record,
+                        size_t threads, size_t target, std::vector<Batch> &batches)
+{
+  const size_t minScan = 1 << 20;
+  std::vector<const char *> cuts = Cut(data, len, std::min(threads, len / minScan));
+  std::vector<std::vector<Tag> > stacks;
+  if (cuts.size() == 2)
+    {
+      /* Nothing to predict: one scan does it all */
+      RecordVisitor visitor(record, std::vector<Tag>(), target);
+      Scan scan;
+      ScanTags(data, data + len, scan, visitor);
+      if (!scan.ok || !scan.closed.empty() || !scan.opened.empty())
+        return false;
+      batches = std::move(visitor.batches);
+      return true;
+    }
+  if (!Predict(cuts, threads, stacks))
+    return false;
+
+  size_t count = cuts.size() - 1;
+  std::vector<std::unique_ptr<RecordVisitor> > visitors(count);
+  ForEach(count, threads, [&](size_t i) {
+    visitors[i].reset(new RecordVisitor(record, stacks[i], target));
+    Scan scan;
+    ScanTags(cuts[i], cuts[i + 1], scan, *visitors[i]);
+  });
+
+  for (size_t i = 0; i < count; i++)
+    for (Batch &batch : visitors[i]->batches)
+      if (!batch.continued)
+        batches.push_back(std::move(batch));
+      else if (batch.end)
+        batches.back().end = batch.end;
+  return true;
+}
+
+static bool IsWhitespace(const char *p, const char *end)
+{
+  for (; p < end; p++)
+    if (*p != ' ' && *p != '\t' && *p != '\r' && *p != '\n')
+      return false;
+  return true;
+}
+
+/**
+ * Checks the document with the batches left out: the markup between
+ * them, which no batch parser sees. Batches at the top level stand in
+ * as one empty element. Returns an error message, or an empty string.
+ */
+static std::string CheckOutside(const char *data, size_t len, const std::string &encoding,
+                                XML_Char separator, const std::vector<Batch> &batches)
+{
+  const XML_Char *name = encoding.empty() ? NULL : encoding.c_str();
+  XML_Parser parser = separator ? XML_ParserCreateNS(name, separator)
+                                : XML_ParserCreate(name);
+  assert(parser != NULL);
+  const char *gap = data;
+  const char *end = data + len;
+  /* Bytes fed before the one at gap */
+  XML_Index fed = 0;
+  bool ok = true;
+  for (size_t i = 0; ok && i <= batches.size(); i++)
+    {
+      const char *gapEnd = i < batches.size() ? batches[i].begin : end;
+      if (IsWhitespace(gap, gapEnd))
+        gap = gapEnd;
+      while (ok && gap < gapEnd)
+        {
+          /* XML_Parse() takes an int */
+          int chunk = static_cast<int>(std::min<size_t>(gapEnd - gap, INT_MAX));
+          ok = XML_Parse(parser, gap, chunk, 0) != XML_STATUS_ERROR;
+          if (ok)
+            {
+              fed += chunk;
+              gap += chunk;
+            }
+        }
+      if (ok && i < batches.size())
+        {
+          gap = batches[i].begin;
+          if (batches[i].ancestors.empty())
+            ok = XML_Parse(parser, "<a/>", 4, 0) != XML_STATUS_ERROR;
+          if (ok)
+            {
+              fed += batches[i].ancestors.empty() ? 4 : 0;
+              gap = batches[i].end;
+            }
+        }
+    }
+  if (ok)
+    ok = XML_Parse(parser, NULL, 0, 1) != XML_STATUS_ERROR;
+
+  std::string message;
+  if (!ok)
+    {
+      XML_Index index = XML_GetCurrentByteIndex(parser);
+      const char *p = gap + std::max<XML_Index>(index - fed, 0);
+      message = XML_ErrorString(XML_GetErrorCode(parser));
+      message += " at byte ";
+      message += std::to_string(std::min(p, end) - data);
+    }
+  XML_ParserFree(parser);
+  return message;
+}
+
+} // namespace slices
+
+/**
+ * Runs XML_Parse for parseAsync() on the libuv threadpool. The parser
+ * records into its tape meanwhile; the events are handed to the
+ * callback once the worker is done. For parseParallel(), the worker
+ * first tries to parse the whole document in up to threads slices.
+ */
+class ParseWorker : public Nan::AsyncWorker {
+public:
+  ParseWorker(Nan::Callback *callback, Parser *parser,
+              Local<Object> buffer, int isFinal,
+              size_t threads = 0, size_t minSlice = 0)
+    : Nan::AsyncWorker(callback, threads ? "node-expat:parseParallel" : "node-expat:parseAsync"),
+      parser(parser), data(Buffer::Data(buffer)), len(Buffer::Length(buffer)),
+      isFinal(isFinal), result(false), threads(threads), minSlice(minSlice)
+  {
+    /* Keep the parser and the input alive until HandleOKCallback */
+    SaveToPersistent("parser", parser->handle());
+    SaveToPersistent("buffer", buffer);
+  }
+
+  void Execute()
+  {
+    if (threads > 0)
+      {
+        XML_Char separator = parser->namespaces ? Parser::NS_SEPARATOR : '\0';
+        size_t count = threads > 1
+          ? slices::Parse(data, len, parser->encodingName, separator,
+                          parser->eventMask, threads, minSlice, parser->tape,
+                          parser->endLine, parser->endColumn,
+                          parser->endByteIndex)
+          : 0;
+        parser->parallelSlices = std::max<size_t>(count, 1);
+        if (count > 0)
+          {
+            /* The document is done: further input is an error until
+               reset(), as after parse(buf, true) */
+            XML_StopParser(parser->parser, XML_FALSE);
+            parser->parallelEnded = true;
+            result = true;
+            return;
+          }
+      }
+    result = parser->parseBytes(data, len, isFinal);
+    parser->flushText();
+  }
+
+  void HandleOKCallback()
+  {
+    Nan::HandleScope scope;
+
+    parser->idle();
+
+    Local<Value> argv[3] = { Nan::Null(),
+                             result ? Nan::True() : Nan::False(),
+                             parser->takeEvents() };
+    parser->trimMemory(false);
+    parser->reportMemory();
+    callback->Call(3, argv, async_resource);
+  }
+
+private:
+  Parser *parser;
+  const char *data;
+  size_t len;
+  int isFinal;
+  bool result;
+  /* parseParallel() only */
+  size_t threads;
+  size_t minSlice;
+};
+
+/**
+ * parseAsync(buffer, isFinal, callback(err, result, events)). Only one
+ * call may be in flight per parser; lib/node-expat.js queues them.
+ */
+NAN_METHOD(Parser::ParseAsync)
+{
+  Parser *parser = Nan::ObjectWrap::Unwrap<Parser>(info.This());
+  Nan::HandleScope scope;
+
+  if (!parser->checkIdle())
+    return;
+
+  if (info.Length() < 3 || !Buffer::HasInstance(info[0]) || !info[2]->IsFunction())
+    {
+      Nan::ThrowTypeError("parseAsync expects a Buffer, isFinal and a callback");
+      return;
+    }
+  Local<Object> buffer = Nan::To<Object>(info[0]).ToLocalChecked();
+  int isFinal = info[1]->IsTrue();
+
+  if (parser->zeroCopy)
+    parser->lastBuffer.Reset(buffer);
+  parser->busy = true;
+  parser->recording = true;
+
+  Nan::Callback *callback = new Nan::Callback(info[2].As<Function>());
+  Nan::AsyncQueueWorker(new ParseWorker(callback, parser, buffer, isFinal));
+}
+
+/**
+ * parseParallel(buffer, threads, minSlice, callback(err, result, events))
+ * parses a whole document like parseAsync(buffer, true). A fresh
+ * parser without select or coalesceText splits it into slices of at
+ * least minSlice bytes, parsed on up to threads threads; otherwise, or
+ * when speculation fails, one parser does all the work.
+ */
+NAN_METHOD(Parser::ParseParallel)
+{
+  Parser *parser = Nan::ObjectWrap::Unwrap<Parser>(info.This());
+  Nan::HandleScope scope;
+
+  if (!parser->checkIdle())
+    return;
+
+  if (info.Length() < 4 || !Buffer::HasInstance(info[0]) ||
+      !info[1]->IsUint32() || !info[2]->IsUint32() || !info[3]->IsFunction())
+    {
+      Nan::ThrowTypeError("parseParallel expects a Buffer, threads, minSlice and a callback");
+      return;
+    }
+  Local<Object> buffer = Nan::To<Object>(info[0]).ToLocalChecked();
+  size_t threads = std::max<uint32_t>(Nan::To<uint32_t>(info[1]).FromJust(), 1);
+  size_t minSlice = Nan::To<uint32_t>(info[2]).FromJust();
+
+  /* Slices only see their own part of the document */
+  XML_ParsingStatus status;
+  XML_GetParsingStatus(parser->parser, &status);
+  if (parser->selector || parser->coalesceText || status.parsing != XML_INITIALIZED)
+    threads = 1;
+
+  if (parser->zeroCopy)
+    parser->lastBuffer.Reset(buffer);
+  parser->busy = true;
+  parser->recording = true;
+
+  Nan::Callback *callback = new Nan::Callback(info[3].As<Function>());
+  Nan::AsyncQueueWorker(new ParseWorker(callback, parser, buffer, 1,
+                                        threads, minSlice));
+}
+
+/**
+ * Runs parseRecords() on the libuv threadpool: finds the records, then
+ * parses their batches on up to threads threads, each with an expat
+ * instance of its own. Every parsed batch is sent to the progress
+ * callback as an array of events, in document order or as soon as it
+ * is done.
+ */
+class RecordsWorker : public Nan::AsyncProgressQueueWorker<slices::Batch *> {
+public:
+  RecordsWorker(Nan::Callback *callback, Nan::Callback *progress, Parser *parser,
+                Local<Object> buffer, const std::string &record,
+                size_t threads, bool ordered)
+    : Nan::AsyncProgressQueueWorker<slices::Batch *>(callback, "node-expat:parseRecords"),
+      progress(progress), parser(parser),
+      data(Buffer::Data(buffer)), len(Buffer::Length(buffer)),
+      record(record), threads(threads), ordered(ordered), records(0)
+  {
+    SaveToPersistent("parser", parser->handle());
+    SaveToPersistent("buffer", buffer);
+  }
+
+  ~RecordsWorker()
+  {
+    delete progress;
+  }
+
+  void Execute(const ExecutionProgress &sender)
+  {
+    XML_Char separator = parser->namespaces ? Parser::NS_SEPARATOR : '\0';
+    std::string laterEncoding = parser->encodingName;
+    if (!slices::SliceEncoding(data, len, laterEncoding))
+      {
+        SetErrorMessage("parseRecords needs an encoding that is ASCII-compatible");
+        return;
+      }
+
+    /* Batches of about 1 MiB, at least 16 per thread for balance */
+    size_t target = std::min<size_t>(std::max<size_t>(len / (threads * 16), 64 << 10), 1 << 20);
+    std::string error;
+    if (!slices::FindRecords(data, len, record, threads, target, batches))
+      {
+        error = slices::CheckOutside(data, len, parser->encodingName, separator,
+                                     std::vector<slices::Batch>());
+        if (error.empty())
+          error = "parseRecords does not support document type declarations";
+      }
+    else
+      error = slices::CheckOutside(data, len, parser->encodingName, separator, batches);
+    if (!error.empty())
+      {
+        SetErrorMessage(error.c_str());
+        return;
+      }
+
+    std::mutex lock;
+    std::vector<bool> done(batches.size());
+    size_t sent = 0;
+    std::atomic<size_t> next(0);
+    std::atomic<bool> failed(false);
+    size_t workers = std::min(threads, batches.size());
+    slices::ForEach(workers, workers, [&](size_t) {
+      slices::SliceParser slice(laterEncoding.empty() ? NULL : laterEncoding.c_str(),
+                                separator, parser->eventMask, record);
+      for (size_t i = next++; i < batches.size() && !failed; i = next++)
+        {
+          slices::Batch &batch = batches[i];
+          slice.Reset();
+          if (!slice.Parse(batch.ancestors, batch.begin, batch.end, batch.ancestors))
+            {
+              batch.error = slice.Error(data);
+              failed = true;
+            }
+          batch.tape = std::move(slice.tape);
+          slice.tape.Clear();
+
+          std::lock_guard<std::mutex> guard(lock);
+          done[i] = true;
+          if (!ordered)
+            {
+              slices::Batch *ready = &batch;
+              if (batch.error.empty())
+                sender.Send(&ready, 1);
+              continue;
+            }
+          /* Send what is done in order, up to a failed batch */
+          for (; sent < batches.size() && done[sent] && batches[sent].error.empty(); sent++)
+            {
+              slices::Batch *ready = &batches[sent];
+              sender.Send(&ready, 1);
+            }
+        }
+    });
+
+    for (const slices::Batch &batch : batches)
+      {
+        if (!batch.error.empty())
+          {
+            SetErrorMessage(batch.error.c_str());
+            return;
+          }
+        records += batch.records;
+      }
+  }
+
+  void HandleProgressCallback(slices::Batch *const *ready, size_t count)
+  {
+    Nan::HandleScope scope;
+
+    for (size_t i = 0; i < count; i++)
+      {
+        Local<Value> argv[1] = { parser->takeEvents(ready[i]->tape) };
+        progress->Call(1, argv, async_resource);
+      }
+  }
+
+  void HandleOKCallback()
+  {
+    Nan::HandleScope scope;
+
+    parser->idle();
+    Local<Value> argv[2] = { Nan::Null(), Nan::New<Number>(records) };
+    callback->Call(2, argv, async_resource);
+  }
+
+  void HandleErrorCallback()
+  {
+    Nan::HandleScope scope;
+
+    parser->idle();
+    Local<Value> argv[1] = { Nan::Error(ErrorMessage()) };
+    callback->Call(1, argv, async_resource);
+  }
+
+private:
+  Nan::Callback *progress;
+  Parser *parser;
+  const char *data;
+  size_t len;
+  std::string record;
+  size_t threads;
+  bool ordered;
+  std::vector<slices::Batch> batches;
+  double records;
+};
+
+/**
+ * parseRecords(buffer, record, threads, ordered, progress(events),
+ * callback(err, records)) parses the elements named record, those not
+ * inside another one, on up to threads threads. progress gets the
+ * events of one batch of records at a time; other events are dropped.
+ */
+NAN_METHOD(Parser::ParseRecords)
+{
+  Parser *parser = Nan::ObjectWrap::Unwrap<Parser>(info.This());
+  Nan::HandleScope scope;
+
+  if (!parser->checkIdle())
+    return;
+
+  if (info.Length() < 6 || !Buffer::HasInstance(info[0]) || !info[1]->IsString() ||
+      !info[2]->IsUint32() || !info[4]->IsFunction() || !info[5]->IsFunction())
+    {
+      Nan::ThrowTypeError("parseRecords expects a Buffer, a record name, threads, ordered, a progress callback and a callback");
+      return;
+    }
+  /* Batches are parsed apart from the parser's own state */
+  if (parser->selector || parser->coalesceText)
+    {
+      Nan::ThrowError("parseRecords does not support select or coalesceText");
+      return;
+    }
+  Local<Object> buffer = Nan::To<Object>(info[0]).ToLocalChecked();
+  Nan::Utf8String record(info[1]);
+  if (record.length() == 0)
+    {
+      Nan::ThrowTypeError("parseRecords expects a record name");
+      return;
+    }
+  size_t threads = std::max<uint32_t>(Nan::To<uint32_t>(info[2]).FromJust(), 1);
+  bool ordered = info[3]->IsTrue();
+
+  parser->busy = true;
+
+  Nan::Callback *progress = new Nan::Callback(info[4].As<Function>());
+  Nan::Callback *callback = new Nan::Callback(info[5].As<Function>());
+  Nan::AsyncQueueWorker(new RecordsWorker(callback, progress, parser, buffer,
+                                          std::string(*record, record.length()),
+                                          threads, ordered));
+}
+
+/**
+ * Runs parseFile() and parseFd() on the libuv threadpool, sending the
+ * events of each batch to the progress callback while the next one is
+ * parsed. At most MAX_PENDING batches wait for the main thread, so a
+ * slow consumer holds up the parse instead of letting events pile up.
+ *
+ * parseFile() maps the file rather than reading it, and expat parses
+ * batchSize bytes of the mapping at a time without copying them.
+ * parseFd() reads the descriptor on a thread of its own into a ring of
+ * buffers, so that reading the next batches overlaps with parsing.
+ */
+class FileWorker : public Nan::AsyncProgressQueueWorker<EventTape *> {
+public:
+  FileWorker(Nan::Callback *callback, Nan::Callback *progress, Parser *parser,
+             const std::string &path, int fd, size_t batchSize, size_t buffers)
+    : Nan::AsyncProgressQueueWorker<EventTape *>(callback, fd < 0 ? "node-expat:parseFile"
+                                                                  : "node-expat:parseFd"),
+      progress(progress), parser(parser), path(path), fd(fd),
+      batchSize(batchSize), buffers(buffers), result(false), pending(0)
+  {
+    SaveToPersistent("parser", parser->handle());
+  }
+
+  ~FileWorker()
+  {
+    delete progress;
+  }
+
+  void Execute(const ExecutionProgress &sender)
+  {
+    if (fd >= 0)
+      readFd(sender);
+    else
+      mapFile(sender);
+  }
+
+  void HandleProgressCallback(EventTape *const *ready, size_t count)
+  {
+    Nan::HandleScope scope;
+
+    for (size_t i = 0; i < count; i++)
+      {
+        Local<Value> argv[1] = { parser->takeEvents(*ready[i]) };
+        delete ready[i];
+        {
+          std::lock_guard<std::mutex> guard(lock);
+          pending--;
+        }
+        drained.notify_one();
+        progress->Call(1, argv, async_resource);
+      }
+  }
+
+  void HandleOKCallback()
+  {
+    Nan::HandleScope scope;
+
+    parser->idle();
+
+    Local<Value> argv[2] = { Nan::Null(), result ? Nan::True() : Nan::False() };
+    parser->trimMemory(false);
+    parser->reportMemory();
+    callback->Call(2, argv, async_resource);
+  }
+
+  void HandleErrorCallback()
+  {
+    Nan::HandleScope scope;
+
+    parser->idle();
+    parser->tape.Clear();
+
+    Local<Value> argv[1] = { Nan::Error(ErrorMessage()) };
+    callback->Call(1, argv, async_resource);
+  }
+
+private:
+  static const size_t MAX_PENDING = 4;
+
+  void mapFile(const ExecutionProgress &sender)
+  {
+#ifdef _WIN32
+    /* No mmap(): read batches into one reused buffer, which expat
+       has to copy from */
+    FILE *file = fopen(path.c_str(), "rb");
+    if (!file)
+      return fail();
+    std::vector<char> buffer(batchSize);
+    do
+      {
+        size_t n = fread(buffer.data(), 1, batchSize, file);
+        if (ferror(file))
+          {
+            fail();
+            break;
+          }
+        result = parseBatch(sender, buffer.data(), n, n < batchSize);
+      }
+    while (result && !feof(file));
+    fclose(file);
+#else
+    int fd = open(path.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0)
+      {
+        fail();
+        if (fd >= 0)
+          close(fd);
+        return;
+      }
+    if (!S_ISREG(st.st_mode))
+      {
+        close(fd);
+        SetErrorMessage((path + ": not a regular file").c_str());
+        return;
+      }
+    size_t len = st.st_size;
+    /* mmap() refuses empty mappings; an empty file is parsed as such */
+    void *map = NULL;
+    if (len > 0)
+      {
+        map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED)
+          {
+            fail();
+            close(fd);
+            return;
+          }
+        madvise(map, len, MADV_SEQUENTIAL);
+      }
+    /* The mapping stays valid without the descriptor */
+    close(fd);
+
+    const char *data = static_cast<const char *>(map);
+    size_t pos = 0;
+    do
+      {
+        size_t n = std::min(batchSize, len - pos);
+        pos += n;
+        result = parseBatch(sender, data + pos - n, n, pos == len, true);
+      }
+    while (result && pos < len);
+    /* Position getters must not read the mapping once it is gone;
+       expat copies what it still needs into the parser's arena */
+    {
+      Arena::Scope memory(parser->arena.get());
+      XML_ReleaseExternal(parser->parser);
+    }
+    if (map)
+      munmap(map, len);
+#endif
+  }
+
+  /* One buffer of parseFd()'s ring, owned by the reader while not full */
+  struct Block {
+    std::vector<char> data;
+    size_t len = 0;
+    int error = 0;
+    bool full = false;
+  };
+
+  void readFd(const ExecutionProgress &sender)
   {
-    Nan::HandleScope scope;
-    Parser *parser = reinterpret_cast<Parser *>(userData);
+    std::vector<Block> ring(buffers);
+    for (Block &block : ring)
+      block.data.resize(batchSize);
+    std::mutex ringLock;
+    std::condition_variable filled, emptied;
+    std::atomic<bool> stop(false);
 
-    /* Collect atts into JS object */
-    Local<Object> attr = Nan::New<Object>();
-    for(const XML_Char **atts1 = atts; *atts1; atts1 += 2)
-      Nan::Set(attr, Nan::New(atts1[0]).ToLocalChecked(), Nan::New(atts1[1]).ToLocalChecked());
+    std::thread reader([&] {
+      /* Seekable descriptors are read with pread() from their offset,
+         which is left alone; others as they become readable */
+#ifdef _WIN32
+      long long offset = -1;
+#else
+      long long offset = lseek(fd, 0, SEEK_CUR);
+#endif
+      for (size_t i = 0; ; i = (i + 1) % ring.size())
+        {
+          Block &block = ring[i];
+          {
+            std::unique_lock<std::mutex> guard(ringLock);
+            emptied.wait(guard, [&] { return stop || !block.full; });
+            if (stop)
+              return;
+          }
+          long long n = readBlock(block.data.data(), offset, stop);
+          int error = n < 0 ? errno : 0;
+          if (n > 0 && offset >= 0)
+            offset += n;
+          {
+            std::lock_guard<std::mutex> guard(ringLock);
+            block.len = n > 0 ? n : 0;
+            block.error = error;
+            block.full = true;
+          }
+          filled.notify_one();
+          if (n <= 0)
+            return;
+        }
+    });
 
-    /* Trigger event */
-    Local<Value> argv[3] = { Nan::New("startElement").ToLocalChecked(),
-                              Nan::New(name).ToLocalChecked(),
-                              attr };
-    parser->Emit(3, argv);
+    /* In place, expat keeps pointing into a buffer until the next call,
+       so each is only handed back after the following one is parsed.
+       That still leaves the reader a buffer with three or more; with
+       two, expat copies instead. */
+    bool inPlace = ring.size() > 2;
+    size_t previous = ring.size();
+    for (size_t i = 0; ; i = (i + 1) % ring.size())
+      {
+        Block &block = ring[i];
+        {
+          std::unique_lock<std::mutex> guard(ringLock);
+          filled.wait(guard, [&] { return block.full; });
+        }
+        if (block.error)
+          {
+            errno = block.error;
+            fail();
+            break;
+          }
+        bool isFinal = block.len == 0;
+        result = parseBatch(sender, block.data.data(), block.len, isFinal, inPlace);
+        if (!result || isFinal)
+          break;
+
+        size_t done = inPlace ? previous : i;
+        previous = i;
+        if (done == ring.size())
+          continue;
+        {
+          std::lock_guard<std::mutex> guard(ringLock);
+          ring[done].full = false;
+        }
+        emptied.notify_one();
+      }
+    {
+      std::lock_guard<std::mutex> guard(ringLock);
+      stop = true;
+    }
+    emptied.notify_one();
+    reader.join();
+    /* A read error may leave expat pointing into the ring */
+    if (inPlace)
+      {
+        Arena::Scope memory(parser->arena.get());
+        XML_ReleaseExternal(parser->parser);
+      }
   }
 
-  static void EndElement(void *userData,
-                         const XML_Char *name)
+  /** Reads up to batchSize bytes into data, retrying on EINTR. Returns
+      0 at the end of input or when stop is set, -1 on errors. */
+  long long readBlock(char *data, long long offset, const std::atomic<bool> &stop)
   {
-    Nan::HandleScope scope;
-    Parser *parser = reinterpret_cast<Parser *>(userData);
+    for (;;)
+      {
+#ifdef _WIN32
+        long long n = _read(fd, data, static_cast<unsigned>(batchSize));
+#else
+        if (offset < 0)
+          {
+            /* Wait for pipes and sockets, even non-blocking ones like
+               Node's, without blocking in read() past stop */
+            struct pollfd ready = { fd, POLLIN, 0 };
+            int polled = poll(&ready, 1, 100);
+            if (stop)
+              return 0;
+            if (polled == 0 || (polled < 0 && errno == EINTR))
+              continue;
+            if (polled < 0)
+              return -1;
+          }
+        long long n = offset < 0 ? read(fd, data, batchSize)
+                                 : pread(fd, data, batchSize, offset);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+          continue;
+#endif
+        if (n >= 0 || errno != EINTR)
+          return n;
+      }
+  }
 
-    /* Trigger event */
-    Local<Value> argv[2] = { Nan::New("endElement").ToLocalChecked(), Nan::New(name).ToLocalChecked() };
-    parser->Emit(2, argv);
+  /** Parses one batch and sends its events */
+  bool parseBatch(const ExecutionProgress &sender, const char *data, size_t len,
+                  bool isFinal, bool inPlace = false)
+  {
+    bool ok = parser->parseBytes(data, len, isFinal, inPlace);
+    if (isFinal || !ok)
+      parser->flushText();
+    if (parser->tape.IsEmpty())
+      return ok;
+
+    {
+      std::unique_lock<std::mutex> guard(lock);
+      drained.wait(guard, [this] { return pending < MAX_PENDING; });
+      pending++;
+    }
+    EventTape *ready = new EventTape(std::move(parser->tape));
+    parser->tape.Clear();
+    sender.Send(&ready, 1);
+    return ok;
   }
 
-  static void StartCdata(void *userData)
+  void fail()
   {
-    Nan::HandleScope scope;
-    Parser *parser = reinterpret_cast<Parser *>(userData);
+    SetErrorMessage((path + ": " + strerror(errno)).c_str());
+  }
 
-    /* Trigger event */
-    Local<Value> argv[1] = { Nan::New("startCdata").ToLocalChecked() };
-    parser->Emit(1, argv);
+  Nan::Callback *progress;
+  Parser *parser;
+  /* parseFile()'s path, or a name for parseFd()'s descriptor */
+  std::string path;
+  /* parseFd() only */
+  int fd;
+  size_t batchSize;
+  size_t buffers;
+  bool result;
+  /* Batches sent but not yet converted by the main thread */
+  std::mutex lock;
+  std::condition_variable drained;
+  size_t pending;
+};
+
+/**
+ * parseFile(path, batchSize, progress(events), callback(err, result))
+ * parses a whole file like parseAsync(buffer, true) without reading it
+ * into a Buffer. progress gets the events of each batchSize bytes;
+ * err is set when the file can't be opened or mapped, result is false
+ * on a parse error.
+ */
+NAN_METHOD(Parser::ParseFile)
+{
+  Parser *parser = Nan::ObjectWrap::Unwrap<Parser>(info.This());
+  Nan::HandleScope scope;
+
+  if (!parser->checkIdle())
+    return;
+
+  if (info.Length() < 4 || !info[0]->IsString() || !info[1]->IsUint32() ||
+      !info[2]->IsFunction() || !info[3]->IsFunction())
+    {
+      Nan::ThrowTypeError("parseFile expects a path, batchSize, a progress callback and a callback");
+      return;
+    }
+  Nan::Utf8String path(info[0]);
+  /* expat takes int lengths */
+  size_t batchSize = std::min<uint32_t>(std::max<uint32_t>(Nan::To<uint32_t>(info[1]).FromJust(), 1),
+                                        INT_MAX);
+
+  parser->busy = true;
+  parser->recording = true;
+
+  Nan::Callback *progress = new Nan::Callback(info[2].As<Function>());
+  Nan::Callback *callback = new Nan::Callback(info[3].As<Function>());
+  Nan::AsyncQueueWorker(new FileWorker(callback, progress, parser,
+                                       std::string(*path, path.length()), -1,
+                                       batchSize, 0));
+}
+
+/**
+ * parseFd(fd, batchSize, buffers, progress(events), callback(err, result))
+ * parses everything left to read from a descriptor, like parseFile():
+ * a file from its offset, or a pipe or socket until its end. A thread
+ * reads ahead into up to buffers buffers of batchSize bytes while the
+ * previous ones are parsed. The descriptor is not closed, and whatever
+ * else reads it must wait until the callback.
+ */
+NAN_METHOD(Parser::ParseFd)
+{
+  Parser *parser = Nan::ObjectWrap::Unwrap<Parser>(info.This());
+  Nan::HandleScope scope;
+
+  if (!parser->checkIdle())
+    return;
+
+  if (info.Length() < 5 || !info[0]->IsInt32() || Nan::To<int32_t>(info[0]).FromJust() < 0 ||
+      !info[1]->IsUint32() || !info[2]->IsUint32() ||
+      !info[3]->IsFunction() || !info[4]->IsFunction())
+    {
+      Nan::ThrowTypeError("parseFd expects a descriptor, batchSize, buffers, a progress callback and a callback");
+      return;
+    }
+  int fd = Nan::To<int32_t>(info[0]).FromJust();
+  size_t batchSize = std::min<uint32_t>(std::max<uint32_t>(Nan::To<uint32_t>(info[1]).FromJust(), 1),
+                                        INT_MAX);
+  size_t buffers = std::max<uint32_t>(Nan::To<uint32_t>(info[2]).FromJust(), 2);
+
+  parser->busy = true;
+  parser->recording = true;
+
+  Nan::Callback *progress = new Nan::Callback(info[3].As<Function>());
+  Nan::Callback *callback = new Nan::Callback(info[4].As<Function>());
+  /* Errors name the descriptor */
+  Nan::AsyncQueueWorker(new FileWorker(callback, progress, parser, "fd " + std::to_string(fd), fd,
+                                       batchSize, buffers));
+}
+
+/**
+ * Idle expat instances for parseDocuments() and parseToObject(), kept
+ * across calls with one free list per encoding, separator and event
+ * mask. A worker takes one for all its documents and resets it between
+ * them, which is much cheaper than creating a parser per document.
+ */
+class DocumentPool {
+public:
+  static std::unique_ptr<slices::SliceParser> Acquire(const std::string &encoding,
+                                                      XML_Char separator, uint32_t eventMask)
+  {
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      std::vector<std::unique_ptr<slices::SliceParser> > &free = idle[Key(encoding, separator, eventMask)];
+      if (!free.empty())
+        {
+          std::unique_ptr<slices::SliceParser> parser = std::move(free.back());
+          free.pop_back();
+          return parser;
+        }
+    }
+    return std::unique_ptr<slices::SliceParser>(
+      new slices::SliceParser(encoding.empty() ? NULL : encoding.c_str(), separator, eventMask));
   }
 
-  static void EndCdata(void *userData)
+  static void Release(std::unique_ptr<slices::SliceParser> parser, const std::string &encoding,
+                      XML_Char separator, uint32_t eventMask)
   {
-    Nan::HandleScope scope;
-    Parser *parser = reinterpret_cast<Parser *>(userData);
+    std::lock_guard<std::mutex> guard(lock);
+    std::vector<std::unique_ptr<slices::SliceParser> > &free = idle[Key(encoding, separator, eventMask)];
+    if (free.size() < MAX_IDLE)
+      free.push_back(std::move(parser));
+  }
 
-    /* Trigger event */
-    Local<Value> argv[1] = { Nan::New("endCdata").ToLocalChecked() };
-    parser->Emit(1, argv);
+private:
+  /* Per configuration; more than the threadpool has threads by default */
+  static const size_t MAX_IDLE = 16;
+
+  static std::mutex lock;
+  static std::unordered_map<std::string, std::vector<std::unique_ptr<slices::SliceParser> > > idle;
+
+  static std::string Key(const std::string &encoding, XML_Char separator, uint32_t eventMask)
+  {
+    return encoding + '\0' + separator + std::to_string(eventMask);
   }
+};
 
-  static void Text(void *userData,
-                   const XML_Char *s, int len)
+std::mutex DocumentPool::lock;
+std::unordered_map<std::string, std::vector<std::unique_ptr<slices::SliceParser> > > DocumentPool::idle;
+
+/**
+ * Builds the result of parseToObject() straight from expat's callbacks.
+ * Each open element collects its attributes and children as key/value
+ * lists that become one object once the element ends. Properties are
+ * added in document order, so elements of the same shape share a
+ * hidden class instead of ending up in dictionary mode as with the
+ * bulk Object::New. Repeated child names are grouped into arrays.
+ */
+class TreeBuilder {
+public:
+  /* The only events a tree is built from */
+  static constexpr uint32_t EVENT_MASK = (1u << EventTape::START_ELEMENT) |
+                                         (1u << EventTape::END_ELEMENT) |
+                                         (1u << EventTape::TEXT);
+
+  TreeBuilder(const std::string &attrPrefix, const std::string &textKey, bool alwaysArray)
+    : attrPrefix(attrPrefix), alwaysArray(alwaysArray), names(1024), depth(0)
   {
-    Nan::HandleScope scope;
-    Parser *parser = reinterpret_cast<Parser *>(userData);
+    isolate = Isolate::GetCurrent();
+    context = isolate->GetCurrentContext();
+    this->textKey = names.Get(textKey.data(), textKey.size());
+  }
 
-    /* Trigger event */
-    Local<Value> argv[2] = { Nan::New("text").ToLocalChecked(),
-                              Nan::New(s, len).ToLocalChecked() };
-    parser->Emit(2, argv);
+  /** Parses a whole document with a pooled expat instance, which keeps
+      this builder's handlers until the caller resets it */
+  bool parse(XML_Parser parser, const char *data, size_t len)
+  {
+    XML_SetUserData(parser, this);
+    XML_SetElementHandler(parser, StartElement, EndElement);
+    XML_SetCharacterDataHandler(parser, Text);
+    /* XML_Parse() takes an int */
+    while (len > INT_MAX)
+      {
+        if (XML_Parse(parser, data, INT_MAX, 0) == XML_STATUS_ERROR)
+          return false;
+        data += INT_MAX;
+        len -= INT_MAX;
+      }
+    return XML_Parse(parser, data, static_cast<int>(len), 1) != XML_STATUS_ERROR;
   }
 
-  static void ProcessingInstruction(void *userData,
-                                    const XML_Char *target, const XML_Char *data)
+  /** Builds the result from the elements and text of a tape instead */
+  void build(const EventTape &tape)
   {
-    Nan::HandleScope scope;
-    Parser *parser = reinterpret_cast<Parser *>(userData);
+    size_t pos = 0;
+    while (pos < tape.words.size())
+      {
+        EventTape::Type type = static_cast<EventTape::Type>(tape.words[pos++]);
+        if (type == EventTape::START_ELEMENT)
+          {
+            pos += 2;
+            open();
+            for (uint32_t count = tape.words[pos++]; count > 0; count--, pos += 4)
+              attribute(tape.chars.data() + tape.words[pos + 1], tape.words[pos],
+                        tape.chars.data() + tape.words[pos + 3], tape.words[pos + 2]);
+          }
+        else if (type == EventTape::END_ELEMENT)
+          {
+            close(tape.chars.data() + tape.words[pos + 1], tape.words[pos]);
+            pos += 2;
+          }
+        else if (type == EventTape::TEXT)
+          {
+            text(tape.chars.data() + tape.words[pos + 1], tape.words[pos]);
+            pos += 2;
+          }
+        else
+          for (int i = EventTape::ValueCount(type); i > 0; i--)
+            if (tape.words[pos++] < EventTape::TRUE_VALUE)
+              pos++;
+      }
+  }
 
-    /* Trigger event */
-    Local<Value> argv[3] = { Nan::New("processingInstruction").ToLocalChecked(),
-                              Nan::New(target).ToLocalChecked(),
-                              Nan::New(data).ToLocalChecked() };
-    parser->Emit(3, argv);
+  static std::string getError(XML_Parser parser)
+  {
+    std::string error = XML_ErrorString(XML_GetErrorCode(parser));
+    error += " at line " + std::to_string(XML_GetCurrentLineNumber(parser));
+    error += ", column " + std::to_string(XML_GetCurrentColumnNumber(parser));
+    return error;
   }
 
-  static void Comment(void *userData,
-                      const XML_Char *data)
+  Local<Value> result;
+
+private:
+  struct Frame {
+    std::vector<Local<Name>> keys;
+    std::vector<Local<Value>> values;
+    std::vector<bool> isArray;
+    std::string text;
+
+    void Add(Local<Name> key, Local<Value> value, bool asArray)
+    {
+      for (size_t i = 0; i < keys.size(); i++)
+        if (keys[i] == key)
+          {
+            if (!isArray[i])
+              {
+                Local<Array> array = Nan::New<Array>();
+                Nan::Set(array, 0, values[i]);
+                values[i] = array;
+                isArray[i] = true;
+              }
+            Local<Array> array = values[i].As<Array>();
+            Nan::Set(array, array->Length(), value);
+            return;
+          }
+
+      keys.push_back(key);
+      if (asArray)
+        {
+          Local<Array> array = Nan::New<Array>();
+          Nan::Set(array, 0, value);
+          value = array;
+        }
+      values.push_back(value);
+      isArray.push_back(asArray);
+    }
+  };
+
+  Isolate *isolate;
+  Local<Context> context;
+  std::string attrPrefix;
+  Local<Name> textKey;
+  bool alwaysArray;
+  NameCache names;
+
+  /* stack[0..depth) are the open elements; frames are reused */
+  std::vector<Frame> stack;
+  size_t depth;
+  /* scratch space for prefixed attribute names */
+  std::string key;
+
+  static bool IsWhitespace(const std::string &text)
   {
-    Nan::HandleScope scope;
-    Parser *parser = reinterpret_cast<Parser *>(userData);
+    for (char c : text)
+      if (c != ' ' && c != '\t' && c != '\n' && c != '\r')
+        return false;
+    return true;
+  }
 
-    /* Trigger event */
-    Local<Value> argv[2] = { Nan::New("comment").ToLocalChecked(), Nan::New(data).ToLocalChecked() };
-    parser->Emit(2, argv);
+  void open()
+  {
+    if (depth == stack.size())
+      stack.emplace_back();
+    Frame &frame = stack[depth++];
+    frame.keys.clear();
+    frame.values.clear();
+    frame.isArray.clear();
+    frame.text.clear();
   }
 
-  static void XmlDecl(void *userData,
-                      const XML_Char *version, const XML_Char *encoding,
-                      int standalone)
+  void attribute(const char *name, size_t nameLen, const char *value, size_t valueLen)
   {
-    Nan::HandleScope scope;
-    Parser *parser = reinterpret_cast<Parser *>(userData);
+    key.assign(attrPrefix);
+    key.append(name, nameLen);
+    stack[depth - 1].Add(names.Get(key.data(), key.size()),
+                         Nan::New(value, static_cast<int>(valueLen)).ToLocalChecked(), false);
+  }
 
-    /* Trigger event */
-    Local<Value> argv[4];
+  void close(const char *name, size_t len)
+  {
+    Frame &frame = stack[--depth];
 
-                    argv[0] = Nan::New("xmlDecl").ToLocalChecked();
-    if (version)    argv[1] = Nan::New(version).ToLocalChecked();
-    else            argv[1] = Nan::Null();
-    if (encoding)   argv[2] = Nan::New(encoding).ToLocalChecked();
-    else            argv[2] = Nan::Null();
-    if (standalone) argv[3] = Nan::True();
-    else            argv[3] = Nan::False();
+    /* Elements with text only become strings */
+    Local<Value> value;
+    if (frame.keys.empty())
+      value = Nan::New(frame.text).ToLocalChecked();
+    else
+      {
+        if (!IsWhitespace(frame.text))
+          frame.Add(textKey, Nan::New(frame.text).ToLocalChecked(), false);
+        value = newObject(frame.keys.data(), frame.values.data(), frame.keys.size());
+      }
 
-    parser->Emit(4, argv);
+    Local<Name> element = names.Get(name, len);
+    if (depth > 0)
+      stack[depth - 1].Add(element, value, alwaysArray);
+    else
+      result = newObject(&element, &value, 1);
   }
 
-  static void EntityDecl(void *userData, const XML_Char *entityName, int is_parameter_entity,
-                         const XML_Char *value, int value_length, const XML_Char *base,
-                         const XML_Char *systemId, const XML_Char *publicId, const XML_Char *notationName)
+  Local<Object> newObject(const Local<Name> *keys, const Local<Value> *values, size_t count)
   {
-    Nan::HandleScope scope;
-    Parser *parser = reinterpret_cast<Parser *>(userData);
-
-    /* Trigger event */
-    Local<Value> argv[8];
+    Local<Object> object = Object::New(isolate);
+    for (size_t i = 0; i < count; i++)
+      object->CreateDataProperty(context, keys[i], values[i]).FromJust();
+    return object;
+  }
 
-                             argv[0] = Nan::New("entityDecl").ToLocalChecked();
-    if (entityName)          argv[1] = Nan::New(entityName).ToLocalChecked();
-    else                     argv[1] = Nan::Null();
-    if (is_parameter_entity) argv[2] = Nan::True();
-    else                     argv[2] = Nan::False();
-    if (value)               argv[3] = Nan::New(value, value_length).ToLocalChecked();
-    else                     argv[3] = Nan::Null();
-    if (base)                argv[4] = Nan::New(base).ToLocalChecked();
-    else                     argv[4] = Nan::Null();
-    if (systemId)            argv[5] = Nan::New(systemId).ToLocalChecked();
-    else                     argv[5] = Nan::Null();
-    if (publicId)            argv[6] = Nan::New(publicId).ToLocalChecked();
-    else                     argv[6] = Nan::Null();
-    if (notationName)        argv[7] = Nan::New(notationName).ToLocalChecked();
-    else                     argv[7] = Nan::Null();
+  void text(const char *s, size_t len)
+  {
+    if (depth > 0)
+      stack[depth - 1].text.append(s, len);
+  }
 
-    parser->Emit(8, argv);
+  static void StartElement(void *userData,
+                           const XML_Char *name, const XML_Char **atts)
+  {
+    TreeBuilder *builder = reinterpret_cast<TreeBuilder *>(userData);
+    builder->open();
+    for(const XML_Char **atts1 = atts; *atts1; atts1 += 2)
+      builder->attribute(atts1[0], strlen(atts1[0]), atts1[1], strlen(atts1[1]));
   }
 
-  XML_Encoding *xmlEncodingInfo;
+  static void EndElement(void *userData,
+                         const XML_Char *name)
+  {
+    TreeBuilder *builder = reinterpret_cast<TreeBuilder *>(userData);
+    builder->close(name, strlen(name));
+  }
 
-  static int UnknownEncoding(void *encodingHandlerData, const XML_Char *name, XML_Encoding *info)
+  static void Text(void *userData,
+                   const XML_Char *s, int len)
   {
-    Nan::HandleScope scope;
-    Parser *parser = reinterpret_cast<Parser *>(encodingHandlerData);
+    TreeBuilder *builder = reinterpret_cast<TreeBuilder *>(userData);
+    builder->text(s, len);
+  }
+};
 
-    /* Trigger event */
-    parser->xmlEncodingInfo = info;
-    Local<Value> argv[2];
+/**
+ * parseToObject(buffer, options) parses a whole document into nested
+ * objects: { root: { '@attr': value, child: ..., '#text': text } }
+ */
+static NAN_METHOD(ParseToObject)
+{
+  Nan::HandleScope scope;
 
-              argv[0] = Nan::New("unknownEncoding").ToLocalChecked();
-    if (name) argv[1] = Nan::New(name).ToLocalChecked();
-    else      argv[1] = Nan::Null();
+  if (info.Length() < 1 || !Buffer::HasInstance(info[0]))
+    {
+      Nan::ThrowTypeError("parseToObject expects a Buffer");
+      return;
+    }
+  Local<Object> buffer = Nan::To<Object>(info[0]).ToLocalChecked();
 
-    parser->Emit(2, argv);
+  /* Argument 2: options :: Object */
+  std::string encoding;
+  std::string attrPrefix = "@";
+  std::string textKey = "#text";
+  bool alwaysArray = false;
+  if (info.Length() >= 2 && info[1]->IsObject())
+    {
+      Local<Object> options = Nan::To<Object>(info[1]).ToLocalChecked();
+      Local<Value> value = Nan::Get(options, Nan::New("encoding").ToLocalChecked()).ToLocalChecked();
+      if (value->IsString())
+        encoding = *Nan::Utf8String(value);
+      value = Nan::Get(options, Nan::New("attrPrefix").ToLocalChecked()).ToLocalChecked();
+      if (value->IsString())
+        attrPrefix = *Nan::Utf8String(value);
+      value = Nan::Get(options, Nan::New("textKey").ToLocalChecked()).ToLocalChecked();
+      if (value->IsString())
+        textKey = *Nan::Utf8String(value);
+      value = Nan::Get(options, Nan::New("alwaysArray").ToLocalChecked()).ToLocalChecked();
+      alwaysArray = Nan::To<bool>(value).FromJust();
+    }
 
-    /* Did no event handler invoke setUnknownEncoding()? */
-    if (parser->xmlEncodingInfo) {
-      parser->xmlEncodingInfo = NULL;
-      return XML_STATUS_ERROR;
-    } else {
-      return XML_STATUS_OK;
+  TreeBuilder builder(attrPrefix, textKey, alwaysArray);
+  std::unique_ptr<slices::SliceParser> slice = DocumentPool::Acquire(encoding, '\0', TreeBuilder::EVENT_MASK);
+  XML_Parser expat = slice->Borrow();
+  bool ok = builder.parse(expat, Buffer::Data(buffer), Buffer::Length(buffer));
+  std::string error = ok ? std::string() : TreeBuilder::getError(expat);
+  slice->Reset();
+  DocumentPool::Release(std::move(slice), encoding, '\0', TreeBuilder::EVENT_MASK);
+  if (!ok)
+    {
+      Nan::ThrowError(error.c_str());
+      return;
     }
-  }
+  info.GetReturnValue().Set(builder.result);
+}
 
-  /**
-   * Fills xmlEncodingInfo
-   */
-  static NAN_METHOD(SetUnknownEncoding)
+/**
+ * Parses independent documents for parseDocuments() on the libuv
+ * threadpool with one pooled expat instance. Each document is recorded
+ * to a tape of its own; HandleOKCallback() turns the tapes into event
+ * arrays with the parser's settings, or into trees.
+ */
+class DocumentsWorker : public Nan::AsyncWorker {
+public:
+  DocumentsWorker(Nan::Callback *callback, Parser *parser, Local<Array> buffers,
+                  bool tree, const std::string &attrPrefix, const std::string &textKey,
+                  bool alwaysArray)
+    : Nan::AsyncWorker(callback, "node-expat:parseDocuments"),
+      parser(parser), encoding(parser->encodingName),
+      /* Trees need neither namespaces nor other events */
+      separator(!tree && parser->namespaces ? Parser::NS_SEPARATOR : '\0'),
+      eventMask(tree ? TreeBuilder::EVENT_MASK : parser->eventMask),
+      tree(tree), attrPrefix(attrPrefix), textKey(textKey), alwaysArray(alwaysArray)
   {
-    Parser *parser = Nan::ObjectWrap::Unwrap<Parser>(info.This());
-    Nan::HandleScope scope;
-
-    if (!parser->xmlEncodingInfo)
-      Nan::ThrowError("setUnknownEncoding() must be synchronously invoked from an unknownEncoding event handler");
+    SaveToPersistent("parser", parser->handle());
+    SaveToPersistent("buffers", buffers);
+    for (uint32_t i = 0; i < buffers->Length(); i++)
+      {
+        Local<Object> buffer = Nan::To<Object>(Nan::Get(buffers, i).ToLocalChecked()).ToLocalChecked();
+        documents.emplace_back();
+        documents.back().data = Buffer::Data(buffer);
+        documents.back().len = Buffer::Length(buffer);
+      }
+  }
 
-    if (info.Length() >= 1 && info[0]->IsArray()) {
-      Local<Array> map = info[0].As<Array>();
-      /* Copy map */
-      for(int i = 0; i < 256; i++) {
-        Local<Value> m = Nan::Get(map, Nan::New(i)).ToLocalChecked();
-        if (m->IsInt32())
-          parser->xmlEncodingInfo->map[i] = Nan::To<int32_t>(m).FromJust();
+  void Execute()
+  {
+    std::unique_ptr<slices::SliceParser> slice = DocumentPool::Acquire(encoding, separator, eventMask);
+    std::vector<slices::Tag> none;
+    for (Document &document : documents)
+      {
+        slice->Reset();
+        if (!slice->Parse(none, document.data, document.data + document.len, none))
+          document.error = slice->Error(document.data);
         else
-          Nan::ThrowTypeError("UnknownEncoding map must consist of 256 ints");
+          document.tape = std::move(slice->tape);
+        slice->tape.Clear();
       }
-    } else
-      Nan::ThrowTypeError("SetUnknownEncoding expects a map array");
-
-    parser->xmlEncodingInfo = NULL;
-    return;
+    slice->Reset();
+    DocumentPool::Release(std::move(slice), encoding, separator, eventMask);
   }
 
-  void Emit(int argc, Local<Value> argv[])
+  void HandleOKCallback()
   {
     Nan::HandleScope scope;
 
-    Local<Object> handle = this->handle();
-    Local<Function> emit = Nan::Get(handle, Nan::New("emit").ToLocalChecked()).ToLocalChecked().As<Function>();
-    Nan::Callback emitCallback(emit);
-    Nan::Call(emitCallback, argc, argv);
+    std::unique_ptr<TreeBuilder> builder;
+    if (tree)
+      builder.reset(new TreeBuilder(attrPrefix, textKey, alwaysArray));
+    Local<String> eventsKey = Nan::New("events").ToLocalChecked();
+    Local<String> treeKey = Nan::New("tree").ToLocalChecked();
+    Local<String> errorKey = Nan::New("error").ToLocalChecked();
+    Local<Array> results = Nan::New<Array>(documents.size());
+    for (size_t i = 0; i < documents.size(); i++)
+      {
+        Document &document = documents[i];
+        Local<Object> result = Nan::New<Object>();
+        if (!document.error.empty())
+          Nan::Set(result, errorKey, Nan::New(document.error).ToLocalChecked());
+        else if (tree)
+          {
+            builder->build(document.tape);
+            Nan::Set(result, treeKey, builder->result);
+          }
+        else
+          {
+          Nan::Set(result, eventsKey, parser->takeEvents(document.tape));
+          }
+        document.tape = EventTape();
+        Nan::Set(results, i, result);
+      }
+
+    Local<Value> argv[2] = { Nan::Null(), results };
+    callback->Call(2, argv, async_resource);
   }
+
+private:
+  struct Document {
+    const char *data;
+    size_t len;
+    EventTape tape;
+    std::string error;
+  };
+
+  Parser *parser;
+  std::string encoding;
+  XML_Char separator;
+  uint32_t eventMask;
+  std::vector<Document> documents;
+  bool tree;
+  std::string attrPrefix;
+  std::string textKey;
+  bool alwaysArray;
 };
 
+/**
+ * parseDocuments(buffers, treeOptions, callback(err, results)) parses
+ * each Buffer as a whole document with the parser's encoding and
+ * options, off the main thread. results[i] is { events } as in batch
+ * mode, { tree } as from parseToObject() when treeOptions is an object,
+ * or { error }. The parser itself only converts the results.
+ */
+NAN_METHOD(Parser::ParseDocuments)
+{
+  Parser *parser = Nan::ObjectWrap::Unwrap<Parser>(info.This());
+  Nan::HandleScope scope;
+
+  if (info.Length() < 3 || !info[0]->IsArray() || !info[2]->IsFunction())
+    {
+      Nan::ThrowTypeError("parseDocuments expects an array of Buffers, tree options and a callback");
+      return;
+    }
+  Local<Array> buffers = info[0].As<Array>();
+  for (uint32_t i = 0; i < buffers->Length(); i++)
+    if (!Buffer::HasInstance(Nan::Get(buffers, i).ToLocalChecked()))
+      {
+        Nan::ThrowTypeError("parseDocuments expects an array of Buffers");
+        return;
+      }
+  if (parser->selector || parser->coalesceText)
+    {
+      Nan::ThrowError("parseDocuments does not support select or coalesceText");
+      return;
+    }
+
+  /* Argument 2: treeOptions :: Object, or null for events */
+  bool tree = info[1]->IsObject();
+  std::string attrPrefix = "@";
+  std::string textKey = "#text";
+  bool alwaysArray = false;
+  if (tree)
+    {
+      Local<Object> options = Nan::To<Object>(info[1]).ToLocalChecked();
+      Local<Value> value = Nan::Get(options, Nan::New("attrPrefix").ToLocalChecked()).ToLocalChecked();
+      if (value->IsString())
+        attrPrefix = *Nan::Utf8String(value);
+      value = Nan::Get(options, Nan::New("textKey").ToLocalChecked()).ToLocalChecked();
+      if (value->IsString())
+        textKey = *Nan::Utf8String(value);
+      value = Nan::Get(options, Nan::New("alwaysArray").ToLocalChecked()).ToLocalChecked();
+      alwaysArray = Nan::To<bool>(value).FromJust();
+    }
+
+  Nan::Callback *callback = new Nan::Callback(info[2].As<Function>());
+  Nan::AsyncQueueWorker(new DocumentsWorker(callback, parser, buffers, tree,
+                                            attrPrefix, textKey, alwaysArray));
+}
+
+Nan::Persistent<String> Parser::eventNames[Parser::EVENT_COUNT];
+Nan::Persistent<ObjectTemplate> Parser::lazyAttributesTemplate;
+
 extern "C" {
   static NAN_MODULE_INIT(InitAll)
   {
     Parser::Initialize(target);
+    Nan::SetMethod(target, "parseToObject", ParseToObject);
   }
   //Changed the name cause I couldn't load the module with - in their names
   NODE_MODULE(node_expat, InitAll);
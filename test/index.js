@@ -6,7 +6,10 @@ const Buffer = require('buffer').Buffer
 const vows = require('vows')
 const assert = require('assert')
 const fs = require('fs')
+const os = require('os')
 const path = require('path')
+const Writable = require('stream').Writable
+const PassThrough = require('stream').PassThrough
 const log = require('debug')('test/index')
 
 function collapseTexts (evs) {
@@ -29,9 +32,27 @@ function collapseTexts (evs) {
   return r
 }
 
+// Records every event of p while parse(p) runs; result is its return value
+function recordAll (p, parse) {
+  const events = []
+  allEvents.forEach(function (name) {
+    p.on(name, function () {
+      events.push([name].concat(Array.prototype.slice.call(arguments)))
+    })
+  })
+  return { events, result: parse(p) }
+}
+const allEvents = [
+  'startElement', 'endElement', 'text', 'startCdata', 'endCdata',
+  'processingInstruction', 'comment', 'xmlDecl', 'entityDecl',
+  'startNamespaceDecl', 'endNamespaceDecl'
+]
+
 function expect (s, evsExpected) {
   for (let step = s.length; step > 0; step--) {
     expectWithParserAndStep(s, evsExpected, new expat.Parser(), step)
+    expectWithParserAndStep(s, evsExpected, new expat.Parser(null, { batch: true }), step)
+    expectWithParserAndStep(s, evsExpected, new expat.Parser(null, { arena: true }), step)
   }
 }
 
@@ -135,6 +156,12 @@ vows.describe('node-expat').addBatch({
           ['text', 'ß'],
           ['endElement', 'r']])
     },
+    'single element with two-byte text': function () {
+      expect('<r a="€">日本語</r>',
+        [['startElement', 'r', { a: '€' }],
+          ['text', '日本語'],
+          ['endElement', 'r']])
+    },
     'from buffer': function () {
       expect(Buffer.from('<foo>bar</foo>'),
         [['startElement', 'foo', {}],
@@ -240,6 +267,424 @@ vows.describe('node-expat').addBatch({
       assert.equal('¥€$', text)
     }
   },
+  'batch mode': {
+    'one native emit per parse call': function () {
+      const p = new expat.Parser(null, { batch: true })
+      const emit = p.parser.emit
+      let batches = 0
+      p.parser.emit = function (event) {
+        if (event === 'batch') {
+          batches++
+        }
+        return emit.apply(this, arguments)
+      }
+      const names = []
+      p.on('startElement', function (name) {
+        names.push(name)
+      })
+      p.on('endElement', function (name) {
+        names.push('/' + name)
+      })
+      assert.ok(p.parse('<r><a x="1"/><b>text</b>'))
+      assert.equal(batches, 1)
+      assert.ok(p.parse('</r>'))
+      assert.equal(batches, 2)
+      assert.equal(names.join(' '), 'r a /a b /b /r')
+    },
+    'unknownEncoding stays in document order': function () {
+      const p = new expat.Parser(null, { batch: true })
+      const received = []
+      p.on('xmlDecl', function () {
+        received.push('xmlDecl')
+      })
+      p.on('unknownEncoding', function (name) {
+        received.push('unknownEncoding')
+        const map = []
+        for (let i = 0; i < 256; i++) {
+          map[i] = i
+        }
+        p.setUnknownEncoding(map)
+      })
+      p.on('text', function (s) {
+        received.push(s)
+      })
+      assert.ok(p.parse("<?xml version='1.0' encoding='Windows-1252'?><r>x</r>"))
+      assert.equal(received.join(' '), 'xmlDecl unknownEncoding x')
+    }
+  },
+  'coalesce text': {
+    'one event per run of text': function () {
+      const doc = '<r>a&amp;b\nc<x/>d<![CDATA[e]]>f</r>'
+      for (const batch of [false, true]) {
+        const p = new expat.Parser(null, { coalesceText: true, batch })
+        const evs = []
+        p.on('text', function (s) {
+          evs.push(s)
+        })
+        p.on('startCdata', function () {
+          evs.push('[')
+        })
+        assert.ok(p.parse(doc, true))
+        assert.deepEqual(evs, ['a&b\nc', 'd', '[', 'ef'])
+      }
+    },
+    'flushed at the end of parse()': function () {
+      const p = new expat.Parser(null, { coalesceText: true })
+      const evs = []
+      p.on('text', function (s) {
+        evs.push(s)
+      })
+      assert.ok(p.parse('<r>a&amp;'))
+      assert.deepEqual(evs, ['a&'])
+      assert.ok(p.parse('b</r>'))
+      assert.deepEqual(evs, ['a&', 'b'])
+    }
+  },
+  arena: {
+    'reports expat allocations': function () {
+      const p = new expat.Parser(null, { arena: true })
+      assert.strictEqual(p.getStats().arena.frees, 0)
+      let doc = '<r>'
+      for (let i = 0; i < 1000; i++) {
+        doc += '<e' + i + ' a="' + i + '">x</e' + i + '>'
+      }
+      assert.ok(p.parse(doc + '</r>', true))
+      const stats = p.getStats().arena
+      assert.ok(stats.allocations > 0)
+      assert.ok(stats.frees > 0)
+      assert.ok(stats.bytesInUse > 0)
+      assert.ok(stats.bytesReserved >= stats.bytesInUse)
+      assert.ok(p.reset())
+      assert.ok(p.parse('<r/>', true))
+    },
+    'only with the option': function () {
+      assert.strictEqual(new expat.Parser().getStats().arena, undefined)
+    }
+  },
+  'memory usage': {
+    'breaks down native memory': function () {
+      const p = new expat.Parser()
+      const before = p.getMemoryUsage()
+      assert.ok(p.parse('<r>' + 'x'.repeat(100000)))
+      const usage = p.getMemoryUsage()
+      assert.ok(usage.buffer >= 100000)
+      assert.ok(usage.buffer > before.buffer)
+      assert.ok(usage.pools > 0)
+      assert.ok(usage.dtd > 0)
+      assert.strictEqual(usage.total,
+        usage.buffer + usage.pools + usage.dtd + usage.other + usage.events)
+    }
+  },
+  'memory high-water mark': {
+    'shrinks buffers after a large chunk': function () {
+      const p = new expat.Parser(null, { memoryHighWaterMark: 65536 })
+      assert.ok(p.parse('<r><big>' + 'x'.repeat(1000000)))
+      assert.ok(p.getMemoryUsage().buffer < 65536)
+      assert.ok(p.getStats().bytesReclaimed >= 1000000)
+      assert.ok(p.parse('</big><small/></r>', true))
+    },
+    'waits memoryDecay calls': function () {
+      const p = new expat.Parser(null, { memoryHighWaterMark: 65536, memoryDecay: 2 })
+      assert.ok(p.parse('<r>' + 'x'.repeat(1000000)))
+      assert.ok(p.getMemoryUsage().buffer >= 1000000)
+      assert.strictEqual(p.getStats().bytesReclaimed, 0)
+      assert.ok(p.parse('y'))
+      assert.ok(p.getMemoryUsage().buffer < 65536)
+    },
+    'counts what an arena returns': function () {
+      const p = new expat.Parser(null, { arena: true, memoryHighWaterMark: 65536, memoryDecay: 2 })
+      assert.ok(p.parse('<r>' + 'x'.repeat(1000000)))
+      const before = p.getMemoryUsage().total
+      assert.ok(p.parse('y'))
+      const after = p.getMemoryUsage().total
+      const reclaimed = p.getStats().bytesReclaimed
+      assert.ok(after < before - 1000000, after + ' of ' + before + ' bytes left')
+      assert.ok(reclaimed >= 1000000)
+      assert.ok(reclaimed <= before - after + 65536)
+    },
+    'keeps buffers by default': function () {
+      const p = new expat.Parser()
+      assert.ok(p.parse('<r>' + 'x'.repeat(1000000)))
+      assert.ok(p.getMemoryUsage().buffer >= 1000000)
+      assert.strictEqual(p.getStats().bytesReclaimed, 0)
+    }
+  },
+  'parser pool': {
+    'reuses released parsers': function () {
+      const pool = new expat.ParserPool('UTF-8', null, 1)
+      const p = pool.acquire()
+      let names = []
+      p.on('startElement', function (name) {
+        names.push(name)
+      })
+      assert.ok(!p.parse('<r><</r>', true))
+      assert.ok(pool.release(p))
+      assert.strictEqual(pool.acquire(), p)
+      assert.strictEqual(p.listenerCount('startElement'), 0)
+      p.on('startElement', function (name) {
+        names.push(name)
+      })
+      names = []
+      assert.ok(p.parse('<r>x</r>', true))
+      assert.deepEqual(names, ['r'])
+      assert.strictEqual(p.encoding, 'UTF-8')
+    },
+    'reports hit rate': function () {
+      const pool = new expat.ParserPool(null, null, 1)
+      const a = pool.acquire()
+      const b = pool.acquire()
+      assert.ok(pool.release(a))
+      assert.ok(!pool.release(b))
+      pool.acquire()
+      assert.deepEqual(pool.getStats(), { hits: 1, misses: 2, hitRate: 1 / 3, idle: 0 })
+    }
+  },
+  namespaces: {
+    'local names, uris and declarations': function () {
+      const doc = '<s:r xmlns:s="urn:s" xmlns="urn:d" s:a="1" b="2"><x xmlns=""/></s:r>'
+      for (const batch of [false, true]) {
+        const p = new expat.Parser(null, { namespaces: true, batch })
+        const evs = []
+        p.on('startNamespaceDecl', function (prefix, uri) {
+          evs.push(['sns', prefix, uri])
+        })
+        p.on('endNamespaceDecl', function (prefix) {
+          evs.push(['ens', prefix])
+        })
+        p.on('startElement', function (name, attrs, uri) {
+          evs.push(['start', name, attrs, uri])
+        })
+        p.on('endElement', function (name, uri) {
+          evs.push(['end', name, uri])
+        })
+        assert.ok(p.parse(doc, true))
+        assert.deepEqual(evs, [
+          ['sns', 's', 'urn:s'],
+          ['sns', null, 'urn:d'],
+          ['start', 'r', { '{urn:s}a': '1', b: '2' }, 'urn:s'],
+          ['sns', null, null],
+          ['start', 'x', {}, null],
+          ['end', 'x', null],
+          ['ens', null],
+          ['end', 'r', 'urn:s'],
+          ['ens', null],
+          ['ens', 's']
+        ])
+      }
+    },
+    'unbound prefixes are errors': function () {
+      const p = new expat.Parser(null, { namespaces: true })
+      assert.ok(!p.parse('<a:r/>', true))
+      assert.ok(/unbound prefix/.test(p.getError()))
+    },
+    'prefixed names without the option': function () {
+      const p = new expat.Parser()
+      let args = null
+      p.on('startElement', function () {
+        args = Array.prototype.slice.call(arguments)
+      })
+      assert.ok(p.parse('<a:r xmlns:a="urn:a"/>', true))
+      assert.deepEqual(args, ['a:r', { 'xmlns:a': 'urn:a' }])
+    }
+  },
+  'attributes option': {
+    'flat array': function () {
+      for (const batch of [false, true]) {
+        const p = new expat.Parser(null, { attributes: 'array', batch })
+        const evs = []
+        p.on('startElement', function (name, attrs) {
+          evs.push([name, attrs])
+        })
+        assert.ok(p.parse('<r a="1" b="&amp;"><x/></r>', true))
+        assert.deepEqual(evs, [['r', ['a', '1', 'b', '&']], ['x', []]])
+      }
+    },
+    'lazy view valid during the callback': function () {
+      const p = new expat.Parser(null, { attributes: 'lazy' })
+      const seen = []
+      let kept = null
+      p.on('startElement', function (name, attrs) {
+        attrs.a = 'changed'
+        seen.push([attrs.a, attrs.b, 'b' in attrs, Object.keys(attrs), Object.assign({}, attrs)])
+        kept = attrs
+      })
+      assert.ok(p.parse('<r a="1" b="2"/>', true))
+      assert.deepEqual(seen, [['1', '2', true, ['a', 'b'], { a: '1', b: '2' }]])
+      assert.strictEqual(kept.a, undefined)
+      assert.deepEqual(Object.keys(kept), [])
+    },
+    'lazy in batch mode delivers objects': function () {
+      const p = new expat.Parser(null, { attributes: 'lazy', batch: true })
+      let attrs = null
+      p.on('startElement', function (name, a) {
+        attrs = a
+      })
+      assert.ok(p.parse('<r a="1"/>', true))
+      assert.deepEqual(attrs, { a: '1' })
+    },
+    'rejects unknown modes': function () {
+      assert.throws(function () {
+        return new expat.Parser(null, { attributes: 'map' })
+      }, TypeError)
+    }
+  },
+  'event mask': {
+    'only events with listeners cross into JS': function () {
+      const p = new expat.Parser()
+      const emit = p.parser.emit
+      let emitted = []
+      p.parser.emit = function (event) {
+        emitted.push(event)
+        return emit.apply(this, arguments)
+      }
+      function onComment () {}
+      p.on('startElement', function () {})
+      assert.ok(p.parse('<r><!--a--><?pi x?>t'))
+      assert.deepEqual(emitted, ['startElement'])
+
+      emitted = []
+      p.on('comment', onComment)
+      assert.ok(p.parse('<!--b-->'))
+      assert.deepEqual(emitted, ['comment'])
+
+      emitted = []
+      p.removeListener('comment', onComment)
+      assert.ok(p.parse('<!--c--><a/></r>', true))
+      assert.deepEqual(emitted, ['startElement'])
+    },
+    'survives removeAllListeners()': function () {
+      const p = new expat.Parser()
+      const names = []
+      p.on('startElement', function () {})
+      p.removeAllListeners()
+      p.on('endElement', function (name) {
+        names.push(name)
+      })
+      assert.ok(p.parse('<r><a/></r>', true))
+      assert.deepEqual(names, ['a', 'r'])
+    }
+  },
+  'name cache': {
+    'evicts least recently used names': function () {
+      const p = new expat.Parser(null, { nameCacheSize: 2 })
+      const names = []
+      p.on('startElement', function (name, attrs) {
+        names.push(name + Object.keys(attrs).join(''))
+      })
+      p.on('endElement', function (name) {
+        names.push('/' + name)
+      })
+      assert.ok(p.parse('<a><b c="1"><d/><a e="2"/></b><b/></a>', true))
+      assert.equal(names.join(' '), 'a bc d /d ae /a /b b /b /a')
+    },
+    disabled: function () {
+      expectWithParserAndStep('<r><a>b</a></r>', [
+        ['startElement', 'r', {}],
+        ['startElement', 'a', {}],
+        ['text', 'b'],
+        ['endElement', 'a'],
+        ['endElement', 'r']
+      ], new expat.Parser(null, { nameCacheSize: 0 }), 3)
+    }
+  },
+  'zero copy': {
+    'same events as copying parser': function () {
+      const doc = fs.readFileSync(path.join(__dirname, 'mystic-library.xml'))
+      function parse (options) {
+        const p = new expat.Parser('UTF-8', options)
+        const evs = []
+        p.on('startElement', function (name, attrs) {
+          evs.push(['startElement', name, attrs])
+        })
+        p.on('endElement', function (name) {
+          evs.push(['endElement', name])
+        })
+        p.on('text', function (s) {
+          evs.push(['text', s])
+        })
+        for (let i = 0; i < doc.length; i += 1000) {
+          // A fresh Buffer per chunk, like a stream would deliver
+          assert.ok(p.parse(Buffer.from(doc.subarray(i, i + 1000)), i + 1000 >= doc.length))
+        }
+        return { evs: collapseTexts(evs), stats: p.getStats() }
+      }
+      const copying = parse({})
+      const zeroCopy = parse({ zeroCopy: true })
+      assert.deepEqual(zeroCopy.evs, copying.evs)
+      assert.equal(copying.stats.bytesCopied, doc.length)
+      assert.ok(zeroCopy.stats.bytesCopied < doc.length / 10)
+    }
+  },
+  'plain data runs': {
+    'markup and non-ASCII characters at every offset': function () {
+      const cases = [['&amp;', '&'], ['\r\n', '\n'], ['\r', '\n'], ['\t', '\t'],
+        [']', ']'], [']]', ']]'], ['é', 'é'], ['€', '€'], ['\ud834\udd1e', '\ud834\udd1e']]
+      cases.forEach(function (c) {
+        for (let i = 0; i < 40; i++) {
+          const before = 'x'.repeat(i)
+          const after = 'y'.repeat(40 - i)
+          const s = Buffer.from('<r>' + before + c[0] + after + '</r>')
+          const evs = [['startElement', 'r', {}], ['text', before + c[1] + after], ['endElement', 'r']]
+          expectWithParserAndStep(s, evs, new expat.Parser(), s.length)
+          expectWithParserAndStep(s, evs, new expat.Parser(), 1)
+        }
+      })
+    },
+    'attribute values at every offset': function () {
+      const cases = [['&amp;', '&'], [' ', ' '], ['\t', ' '], ['\n', ' '], ['"', '"'], ['é', 'é']]
+      cases.forEach(function (c) {
+        for (let i = 0; i < 40; i++) {
+          const before = 'x'.repeat(i)
+          const after = 'y'.repeat(40 - i)
+          const s = Buffer.from("<r a='" + before + c[0] + after + "'/>")
+          const evs = [['startElement', 'r', { a: before + c[1] + after }], ['endElement', 'r']]
+          expectWithParserAndStep(s, evs, new expat.Parser(), s.length)
+          expectWithParserAndStep(s, evs, new expat.Parser(), 1)
+        }
+      })
+    },
+    'invalid UTF-8 at every offset': function () {
+      const sequences = [[0xc0, 0x80], [0xe0, 0x9f, 0xbf], [0xed, 0xa0, 0x80], [0xef, 0xbf, 0xbe],
+        [0xf4, 0x90, 0x80, 0x80], [0xf5, 0x80, 0x80, 0x80], [0xe6, 0x97], [0x80], [0xff]]
+      sequences.forEach(function (seq) {
+        for (let i = 0; i < 40; i++) {
+          const s = Buffer.concat([Buffer.from('<r>' + '日本語'.repeat(i % 4) + 'x'.repeat(i)),
+            Buffer.from(seq), Buffer.from('日本語'.repeat(10) + '</r>')])
+          const whole = new expat.Parser()
+          assert.equal(whole.parse(s), false)
+          const bytes = new expat.Parser()
+          let j = 0
+          while (j < s.length && bytes.parse(s.slice(j, j + 1))) j++
+          assert.equal(bytes.getError(), whole.getError())
+          assert.equal(bytes.getCurrentByteIndex(), whole.getCurrentByteIndex())
+        }
+      })
+    },
+    'Latin-1 text': function () {
+      const text = 'caf\u00e9 \u0080\u00ff '.repeat(10)
+      const s = Buffer.from('<r>' + text + '</r>', 'latin1')
+      const evs = [['startElement', 'r', {}], ['text', text], ['endElement', 'r']]
+      expectWithParserAndStep(s, evs, new expat.Parser('ISO-8859-1'), s.length)
+      expectWithParserAndStep(s, evs, new expat.Parser('ISO-8859-1'), 1)
+    },
+    'errors at the same position': function () {
+      const docs = ['<r>' + 'x'.repeat(37) + ']]>' + 'y'.repeat(20) + '</r>',
+        '<r>' + 'x'.repeat(37) + '\u0001' + 'y'.repeat(20) + '</r>',
+        '<r a="' + 'x'.repeat(37) + '<' + 'y'.repeat(20) + '"/>',
+        Buffer.concat([Buffer.from('<r>' + 'x'.repeat(37)), Buffer.from([0xc3, 0x28]), Buffer.from('y'.repeat(20) + '</r>')])]
+      docs.forEach(function (s) {
+        const whole = new expat.Parser()
+        assert.equal(whole.parse(s), false)
+        const bytes = new expat.Parser()
+        const buf = Buffer.from(s)
+        let i = 0
+        while (i < buf.length && bytes.parse(buf.slice(i, i + 1))) i++
+        assert.equal(bytes.getError(), whole.getError())
+        assert.equal(bytes.getCurrentColumnNumber(), whole.getCurrentColumnNumber())
+        assert.equal(bytes.getCurrentByteIndex(), whole.getCurrentByteIndex())
+      })
+    }
+  },
   error: {
     'tag name starting with ampersand': function () {
       expect('<&', [['error', 'not well-formed (invalid token)']])
@@ -379,6 +824,511 @@ vows.describe('node-expat').addBatch({
       assert.equal(p.getCurrentByteIndex(), 2)
     }
   },
+  parseAsync: {
+    'chunks of a file': {
+      topic: function () {
+        const doc = fs.readFileSync(path.join(__dirname, 'mystic-library.xml'))
+        function record (p) {
+          const evs = []
+          p.on('startElement', function (name, attrs) {
+            evs.push(['startElement', name, attrs])
+          })
+          p.on('endElement', function (name) {
+            evs.push(['endElement', name])
+          })
+          p.on('text', function (s) {
+            evs.push(['text', s])
+          })
+          return evs
+        }
+        const sync = new expat.Parser('UTF-8')
+        this.expected = record(sync)
+        sync.parse(doc, true)
+
+        const p = new expat.Parser('UTF-8')
+        this.received = record(p)
+        const results = []
+        for (let i = 0; i < doc.length; i += 4096) {
+          results.push(p.parseAsync(doc.subarray(i, i + 4096), i + 4096 >= doc.length))
+        }
+        Promise.all(results).then(function (results) {
+          this.callback(null, results)
+        }.bind(this), this.callback)
+      },
+      'all chunks parsed': function (results) {
+        assert.ok(results.length > 1)
+        results.forEach(function (result) {
+          assert.strictEqual(result, true)
+        })
+      },
+      'same events in order': function () {
+        assert.deepEqual(collapseTexts(this.received), collapseTexts(this.expected))
+      }
+    },
+    'sync calls while busy': function () {
+      const p = new expat.Parser()
+      p.parseAsync('<r/>', true)
+      assert.throws(function () {
+        p.parse('<r/>')
+      }, /busy/)
+      // expat updates its position while answering these
+      assert.throws(function () {
+        p.getCurrentLineNumber()
+      }, /busy/)
+      assert.throws(function () {
+        p.getStats()
+      }, /busy/)
+    },
+    'listeners added while busy': {
+      topic: function () {
+        const p = new expat.Parser()
+        const comments = []
+        p.on('startElement', function () {})
+        const first = p.parseAsync('<r><!--a-->')
+        // The running chunk keeps the events it started with
+        p.on('comment', function (c) {
+          comments.push(c)
+        })
+        first.then(function () {
+          return p.parseAsync('<!--b--></r>', true)
+        }).then(function (result) {
+          this.callback(null, { result, comments })
+        }.bind(this), this.callback)
+      },
+      'apply to the next chunk': function (r) {
+        assert.strictEqual(r.result, true)
+        assert.deepEqual(r.comments, ['b'])
+      }
+    }
+  },
+  parseParallel: {
+    'slices of a file': {
+      topic: function () {
+        const doc = fs.readFileSync(path.join(__dirname, 'mystic-library.xml'))
+        const self = this
+        this.single = new expat.Parser('UTF-8')
+        this.expected = recordAll(this.single, function (p) {
+          return p.parse(doc, true)
+        })
+        const p = new expat.Parser('UTF-8')
+        this.parser = p
+        this.received = recordAll(p, function (p) {
+          return p.parseParallel(doc, { threads: 4, minSliceSize: 1024 })
+        })
+        this.received.result.then(function (result) {
+          self.callback(null, result)
+        }, this.callback)
+      },
+      'parsed in slices': function (result) {
+        assert.strictEqual(result, true)
+        assert.equal(this.parser.getStats().parallelSlices, 4)
+      },
+      'same events in order': function () {
+        assert.deepEqual(this.received.events, this.expected.events)
+      },
+      'finishes the parser': function () {
+        const p = this.parser
+        assert.equal(p.getCurrentLineNumber(), this.single.getCurrentLineNumber())
+        assert.equal(p.getCurrentColumnNumber(), this.single.getCurrentColumnNumber())
+        assert.equal(p.getCurrentByteIndex(), this.single.getCurrentByteIndex())
+        assert.strictEqual(p.parse('<x/>'), false)
+        assert.equal(p.getError(), 'parsing finished')
+        p.reset()
+        assert.strictEqual(p.parse('<x/>', true), true)
+        assert.equal(p.getCurrentByteIndex(), 4)
+      }
+    },
+    namespaces: {
+      topic: function () {
+        let doc = '<?xml version="1.0"?><r xmlns="urn:r" xmlns:p="urn:p">'
+        for (let i = 0; i < 200; i++) {
+          doc += '<p:a n="' + i + '" p:b="x>y"><b xmlns:q="urn:q" q:c="1"><!--<c>-->t' + i + '<![CDATA[<d>]]></b></p:a>\n'
+        }
+        doc += '</r>'
+        const self = this
+        this.expected = recordAll(new expat.Parser(null, { namespaces: true }), function (p) {
+          return p.parse(doc, true)
+        })
+        this.parser = new expat.Parser(null, { namespaces: true })
+        this.received = recordAll(this.parser, function (p) {
+          return p.parseParallel(doc, { threads: 8, minSliceSize: 512 })
+        })
+        this.received.result.then(function (result) {
+          self.callback(null, result)
+        }, this.callback)
+      },
+      'parsed in slices': function (result) {
+        assert.strictEqual(result, true)
+        assert.ok(this.parser.getStats().parallelSlices > 1)
+      },
+      'same events in order': function () {
+        assert.deepEqual(this.received.events, this.expected.events)
+      }
+    },
+    'falls back': {
+      topic: function () {
+        const body = '<a>x</a>'.repeat(200)
+        const docs = [
+          // DOCTYPE
+          '<!DOCTYPE r [<!ENTITY e "ent">]><r>' + body + '&e;</r>',
+          // unfinished
+          '<r>' + body,
+          // error in a later slice
+          '<r>' + body + '<b></c>' + body + '</r>'
+        ]
+        const self = this
+        Promise.all(docs.map(function (doc) {
+          const expected = recordAll(new expat.Parser(), function (p) {
+            return p.parse(doc, true)
+          })
+          const p = new expat.Parser()
+          const received = recordAll(p, function (p) {
+            return p.parseParallel(doc, { threads: 4, minSliceSize: 64 })
+          })
+          return received.result.then(function (result) {
+            return { expected, received, result, slices: p.getStats().parallelSlices, error: p.getError() }
+          })
+        })).then(function (results) {
+          self.callback(null, results)
+        }, this.callback)
+      },
+      'like one parser': function (results) {
+        results.forEach(function (r) {
+          assert.equal(r.slices, 1)
+          assert.strictEqual(r.result, r.expected.result)
+          assert.deepEqual(r.received.events, r.expected.events)
+        })
+        assert.equal(results[1].error, 'no element found')
+        assert.equal(results[2].error, 'mismatched tag')
+      }
+    }
+  },
+  parseRecords: {
+    'in document order': {
+      topic: function () {
+        let doc = '<?xml version="1.0"?><root xmlns:x="urn:x"><header>h</header>\n'
+        for (let i = 0; i < 20000; i++) {
+          doc += '<item id="' + i + '"><x:name xmlns:y="urn:y">n' + i + '</x:name><!--c--><item>nested</item></item>\n'
+        }
+        doc += '</root>'
+        const self = this
+        // what one parser sees from the first record up to </root>
+        const all = recordAll(new expat.Parser(null, { namespaces: true }), function (p) {
+          return p.parse(doc, true)
+        }).events
+        const first = all.findIndex(function (ev) {
+          return ev[0] === 'startElement' && ev[1] === 'item'
+        })
+        this.expected = all.slice(first, all.length - 2).filter(function (ev) {
+          return ev[0] !== 'text' || ev[1] !== '\n'
+        })
+        this.received = recordAll(new expat.Parser(null, { namespaces: true }), function (p) {
+          return p.parseRecords(doc, 'item', { threads: 4 })
+        })
+        this.received.result.then(function (records) {
+          self.callback(null, records)
+        }, this.callback)
+      },
+      'counts the records': function (records) {
+        assert.strictEqual(records, 20000)
+      },
+      'same events as one parser': function () {
+        assert.deepEqual(this.received.events, this.expected)
+      }
+    },
+    unordered: {
+      topic: function () {
+        let doc = '<root><skip><item id="-1"/></skip>'
+        for (let i = 0; i < 20000; i++) {
+          doc += '<item id="' + i + '">' + 'x'.repeat(i % 50) + '</item>'
+        }
+        doc += '</root>'
+        const ids = []
+        const self = this
+        const p = new expat.Parser()
+        p.on('startElement', function (name, attrs) {
+          ids.push(Number(attrs.id))
+        })
+        p.parseRecords(doc, 'item', { threads: 4, ordered: false }).then(function (records) {
+          self.callback(null, { records, ids })
+        }, this.callback)
+      },
+      'every record once': function (r) {
+        assert.strictEqual(r.records, 20001)
+        r.ids.sort(function (a, b) { return a - b })
+        assert.deepEqual(r.ids, Array.from({ length: 20001 }, function (v, i) {
+          return i - 1
+        }))
+      }
+    },
+    errors: {
+      topic: function () {
+        const docs = [
+          '<root><item>x</item><item><a></item></root>',
+          '<root>&bogus;<item/></root>',
+          '<root><item/></root><item/>',
+          '<!DOCTYPE root><root><item/></root>'
+        ]
+        const self = this
+        Promise.all(docs.map(function (doc) {
+          return new expat.Parser().parseRecords(doc, 'item').then(function () {
+            return null
+          }, function (e) {
+            return e.message
+          })
+        })).then(function (messages) {
+          self.callback(null, messages)
+        }, this.callback)
+      },
+      'rejected with a position': function (messages) {
+        assert.equal(messages[0], 'mismatched tag at byte 31')
+        assert.equal(messages[1], 'undefined entity at byte 6')
+        assert.equal(messages[2], 'junk after document element at byte 20')
+        assert.ok(/document type declarations/.test(messages[3]))
+      }
+    }
+  },
+  select: {
+    'child steps': function () {
+      expectWithParserAndStep('<stream><message><body>hi</body><x><body>no</body></x></message><iq><body>iq</body></iq></stream>', [
+        ['startElement', 'body', {}],
+        ['text', 'hi'],
+        ['endElement', 'body']
+      ], new expat.Parser(null, { select: '/stream/message/body' }), 7)
+    },
+    'descendant steps and predicates': function () {
+      expectWithParserAndStep('<r><a t="1"><b>x</b></a><c><a t="2"><b>y</b><!--z--></a></c></r>', [
+        ['startElement', 'a', { t: '2' }],
+        ['startElement', 'b', {}],
+        ['text', 'y'],
+        ['endElement', 'b'],
+        ['comment', 'z'],
+        ['endElement', 'a']
+      ], new expat.Parser(null, { select: ['//a[@t="2"]', '/r/x'], batch: true }), 5)
+    },
+    'text only': function () {
+      expectWithParserAndStep('<r><a>x<b>y</b></a><a>z</a></r>', [
+        ['text', 'xyz']
+      ], new expat.Parser(null, { select: '/r/a/text()' }), 3)
+    },
+    'invalid selector': function () {
+      assert.throws(function () {
+        return new expat.Parser(null, { select: 'r/a' })
+      }, /must start with/)
+      assert.throws(function () {
+        return new expat.Parser(null, { select: '/r/a[@x="1]' })
+      }, /not terminated/)
+    }
+  },
+  parseToObject: {
+    'attributes, text and repeated children': function () {
+      assert.deepEqual(expat.parseToObject('<r id="1"><a>x</a><a>y</a>\n<b c="2">z</b><c/></r>'), {
+        r: { '@id': '1', a: ['x', 'y'], b: { '@c': '2', '#text': 'z' }, c: '' }
+      })
+    },
+    'mixed content': function () {
+      assert.deepEqual(expat.parseToObject(Buffer.from('<r>x<a/>y</r>')), {
+        r: { a: '', '#text': 'xy' }
+      })
+    },
+    options: function () {
+      assert.deepEqual(expat.parseToObject('<r id="1"><a>x</a>t</r>', {
+        attrPrefix: '$',
+        textKey: '_',
+        alwaysArray: true
+      }), {
+        r: { $id: '1', a: ['x'], _: 't' }
+      })
+    },
+    'parse error': function () {
+      assert.throws(function () {
+        expat.parseToObject('<r><a></r>')
+      }, /mismatched tag at line 1/)
+    }
+  },
+  parseDocuments: {
+    events: {
+      topic: function () {
+        const docs = []
+        for (let i = 0; i < 200; i++) {
+          docs.push(i === 7 ? '<d n="7"><e></d>' : i === 8 ? '' : '<d n="' + i + '">t<e/></d>')
+        }
+        expat.parseDocuments(docs, { threads: 3 }).then(this.callback.bind(this, null), this.callback)
+      },
+      'one result per document, in order': function (results) {
+        assert.equal(results.length, 200)
+        assert.deepEqual(results[0].events, [
+          'startElement', 'd', { n: '0' },
+          'text', 't',
+          'startElement', 'e', {},
+          'endElement', 'e',
+          'endElement', 'd'
+        ])
+        results.forEach(function (result, i) {
+          if (i !== 7 && i !== 8) {
+            assert.equal(result.events[2].n, String(i))
+          }
+        })
+      },
+      'errors per document': function (results) {
+        assert.equal(results[7].error, 'mismatched tag at byte 14')
+        assert.equal(results[7].events, undefined)
+        assert.equal(results[8].error, 'no element found at byte 0')
+      }
+    },
+    'namespaces and array attributes': {
+      topic: function () {
+        expat.parseDocuments([Buffer.from('<p:r xmlns:p="urn:p" p:a="1"/>')], {
+          namespaces: true,
+          attributes: 'array'
+        }).then(this.callback.bind(this, null), this.callback)
+      },
+      'like batch mode': function (results) {
+        assert.deepEqual(results[0].events, [
+          'startNamespaceDecl', 'p', 'urn:p',
+          'startElement', 'r', ['a', '1'], 'urn:p',
+          'endElement', 'r', 'urn:p',
+          'endNamespaceDecl', 'p'
+        ])
+      }
+    },
+    'entity declarations': {
+      topic: function () {
+        const doc = '<!DOCTYPE r [<!ENTITY e "x">]><r>&e;</r>'
+        this.expected = recordAll(new expat.Parser(), function (p) {
+          return p.parse(doc, true)
+        }).events
+        expat.parseDocuments([doc]).then(this.callback.bind(this, null), this.callback)
+      },
+      'like a Parser': function (results) {
+        assert.equal(this.expected[0][0], 'entityDecl')
+        assert.deepEqual(results[0].events, [].concat.apply([], this.expected))
+      }
+    },
+    trees: {
+      topic: function () {
+        expat.parseDocuments([
+          '<r id="1"><a>x</a><a>y</a>\n<b c="2">z</b><c/></r>',
+          '<r>x<a/>y</r>',
+          '<r><a></r>'
+        ], { output: 'tree' }).then(this.callback.bind(this, null), this.callback)
+      },
+      'like parseToObject': function (results) {
+        assert.deepEqual(results[0].tree, expat.parseToObject('<r id="1"><a>x</a><a>y</a>\n<b c="2">z</b><c/></r>'))
+        assert.deepEqual(results[1].tree, { r: { a: '', '#text': 'xy' } })
+        assert.equal(results[2].error, 'mismatched tag at byte 8')
+      }
+    }
+  },
+  parseFile: {
+    'batches of a file': {
+      topic: function () {
+        const file = path.join(__dirname, 'mystic-library.xml')
+        const self = this
+        this.expected = recordAll(new expat.Parser('UTF-8'), function (p) {
+          return p.parse(fs.readFileSync(file), true)
+        })
+        const p = new expat.Parser('UTF-8')
+        const received = recordAll(p, function (p) {
+          return p.parseFile(file, { batchSize: 4096 })
+        })
+        this.received = received.events
+        received.result.then(function (result) {
+          self.callback(null, result)
+        }, this.callback)
+      },
+      'parsed like a Buffer': function (result) {
+        assert.strictEqual(result, true)
+        assert.deepEqual(collapseTexts(this.received), collapseTexts(this.expected.events))
+      }
+    },
+    'with handlers': {
+      topic: function () {
+        const self = this
+        this.names = []
+        expat.parseFile(path.join(__dirname, 'mystic-library.xml'), {
+          startElement: function (name) {
+            self.names.push(name)
+          }
+        }).then(this.callback.bind(this, null), this.callback)
+      },
+      'calls them': function () {
+        assert.equal(this.names[0], 'MysticLibrary')
+        assert.ok(this.names.length > 1)
+      }
+    },
+    'parse error': {
+      topic: function () {
+        const file = path.join(os.tmpdir(), 'node-expat-parse-file-test.xml')
+        fs.writeFileSync(file, '<r><a></r>')
+        expat.parseFile(file, {}).then(function () {
+          fs.unlinkSync(file)
+          this.callback(null, null)
+        }.bind(this), function (err) {
+          fs.unlinkSync(file)
+          this.callback(null, err)
+        }.bind(this))
+      },
+      'rejects with the message': function (err) {
+        assert.ok(err)
+        assert.equal(err.message, 'mismatched tag')
+      }
+    },
+    'missing file': {
+      topic: function () {
+        expat.parseFile(path.join(__dirname, 'missing.xml'), {}).then(function () {
+          this.callback(null, null)
+        }.bind(this), this.callback.bind(this, null))
+      },
+      'rejects': function (err) {
+        assert.ok(err)
+        assert.ok(err.message.indexOf('missing.xml') !== -1)
+      }
+    }
+  },
+  parseFd: {
+    'a file descriptor': {
+      topic: function () {
+        const file = path.join(__dirname, 'mystic-library.xml')
+        const self = this
+        this.expected = recordAll(new expat.Parser('UTF-8'), function (p) {
+          return p.parse(fs.readFileSync(file), true)
+        })
+        this.received = []
+        const runs = [2, 3, 5].map(function (buffers) {
+          const fd = fs.openSync(file, 'r')
+          const received = recordAll(new expat.Parser('UTF-8'), function (p) {
+            return p.parseFd(fd, { batchSize: 4096, buffers })
+          })
+          self.received.push(received.events)
+          return received.result.then(function (result) {
+            fs.closeSync(fd)
+            return result
+          })
+        })
+        Promise.all(runs).then(this.callback.bind(this, null), this.callback)
+      },
+      'parsed like a Buffer with any number of buffers': function (results) {
+        assert.deepEqual(results, [true, true, true])
+        this.received.forEach(function (events) {
+          assert.deepEqual(collapseTexts(events), collapseTexts(this.expected.events))
+        }, this)
+      }
+    },
+    'bad descriptor': {
+      topic: function () {
+        // Far above any open descriptor, unlike a closed one other
+        // topics might reopen
+        expat.parseFd(1 << 30, {}).then(function () {
+          this.callback(null, null)
+        }.bind(this), this.callback.bind(this, null))
+      },
+      'rejects': function (err) {
+        assert.ok(err)
+        assert.ok(err.message.indexOf('fd ') === 0)
+      }
+    }
+  },
   'Stream interface': {
     'read file': {
       topic: function () {
@@ -420,5 +1370,85 @@ vows.describe('node-expat').addBatch({
         assert.ok(this.closed, 'emit close event')
       }
     }
+  },
+  'ParserStream': {
+    'slow consumer': {
+      topic: function () {
+        const callback = this.callback
+        const file = path.join(__dirname, 'mystic-library.xml')
+        const expected = []
+        const p = new expat.Parser('UTF-8')
+        p.on('startElement', function (name, attrs) {
+          expected.push(['startElement', name, attrs])
+        })
+        p.on('endElement', function (name) {
+          expected.push(['endElement', name])
+        })
+        assert.ok(p.parse(fs.readFileSync(file), true))
+
+        const received = []
+        let maxBuffered = 0
+        const s = new expat.ParserStream('UTF-8', {
+          events: ['startElement', 'endElement'],
+          eventHighWaterMark: 4
+        })
+        const consumer = new Writable({
+          objectMode: true,
+          highWaterMark: 1,
+          write: function (event, encoding, done) {
+            received.push(event)
+            maxBuffered = Math.max(maxBuffered, s.readableLength)
+            setImmediate(done)
+          }
+        })
+        consumer.on('finish', function () {
+          callback(null, { expected, received, maxBuffered })
+        })
+        s.on('error', callback)
+        fs.createReadStream(file, { highWaterMark: 1024 }).pipe(s).pipe(consumer)
+      },
+      'receives the same events': function (result) {
+        assert.ok(result.expected.length > 0)
+        assert.deepEqual(result.received, result.expected)
+      },
+      'suspends the parser': function (result) {
+        assert.ok(result.maxBuffered <= 8, result.maxBuffered + ' events buffered')
+      }
+    },
+    'invalid input': {
+      topic: function () {
+        const callback = this.callback
+        const s = new expat.ParserStream()
+        s.on('error', function (e) {
+          callback(null, e)
+        })
+        s.resume()
+        s.end('<a></b>')
+      },
+      'emits an Error': function (e) {
+        assert.ok(e instanceof Error)
+        assert.equal(e.message, 'mismatched tag')
+      }
+    },
+    'truncated input': {
+      topic: function () {
+        const callback = this.callback
+        const s = new expat.ParserStream()
+        s.on('error', function (e) {
+          callback(null, e)
+        })
+        s.on('end', function () {
+          callback(new Error('ended without an error'))
+        })
+        s.resume()
+        const source = new PassThrough()
+        source.pipe(s)
+        source.end('<r><a>')
+      },
+      'emits an Error': function (e) {
+        assert.ok(e instanceof Error)
+        assert.equal(e.message, 'no element found')
+      }
+    }
   }
 }).export(module)